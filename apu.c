@@ -0,0 +1,568 @@
+#include "apu.h"
+#include <string.h>
+
+/* Mixer weights in sample units per level step, the linear
+   approximation scaled so everything at full volume is ~31000 */
+#define PULSE_WEIGHT    271
+#define TRIANGLE_WEIGHT 306
+#define NOISE_WEIGHT    178
+#define DMC_WEIGHT      121
+
+static const uint8_t length_table[32] = {
+	10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+	12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30,
+};
+
+static const uint8_t duty_table[4][8] = {
+	{0, 1, 0, 0, 0, 0, 0, 0},
+	{0, 1, 1, 0, 0, 0, 0, 0},
+	{0, 1, 1, 1, 1, 0, 0, 0},
+	{1, 0, 0, 1, 1, 1, 1, 1},
+};
+
+static const uint8_t triangle_table[32] = {
+	15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+};
+
+/* NTSC, in CPU cycles */
+static const uint16_t noise_periods[16] = {
+	4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068,
+};
+
+static const uint16_t dmc_periods[16] = {
+	428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54,
+};
+
+/* Frame counter steps from the start of the sequence, the last one
+   wraps around. The 5 step mode's fourth step does nothing, so skip it */
+static const uint32_t frame_steps[2][4] = {
+	{ 7457, 14913, 22371, 29829 },
+	{ 7457, 14913, 22371, 37281 },
+};
+static const uint32_t frame_periods[2] = { 29830, 37282 };
+
+/* Passes a level change on to the mixer as a step at time */
+static void set_level(Apu *apu, int8_t *level, int value, int weight, uint64_t time)
+{
+	if (value == *level)
+		return;
+	add_blip_delta(&apu->blip, time - apu->frame_time, (value - *level) * weight);
+	*level = value;
+}
+
+static int envelope_volume(Envelope *envelope)
+{
+	return envelope->constant ? envelope->volume : envelope->decay;
+}
+
+static void clock_envelope(Envelope *envelope, bool loop)
+{
+	if (envelope->start)
+	{
+		envelope->start = false;
+		envelope->decay = 15;
+		envelope->divider = envelope->volume;
+	}
+	else if (envelope->divider == 0)
+	{
+		envelope->divider = envelope->volume;
+		if (envelope->decay > 0)
+			envelope->decay --;
+		else if (loop)
+			envelope->decay = 15;
+	}
+	else
+	{
+		envelope->divider --;
+	}
+}
+
+/* Pulse 1 negates with one's complement, pulse 2 with two's */
+static int sweep_target(Pulse *pulse, int channel)
+{
+	int change = pulse->period >> (pulse->sweep & 0x07);
+	if (pulse->sweep & 0x08)
+		return pulse->period - change - (channel == 0);
+	return pulse->period + change;
+}
+
+static int pulse_volume(Pulse *pulse, int channel)
+{
+	if (pulse->length == 0 || pulse->period < 8 || sweep_target(pulse, channel) > 0x7FF)
+		return 0;
+	return envelope_volume(&pulse->envelope);
+}
+
+static void clock_sweep(Pulse *pulse, int channel)
+{
+	int target = sweep_target(pulse, channel);
+	bool enabled = (pulse->sweep & 0x80) && (pulse->sweep & 0x07);
+	if (pulse->sweep_divider == 0 && enabled && pulse->period >= 8 && target <= 0x7FF)
+		pulse->period = target;
+
+	if (pulse->sweep_divider == 0 || pulse->sweep_reload)
+	{
+		pulse->sweep_divider = (pulse->sweep >> 4) & 0x07;
+		pulse->sweep_reload = false;
+	}
+	else
+	{
+		pulse->sweep_divider --;
+	}
+}
+
+/* Steps a timer that isn't producing any output past end */
+static void skip_steps(uint64_t *next, uint64_t period, uint64_t end, uint8_t *step, int step_count)
+{
+	if (*next > end)
+		return;
+	uint64_t steps = (end - *next) / period + 1;
+	*next += steps * period;
+	if (step != NULL)
+		*step = (*step + steps) % step_count;
+}
+
+/* Channels: registers only change between catch ups, so the level is
+   brought up to date at from, then follows the timer up to end */
+
+static void run_pulse(Apu *apu, int channel, uint64_t from, uint64_t end)
+{
+	Pulse *pulse = &apu->state.pulse[channel];
+	const uint8_t *duty = duty_table[pulse->duty];
+	uint64_t period = (pulse->period + 1) * 2;
+	int volume = pulse_volume(pulse, channel);
+
+	set_level(apu, &pulse->level, duty[pulse->step] * volume, PULSE_WEIGHT, from);
+	if (volume == 0)
+	{
+		skip_steps(&pulse->next, period, end, &pulse->step, 8);
+		return;
+	}
+
+	for (; pulse->next <= end; pulse->next += period)
+	{
+		pulse->step = (pulse->step + 1) & 0x07;
+		set_level(apu, &pulse->level, duty[pulse->step] * volume, PULSE_WEIGHT, pulse->next);
+	}
+}
+
+/* The ramp stops where it is when either counter runs out. Periods
+   under 2 are ultrasonic and only pop, so those stop it too */
+static void run_triangle(Apu *apu, uint64_t from, uint64_t end)
+{
+	Triangle *triangle = &apu->state.triangle;
+	uint64_t period = triangle->period + 1;
+
+	set_level(apu, &triangle->level, triangle_table[triangle->step], TRIANGLE_WEIGHT, from);
+	if (triangle->length == 0 || triangle->linear == 0 || triangle->period < 2)
+	{
+		skip_steps(&triangle->next, period, end, NULL, 0);
+		return;
+	}
+
+	for (; triangle->next <= end; triangle->next += period)
+	{
+		triangle->step = (triangle->step + 1) & 0x1F;
+		set_level(apu, &triangle->level, triangle_table[triangle->step], TRIANGLE_WEIGHT, triangle->next);
+	}
+}
+
+static void run_noise(Apu *apu, uint64_t from, uint64_t end)
+{
+	Noise *noise = &apu->state.noise;
+	int volume = noise->length > 0 ? envelope_volume(&noise->envelope) : 0;
+	int tap = noise->short_mode ? 6 : 1;
+
+	// Nobody can hear where a silent shift register is, at the highest
+	// rate stepping it would cost more than the rest of the APU together
+	set_level(apu, &noise->level, (noise->shift & 1) ? 0 : volume, NOISE_WEIGHT, from);
+	if (volume == 0)
+	{
+		skip_steps(&noise->next, noise->period, end, NULL, 0);
+		return;
+	}
+
+	for (; noise->next <= end; noise->next += noise->period)
+	{
+		int feedback = (noise->shift ^ (noise->shift >> tap)) & 1;
+		noise->shift = (noise->shift >> 1) | (feedback << 14);
+		set_level(apu, &noise->level, (noise->shift & 1) ? 0 : volume, NOISE_WEIGHT, noise->next);
+	}
+}
+
+static void fetch_dmc_sample(Apu *apu)
+{
+	Dmc *dmc = &apu->state.dmc;
+	if (dmc->buffer_full || dmc->bytes_remaining == 0)
+		return;
+
+	dmc->buffer = peek_cpu_memory(apu->mem, dmc->address);
+	dmc->buffer_full = true;
+	dmc->address = dmc->address == 0xFFFF ? 0x8000 : dmc->address + 1;
+
+	if (--dmc->bytes_remaining == 0)
+	{
+		if (dmc->loop)
+		{
+			dmc->address = dmc->sample_address;
+			dmc->bytes_remaining = dmc->sample_length;
+		}
+		else if (dmc->irq_enabled)
+		{
+			apu->state.irqs |= APU_DMC_IRQ;
+			set_irq(apu->cpu, IRQ_DMC, true);
+		}
+	}
+}
+
+static void run_dmc(Apu *apu, uint64_t from, uint64_t end)
+{
+	Dmc *dmc = &apu->state.dmc;
+
+	set_level(apu, &dmc->level, dmc->output, DMC_WEIGHT, from);
+	for (; dmc->next <= end; dmc->next += dmc->period)
+	{
+		if (!dmc->silence)
+		{
+			if ((dmc->shift & 1) && dmc->output <= 125)
+				dmc->output += 2;
+			else if (!(dmc->shift & 1) && dmc->output >= 2)
+				dmc->output -= 2;
+			set_level(apu, &dmc->level, dmc->output, DMC_WEIGHT, dmc->next);
+		}
+		dmc->shift >>= 1;
+
+		// Shift register empty, start over with the sample buffer
+		if (--dmc->bits == 0)
+		{
+			dmc->bits = 8;
+			dmc->silence = !dmc->buffer_full;
+			dmc->shift = dmc->buffer;
+			dmc->buffer_full = false;
+			fetch_dmc_sample(apu);
+		}
+	}
+}
+
+void apu_catch_up(Apu *apu, uint64_t time)
+{
+	uint64_t from = apu->state.time;
+	if (time <= from)
+		return;
+
+	run_pulse(apu, 0, from, time);
+	run_pulse(apu, 1, from, time);
+	run_triangle(apu, from, time);
+	run_noise(apu, from, time);
+	run_dmc(apu, from, time);
+	apu->state.time = time;
+}
+
+/* Sample bytes are fetched lazily as the DMC catches up, the only thing
+   that has to be on time is the IRQ after the last one. Fetches happen
+   as the shift register empties, every 8 output bits, and the buffer
+   is always full while bytes remain */
+static void schedule_dmc(Apu *apu)
+{
+	Dmc *dmc = &apu->state.dmc;
+	if (dmc->bytes_remaining > 0 && dmc->irq_enabled && !dmc->loop)
+	{
+		uint64_t bits = dmc->bits - 1 + (uint64_t) (dmc->bytes_remaining - 1) * 8;
+		schedule_event(&apu->cpu->scheduler, apu->dmc_event, dmc->next + bits * dmc->period);
+	}
+	else
+	{
+		cancel_event(&apu->cpu->scheduler, apu->dmc_event);
+	}
+}
+
+static void dmc_event(void *context, uint64_t time)
+{
+	Apu *apu = context;
+	apu_catch_up(apu, time);
+	schedule_dmc(apu);
+}
+
+/* Envelopes and the triangle's linear counter */
+static void clock_quarter_frame(ApuState *state)
+{
+	clock_envelope(&state->pulse[0].envelope, state->pulse[0].halt);
+	clock_envelope(&state->pulse[1].envelope, state->pulse[1].halt);
+	clock_envelope(&state->noise.envelope, state->noise.halt);
+
+	Triangle *triangle = &state->triangle;
+	if (triangle->linear_reload)
+		triangle->linear = triangle->linear_period;
+	else if (triangle->linear > 0)
+		triangle->linear --;
+	if (!triangle->control)
+		triangle->linear_reload = false;
+}
+
+/* Length counters and sweeps */
+static void clock_half_frame(ApuState *state)
+{
+	for (int i = 0; i < 2; i++)
+	{
+		Pulse *pulse = &state->pulse[i];
+		if (!pulse->halt && pulse->length > 0)
+			pulse->length --;
+		clock_sweep(pulse, i);
+	}
+	if (!state->triangle.control && state->triangle.length > 0)
+		state->triangle.length --;
+	if (!state->noise.halt && state->noise.length > 0)
+		state->noise.length --;
+}
+
+static void schedule_frame_step(Apu *apu)
+{
+	ApuState *state = &apu->state;
+	schedule_event(&apu->cpu->scheduler, apu->frame_event,
+		state->frame_start + frame_steps[state->five_step][state->frame_step]);
+}
+
+static void frame_event(void *context, uint64_t time)
+{
+	Apu *apu = context;
+	ApuState *state = &apu->state;
+	apu_catch_up(apu, time);
+
+	clock_quarter_frame(state);
+	if (state->frame_step & 1)
+		clock_half_frame(state);
+
+	if (state->frame_step == 3)
+	{
+		if (!state->five_step && !state->irq_inhibit)
+		{
+			state->irqs |= APU_FRAME_IRQ;
+			set_irq(apu->cpu, IRQ_FRAME, true);
+		}
+		state->frame_step = 0;
+		state->frame_start += frame_periods[state->five_step];
+	}
+	else
+	{
+		state->frame_step ++;
+	}
+	schedule_frame_step(apu);
+}
+
+uint8_t read_apu_status(Apu *apu)
+{
+	ApuState *state = &apu->state;
+	apu_catch_up(apu, cpu_time(apu->cpu));
+
+	uint8_t value = state->irqs;
+	value |= state->pulse[0].length > 0 ? APU_PULSE_1 : 0;
+	value |= state->pulse[1].length > 0 ? APU_PULSE_2 : 0;
+	value |= state->triangle.length > 0 ? APU_TRIANGLE : 0;
+	value |= state->noise.length > 0 ? APU_NOISE : 0;
+	value |= state->dmc.bytes_remaining > 0 ? APU_DMC : 0;
+
+	state->irqs &= ~APU_FRAME_IRQ;
+	set_irq(apu->cpu, IRQ_FRAME, false);
+	return value;
+}
+
+static void write_pulse(ApuState *state, int channel, int reg, uint8_t byte)
+{
+	Pulse *pulse = &state->pulse[channel];
+	switch (reg)
+	{
+		case 0:
+			pulse->duty = byte >> 6;
+			pulse->halt = byte & 0x20;
+			pulse->envelope.constant = byte & 0x10;
+			pulse->envelope.volume = byte & 0x0F;
+			break;
+
+		case 1:
+			pulse->sweep = byte;
+			pulse->sweep_reload = true;
+			break;
+
+		case 2:
+			pulse->period = (pulse->period & 0x700) | byte;
+			break;
+
+		case 3:
+			pulse->period = (pulse->period & 0xFF) | ((byte & 0x07) << 8);
+			if (state->enabled & (APU_PULSE_1 << channel))
+				pulse->length = length_table[byte >> 3];
+			pulse->step = 0;
+			pulse->envelope.start = true;
+			break;
+	}
+}
+
+void write_apu_register(Apu *apu, uint16_t addr, uint8_t byte)
+{
+	ApuState *state = &apu->state;
+	uint64_t now = cpu_time(apu->cpu);
+	apu_catch_up(apu, now);
+
+	switch (addr)
+	{
+		case 0x4000: case 0x4001: case 0x4002: case 0x4003:
+		case 0x4004: case 0x4005: case 0x4006: case 0x4007:
+			write_pulse(state, (addr >> 2) & 1, addr & 0x03, byte);
+			break;
+
+		case 0x4008:
+			state->triangle.control = byte & 0x80;
+			state->triangle.linear_period = byte & 0x7F;
+			break;
+
+		case 0x400A:
+			state->triangle.period = (state->triangle.period & 0x700) | byte;
+			break;
+
+		case 0x400B:
+			state->triangle.period = (state->triangle.period & 0xFF) | ((byte & 0x07) << 8);
+			if (state->enabled & APU_TRIANGLE)
+				state->triangle.length = length_table[byte >> 3];
+			state->triangle.linear_reload = true;
+			break;
+
+		case 0x400C:
+			state->noise.halt = byte & 0x20;
+			state->noise.envelope.constant = byte & 0x10;
+			state->noise.envelope.volume = byte & 0x0F;
+			break;
+
+		case 0x400E:
+			state->noise.short_mode = byte & 0x80;
+			state->noise.period = noise_periods[byte & 0x0F];
+			break;
+
+		case 0x400F:
+			if (state->enabled & APU_NOISE)
+				state->noise.length = length_table[byte >> 3];
+			state->noise.envelope.start = true;
+			break;
+
+		case 0x4010:
+			state->dmc.irq_enabled = byte & 0x80;
+			state->dmc.loop = byte & 0x40;
+			state->dmc.period = dmc_periods[byte & 0x0F];
+			if (!state->dmc.irq_enabled)
+			{
+				state->irqs &= ~APU_DMC_IRQ;
+				set_irq(apu->cpu, IRQ_DMC, false);
+			}
+			schedule_dmc(apu);
+			reschedule_cpu(apu->cpu);
+			break;
+
+		case 0x4011:
+			state->dmc.output = byte & 0x7F;
+			break;
+
+		case 0x4012:
+			state->dmc.sample_address = 0xC000 + byte * 64;
+			break;
+
+		case 0x4013:
+			state->dmc.sample_length = byte * 16 + 1;
+			break;
+
+		case 0x4015:
+			// Acknowledges the DMC IRQ, a one byte sample can raise it again right away
+			state->irqs &= ~APU_DMC_IRQ;
+			set_irq(apu->cpu, IRQ_DMC, false);
+
+			state->enabled = byte & 0x1F;
+			if (!(byte & APU_PULSE_1)) state->pulse[0].length = 0;
+			if (!(byte & APU_PULSE_2)) state->pulse[1].length = 0;
+			if (!(byte & APU_TRIANGLE)) state->triangle.length = 0;
+			if (!(byte & APU_NOISE)) state->noise.length = 0;
+
+			if (!(byte & APU_DMC))
+			{
+				state->dmc.bytes_remaining = 0;
+			}
+			else if (state->dmc.bytes_remaining == 0)
+			{
+				state->dmc.address = state->dmc.sample_address;
+				state->dmc.bytes_remaining = state->dmc.sample_length;
+				fetch_dmc_sample(apu);
+			}
+			schedule_dmc(apu);
+			reschedule_cpu(apu->cpu);
+			break;
+
+		case 0x4017:
+			state->five_step = byte & 0x80;
+			state->irq_inhibit = byte & 0x40;
+			if (state->irq_inhibit)
+			{
+				state->irqs &= ~APU_FRAME_IRQ;
+				set_irq(apu->cpu, IRQ_FRAME, false);
+			}
+
+			// The sequence restarts, the 5 step mode clocks everything right away
+			state->frame_step = 0;
+			state->frame_start = now;
+			if (state->five_step)
+			{
+				clock_quarter_frame(state);
+				clock_half_frame(state);
+			}
+			schedule_frame_step(apu);
+			reschedule_cpu(apu->cpu);
+			break;
+	}
+}
+
+void end_apu_frame(Apu *apu, uint64_t time)
+{
+	apu_catch_up(apu, time);
+	apu->sample_count = end_blip_frame(&apu->blip, time - apu->frame_time, apu->samples);
+	apu->frame_time = time;
+}
+
+void refresh_apu(Apu *apu)
+{
+	apu->frame_time = apu->state.time;
+	set_irq(apu->cpu, IRQ_FRAME, apu->state.irqs & APU_FRAME_IRQ);
+	set_irq(apu->cpu, IRQ_DMC, apu->state.irqs & APU_DMC_IRQ);
+}
+
+bool set_apu_sample_rate(Apu *apu, int sample_rate)
+{
+	return init_blip(&apu->blip, APU_CLOCK_RATE, sample_rate);
+}
+
+bool init_apu(Apu *apu, Cpu *cpu, SharedMemory *mem, int sample_rate)
+{
+	memset(apu, 0, sizeof(Apu));
+	apu->cpu = cpu;
+	apu->mem = mem;
+	if (!set_apu_sample_rate(apu, sample_rate))
+		return false;
+
+	ApuState *state = &apu->state;
+	uint64_t now = cpu_time(cpu);
+	state->time = now;
+	state->frame_start = now;
+	apu->frame_time = now;
+
+	state->pulse[0].next = now + 2;
+	state->pulse[1].next = now + 2;
+	state->triangle.next = now + 1;
+	state->noise.shift = 1;
+	state->noise.period = noise_periods[0];
+	state->noise.next = now + state->noise.period;
+	state->dmc.period = dmc_periods[0];
+	state->dmc.bits = 8;
+	state->dmc.silence = true;
+	state->dmc.next = now + state->dmc.period;
+
+	apu->frame_event = add_event(&cpu->scheduler, &frame_event, apu);
+	apu->dmc_event = add_event(&cpu->scheduler, &dmc_event, apu);
+	schedule_frame_step(apu);
+	return true;
+}
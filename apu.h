@@ -0,0 +1,164 @@
+/*
+
+2A03 audio processing unit
+
+- Two pulses, triangle, noise and DMC, the frame counter and the
+  $4000-$4017 registers
+- Nothing is clocked per cycle: each channel jumps from one timer
+  expiry to the next, and only changes of its output level are passed
+  on, as timestamped steps into a band-limited buffer (blip.h)
+- Catches up lazily like the PPU, when a register is touched and on
+  its own events: frame counter steps, and the DMC fetching the last
+  byte of a sample so its IRQ is on time
+- Mixing to 16 bit samples happens once per frame in end_apu_frame()
+- Channels are mixed linearly, with the usual approximation of the
+  console's non-linear mixer
+
+Not emulated: DMC fetches stealing CPU cycles (they also read memory a
+little late, when the DMC catches up), the few cycles of delay
+before $4017 writes take effect, sweep and length counter edge cases on
+the same cycle as a frame counter step.
+
+*/
+#ifndef APU_H_
+#define APU_H_
+
+#include "blip.h"
+#include "cpu.h"
+#include "shared_mem.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define APU_CLOCK_RATE          1789773 // NTSC CPU cycles per second
+#define APU_DEFAULT_SAMPLE_RATE 48000
+
+/* $4015 */
+#define APU_PULSE_1   0x01
+#define APU_PULSE_2   0x02
+#define APU_TRIANGLE  0x04
+#define APU_NOISE     0x08
+#define APU_DMC       0x10
+#define APU_FRAME_IRQ 0x40
+#define APU_DMC_IRQ   0x80
+
+typedef struct envelope {
+	uint8_t volume; // Constant volume, or the decay period
+	bool constant;
+	bool start;
+	uint8_t divider;
+	uint8_t decay;
+} Envelope;
+
+typedef struct pulse {
+	uint8_t duty;
+	uint8_t step;    // Position in the 8 step duty cycle
+	uint16_t period; // 11 bit timer reload
+	uint8_t length;
+	bool halt;       // Length counter halt, also loops the envelope
+	Envelope envelope;
+
+	uint8_t sweep;   // $4001 as written
+	uint8_t sweep_divider;
+	bool sweep_reload;
+
+	uint64_t next;   // CPU cycle of the next step
+	int8_t level;    // Last level sent to the mixer
+} Pulse;
+
+typedef struct triangle {
+	uint8_t step;    // Position in the 32 step ramp
+	uint16_t period;
+	uint8_t length;
+	bool control;    // Length counter halt and linear counter control
+	uint8_t linear_period;
+	uint8_t linear;
+	bool linear_reload;
+
+	uint64_t next;
+	int8_t level;
+} Triangle;
+
+typedef struct noise {
+	uint16_t shift;  // 15 bit LFSR
+	bool short_mode;
+	uint16_t period; // In CPU cycles
+	uint8_t length;
+	bool halt;
+	Envelope envelope;
+
+	uint64_t next;
+	int8_t level;
+} Noise;
+
+typedef struct dmc {
+	bool irq_enabled;
+	bool loop;
+	uint16_t period; // CPU cycles per output bit
+	uint16_t sample_address;
+	uint16_t sample_length;
+
+	/* Memory reader */
+	uint16_t address;
+	uint16_t bytes_remaining;
+	uint8_t buffer;
+	bool buffer_full;
+
+	/* Output unit */
+	uint8_t shift;
+	uint8_t bits; // Left in the shift register
+	bool silence;
+	uint8_t output; // 7 bit DAC
+
+	uint64_t next; // CPU cycle of the next output bit
+	int8_t level;
+} Dmc;
+
+// Everything that affects emulation, saved and restored as one block
+typedef struct apu_state {
+	Pulse pulse[2];
+	Triangle triangle;
+	Noise noise;
+	Dmc dmc;
+
+	uint8_t enabled; // $4015 channel bits
+	uint8_t irqs;    // APU_FRAME_IRQ and APU_DMC_IRQ
+	bool five_step;
+	bool irq_inhibit;
+	uint8_t frame_step;
+	uint64_t frame_start; // CPU cycle the frame counter sequence started
+
+	uint64_t time; // Synthesized up to this CPU cycle
+} ApuState;
+
+typedef struct apu {
+	ApuState state;
+	Cpu *cpu;
+	SharedMemory *mem; // DMC sample fetches
+
+	int frame_event; // Scheduler ids
+	int dmc_event;
+
+	/* Output */
+	Blip blip;
+	uint64_t frame_time; // CPU cycle the blip frame started at
+	int16_t samples[BLIP_MAX_SAMPLES];
+	int sample_count; // In the last finished frame
+} Apu;
+
+// Registers its events on the CPU's scheduler. The registers themselves
+// share a page with OAM DMA and the controllers, see write_apu_register()
+bool init_apu(Apu *apu, Cpu *cpu, SharedMemory *mem, int sample_rate);
+bool set_apu_sample_rate(Apu *apu, int sample_rate);
+
+void apu_catch_up(Apu *apu, uint64_t time);
+
+uint8_t read_apu_status(Apu *apu); // $4015
+void write_apu_register(Apu *apu, uint16_t addr, uint8_t byte); // $4000-$4013, $4015, $4017
+
+// Synthesizes up to time and mixes everything since the last call into samples
+void end_apu_frame(Apu *apu, uint64_t time);
+
+// After state was overwritten directly (savestates, rewind)
+void refresh_apu(Apu *apu);
+
+#endif
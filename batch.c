@@ -0,0 +1,180 @@
+#include "batch.h"
+#include "movie.h"
+#include "nes.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Each worker owns the job indices [head, tail) */
+typedef struct work_queue {
+	pthread_mutex_t lock;
+	int head;
+	int tail;
+} WorkQueue;
+
+typedef struct batch {
+	BatchJob *jobs;
+	Cartridge **carts; // Each job's, shared between jobs on the same ROM
+	WorkQueue *queues;
+	int worker_count;
+} Batch;
+
+typedef struct worker {
+	Batch *batch;
+	int id;
+} Worker;
+
+static double now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static void run_job(BatchJob *job, Cartridge *cart)
+{
+	// sizeof(Nes) rounded up, aligned_alloc wants a multiple of the alignment
+	Nes *nes = aligned_alloc(NES_ALIGNMENT, (sizeof(Nes) + NES_ALIGNMENT - 1) & ~(NES_ALIGNMENT - 1));
+	double start = now();
+
+	job->ok = nes != NULL && cart != NULL && init_nes_with_cartridge(nes, cart, job->log_file, job->use_jit);
+	job->mismatch_frame = -1;
+	if (job->ok)
+	{
+		if (job->movie_file != NULL)
+		{
+			Movie movie;
+			job->ok = read_movie(&movie, job->movie_file) &&
+			          play_movie(&movie, nes, &job->mismatch_frame);
+			job->frames = movie.header.frames;
+			free_movie(&movie);
+		}
+		else
+		{
+			run_nes_frames(nes, job->frames);
+		}
+
+		job->instructions = nes->cpu.instruction_count;
+		job->cycles = nes->cpu.frame_count * CPU_CYCLES_PER_FRAME + nes->cpu.cycle_count;
+		job->PC = nes->cpu.PC;
+		if (nes->jit != NULL)
+			job->jit_stats = nes->jit->stats;
+		cleanup_nes(nes);
+	}
+
+	job->seconds = now() - start;
+	free(nes);
+}
+
+static int take_job(WorkQueue *queue)
+{
+	int job = -1;
+	pthread_mutex_lock(&queue->lock);
+	if (queue->head < queue->tail)
+		job = queue->head++;
+	pthread_mutex_unlock(&queue->lock);
+	return job;
+}
+
+/* Move the back half of the first non-empty victim's jobs into queue */
+static bool steal_jobs(Batch *batch, int thief)
+{
+	for (int i = 1; i < batch->worker_count; i++)
+	{
+		WorkQueue *victim = &batch->queues[(thief + i) % batch->worker_count];
+
+		pthread_mutex_lock(&victim->lock);
+		int remaining = victim->tail - victim->head;
+		int start = victim->tail - (remaining + 1) / 2;
+		int end = victim->tail;
+		if (remaining > 0)
+			victim->tail = start;
+		pthread_mutex_unlock(&victim->lock);
+
+		if (remaining > 0)
+		{
+			WorkQueue *queue = &batch->queues[thief];
+			pthread_mutex_lock(&queue->lock);
+			queue->head = start;
+			queue->tail = end;
+			pthread_mutex_unlock(&queue->lock);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void *batch_worker(void *arg)
+{
+	Worker *worker = arg;
+	Batch *batch = worker->batch;
+
+	for (;;)
+	{
+		int job = take_job(&batch->queues[worker->id]);
+		if (job >= 0)
+			run_job(&batch->jobs[job], batch->carts[job]);
+		else if (!steal_jobs(batch, worker->id))
+			break;
+	}
+
+	return NULL;
+}
+
+void run_batch(BatchJob *jobs, int count, int threads)
+{
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > count)
+		threads = count;
+	if (threads < 1)
+		return;
+
+	// Every ROM is loaded once, up front
+	Cartridge *loaded = calloc(count, sizeof(Cartridge));
+	bool *usable = calloc(count, sizeof(bool));
+	Cartridge **carts = calloc(count, sizeof(Cartridge *));
+	for (int i = 0; i < count; i++)
+	{
+		int first = 0;
+		while (strcmp(jobs[first].rom_file, jobs[i].rom_file) != 0)
+			first++;
+		if (first == i)
+			usable[i] = load_cartridge(&loaded[i], jobs[i].rom_file);
+		carts[i] = usable[first] ? &loaded[first] : NULL;
+	}
+
+	Batch batch = { jobs, carts, malloc(threads * sizeof(WorkQueue)), threads };
+	Worker *workers = malloc(threads * sizeof(Worker));
+	pthread_t *handles = malloc(threads * sizeof(pthread_t));
+
+	for (int i = 0; i < threads; i++)
+	{
+		pthread_mutex_init(&batch.queues[i].lock, NULL);
+		batch.queues[i].head = (long) count * i / threads;
+		batch.queues[i].tail = (long) count * (i + 1) / threads;
+		workers[i].batch = &batch;
+		workers[i].id = i;
+	}
+
+	for (int i = 0; i < threads; i++)
+		pthread_create(&handles[i], NULL, &batch_worker, &workers[i]);
+	for (int i = 0; i < threads; i++)
+		pthread_join(handles[i], NULL);
+
+	for (int i = 0; i < threads; i++)
+		pthread_mutex_destroy(&batch.queues[i].lock);
+	free(handles);
+	free(workers);
+	free(batch.queues);
+
+	for (int i = 0; i < count; i++)
+		if (usable[i])
+			free_cartridge(&loaded[i]);
+	free(carts);
+	free(usable);
+	free(loaded);
+}
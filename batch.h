@@ -0,0 +1,41 @@
+/*
+
+Batch runner
+
+- Runs many independent Nes instances in one process
+- Jobs are split evenly across the workers up front; a worker that
+  runs dry steals half of the remaining jobs from another one
+- Results are written back into each job
+- Each ROM is loaded once, jobs running the same one share its Cartridge
+- A job with a movie replays it instead of running frames with no input,
+  which is how recorded sessions are checked in bulk
+
+*/
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "jit.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct batch_job {
+	char *rom_file;
+	char *log_file; // NULL for no log
+	char *movie_file; // NULL for none, frames is ignored otherwise
+	int frames;
+	bool use_jit;
+
+	/* Results */
+	bool ok;
+	uint64_t instructions;
+	uint64_t cycles;
+	uint16_t PC;
+	int mismatch_frame; // Frame of a movie's first wrong RAM checksum, or -1
+	double seconds;
+	JitStats jit_stats; // Zero unless the job ran on the JIT
+} BatchJob;
+
+// threads <= 0 uses every online core
+void run_batch(BatchJob *jobs, int count, int threads);
+
+#endif
@@ -0,0 +1,384 @@
+/*
+
+Headless benchmark
+
+- Runs each workload for a fixed number of frames, several times over
+- Reports instructions/s, emulated cycles/s and ns/instruction, with
+  the spread across repeats
+- Workloads: nestest.nes, a loop per addressing mode, branch heavy and
+  stack heavy loops
+- With -j the CPU runs through the JIT, whose stats from the first
+  repeat follow each workload
+- Pixel kernels: CHR decode and palette to RGBA for every instruction
+  set the CPU has, with the speedup over scalar. -f sets the number of
+  frames' worth of pixels they chew through
+
+usage: nes_bench [-f frames] [-r repeats] [-j] [workload ...]
+
+*/
+#include "cartridge.h"
+#include "cpu.h"
+#include "jit.h"
+#include "mapper.h"
+#include "video.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DEFAULT_FRAMES  600 // 10 seconds of NTSC
+#define BENCH_DEFAULT_REPEATS 5
+#define BENCH_MAX_REPEATS     64
+#define BENCH_LOOP_LENGTH     64  // Instructions per loop iteration before the JMP back
+#define BENCH_CHR_SIZE        0x40000 // 256 KB, the largest MMC3 CHR ROM
+
+typedef struct program {
+	uint8_t prg[0x8000];
+	int size;
+} Program;
+
+typedef struct workload {
+	const char *name;
+	int opcode; // Repeated opcode, or -1 for a custom generator
+	void (*generate)(Program *program);
+} Workload;
+
+static void emit_bytes(Program *program, int count, uint8_t a, uint8_t b, uint8_t c)
+{
+	uint8_t bytes[3] = {a, b, c};
+	for (int i = 0; i < count; i++)
+		program->prg[program->size++] = bytes[i];
+}
+
+/* JMP $8000, backward branches aren't usable as loops yet */
+static void emit_loop_end(Program *program)
+{
+	emit_bytes(program, 3, 0x4C, 0x00, 0x80);
+}
+
+static void generate_branches(Program *program)
+{
+	// Alternate taken and untaken forward branches on changing flags
+	for (int i = 0; i < BENCH_LOOP_LENGTH / 4; i++)
+	{
+		emit_bytes(program, 2, 0xC9, i * 17, 0); // CMP #
+		emit_bytes(program, 2, 0xF0, 0x00, 0);   // BEQ +0
+		emit_bytes(program, 2, 0x90, 0x00, 0);   // BCC +0
+		emit_bytes(program, 2, 0x10, 0x00, 0);   // BPL +0
+	}
+	emit_loop_end(program);
+}
+
+static void generate_stack(Program *program)
+{
+	int body = 0x8000 + BENCH_LOOP_LENGTH;
+	for (int i = 0; i < BENCH_LOOP_LENGTH / 8; i++)
+	{
+		emit_bytes(program, 1, 0x48, 0, 0);                         // PHA
+		emit_bytes(program, 1, 0x08, 0, 0);                         // PHP
+		emit_bytes(program, 1, 0x28, 0, 0);                         // PLP
+		emit_bytes(program, 1, 0x68, 0, 0);                         // PLA
+		emit_bytes(program, 3, 0x20, body & 0xFF, body >> 8);       // JSR body
+	}
+	emit_loop_end(program);
+
+	// The subroutine every JSR lands on
+	program->size = BENCH_LOOP_LENGTH;
+	emit_bytes(program, 1, 0xEA, 0, 0); // NOP
+	emit_bytes(program, 1, 0x60, 0, 0); // RTS
+}
+
+/* One instruction per addressing mode, pointing at internal RAM */
+static const Workload workloads[] = {
+	{ "nestest",     -1,   NULL },
+	{ "implied",     0xE8, NULL }, // INX
+	{ "accumulator", 0x0A, NULL }, // ASL A
+	{ "immediate",   0xA9, NULL }, // LDA #
+	{ "zero_page",   0xA5, NULL }, // LDA zp
+	{ "zero_page_x", 0xB5, NULL }, // LDA zp,X
+	{ "zero_page_y", 0xB6, NULL }, // LDX zp,Y
+	{ "relative",    0xD0, NULL }, // BNE +0
+	{ "absolute",    0xAD, NULL }, // LDA abs
+	{ "absolute_x",  0xBD, NULL }, // LDA abs,X
+	{ "absolute_y",  0xB9, NULL }, // LDA abs,Y
+	{ "indirect",    0x6C, NULL }, // JMP (ind)
+	{ "indirect_x",  0xA1, NULL }, // LDA (zp,X)
+	{ "indirect_y",  0xB1, NULL }, // LDA (zp),Y
+	{ "branches",    -1,   &generate_branches },
+	{ "stack",       -1,   &generate_stack },
+};
+
+#define WORKLOAD_COUNT ((int) (sizeof(workloads) / sizeof(workloads[0])))
+
+static void generate_addressing_mode(Program *program, uint8_t opcode)
+{
+	int length = instruction_length(addressing_modes[opcode]);
+
+	// JMP ($0010) with $0010 pointing back at $8000
+	if (opcode == 0x6C)
+	{
+		emit_bytes(program, 3, 0x6C, 0x10, 0x00);
+		return;
+	}
+
+	for (int i = 0; i < BENCH_LOOP_LENGTH; i++)
+		emit_bytes(program, length, opcode, 0x10, 0x02); // $10 or $0210
+	emit_loop_end(program);
+}
+
+static double now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+typedef struct result {
+	double seconds;
+	uint64_t instructions;
+	uint64_t cycles;
+	JitStats jit_stats; // Only with -j
+} Result;
+
+static bool run_workload(const Workload *workload, int frames, bool use_jit, Result *result)
+{
+	static Program program;
+	static SharedMemory mem;
+	static Mapper mapper;
+	static Jit jit;
+	Cartridge cart = {0};
+	DecodedPrg decoded = {0};
+	Cpu cpu;
+
+	memset(&program, 0, sizeof(program));
+	init_shared_memory(&mem);
+
+	if (workload->opcode < 0 && workload->generate == NULL)
+	{
+		if (!load_cartridge(&cart, "nestest.nes") || !init_mapper(&mapper, &cart.rom, &mem))
+			return false;
+		decoded = cart.decoded;
+	}
+	else
+	{
+		if (workload->generate != NULL)
+			workload->generate(&program);
+		else
+			generate_addressing_mode(&program, workload->opcode);
+		map_memory(&mem, 0x8000, 0xFFFF, program.prg, sizeof(program.prg), false);
+		if (!decode_prg(&decoded, program.prg, sizeof(program.prg)))
+			return false;
+
+		// Pointers for the indirect modes, both lead back to the loop
+		mem.ram[0x10] = 0x00;
+		mem.ram[0x11] = 0x80;
+	}
+
+	init_cpu(&cpu, &mem, NULL);
+	cpu.decoded = decoded;
+	cpu.PC = workload->opcode < 0 && workload->generate == NULL ? 0xC000 : 0x8000;
+	if (use_jit)
+	{
+		if (!init_jit(&jit))
+			return false;
+		cpu.jit = &jit;
+	}
+
+	double start = now();
+	for (int i = 0; i < frames; i++)
+		execute_cpu_instructions(&cpu);
+	result->seconds = now() - start;
+
+	result->instructions = cpu.instruction_count;
+	result->cycles = cpu.frame_count * CPU_CYCLES_PER_FRAME + cpu.cycle_count;
+
+	if (use_jit)
+	{
+		result->jit_stats = jit.stats;
+		cleanup_jit(&jit);
+	}
+	cleanup_cpu(&cpu);
+	cleanup_shared_memory(&mem);
+	if (cart.rom.raw != NULL)
+		free_cartridge(&cart);
+	else
+		free_decoded_prg(&decoded);
+	return true;
+}
+
+/* Pixel kernels, timed per unit of work: a tile, or a whole frame */
+
+typedef struct pixel_workload {
+	const char *name;
+	const char *unit;
+	double (*run)(const PixelKernels *kernels, int frames);
+} PixelWorkload;
+
+static uint8_t bench_chr[BENCH_CHR_SIZE];
+static uint8_t bench_tiles[BENCH_CHR_SIZE * 4];
+static uint8_t bench_frame[PIXEL_FRAME_SIZE];
+static uint8_t bench_rgba[PIXEL_FRAME_SIZE * 4];
+
+static void fill_random(uint8_t *bytes, size_t size)
+{
+	uint32_t seed = 0x12345678;
+	for (size_t i = 0; i < size; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		bytes[i] = seed >> 16;
+	}
+}
+
+// A whole CHR ROM per frame, as refresh_ppu_tiles does after a load
+static double run_chr_decode(const PixelKernels *kernels, int frames)
+{
+	double start = now();
+	for (int i = 0; i < frames; i++)
+		kernels->decode_tiles(bench_chr, bench_tiles, BENCH_CHR_SIZE / TILE_BYTES);
+	return (now() - start) / ((double) frames * BENCH_CHR_SIZE / TILE_BYTES);
+}
+
+static double run_palette_rgba(const PixelKernels *kernels, int frames)
+{
+	double start = now();
+	for (int i = 0; i < frames; i++)
+		kernels->indexed_to_rgba(bench_frame, bench_rgba, PIXEL_FRAME_SIZE);
+	return (now() - start) / frames;
+}
+
+static const PixelWorkload pixel_workloads[] = {
+	{ "chr_decode",   "tile",  &run_chr_decode },
+	{ "palette_rgba", "frame", &run_palette_rgba },
+};
+
+#define PIXEL_WORKLOAD_COUNT ((int) (sizeof(pixel_workloads) / sizeof(pixel_workloads[0])))
+
+/* Best of the repeats, as the minimum is the least disturbed by the machine */
+static void report_pixels(const PixelWorkload *workload, int frames, int repeats)
+{
+	double scalar = 0;
+	for (int isa = 0; isa < PIXEL_ISA_COUNT; isa++)
+	{
+		const PixelKernels *kernels = get_pixel_kernels(isa);
+		if (kernels == NULL)
+			continue;
+
+		double best = INFINITY;
+		for (int i = 0; i < repeats; i++)
+			best = fmin(best, workload->run(kernels, frames));
+		if (isa == isa_scalar)
+			scalar = best;
+
+		printf("%-12s %-6s %10.2f ns/%-5s %6.2fx\n", workload->name, kernels->name,
+			best * 1e9, workload->unit, scalar / best);
+	}
+}
+
+static bool pixels_match(const PixelKernels *kernels)
+{
+	static uint8_t tiles[BENCH_CHR_SIZE * 4];
+	static uint8_t rgba[PIXEL_FRAME_SIZE * 4];
+	const PixelKernels *scalar = get_pixel_kernels(isa_scalar);
+
+	scalar->decode_tiles(bench_chr, tiles, BENCH_CHR_SIZE / TILE_BYTES);
+	kernels->decode_tiles(bench_chr, bench_tiles, BENCH_CHR_SIZE / TILE_BYTES);
+	scalar->indexed_to_rgba(bench_frame, rgba, PIXEL_FRAME_SIZE);
+	kernels->indexed_to_rgba(bench_frame, bench_rgba, PIXEL_FRAME_SIZE);
+
+	return memcmp(tiles, bench_tiles, sizeof(tiles)) == 0 && memcmp(rgba, bench_rgba, sizeof(rgba)) == 0;
+}
+
+static void report(const char *name, Result *results, int repeats)
+{
+	double rate[BENCH_MAX_REPEATS];
+	double mean = 0, variance = 0;
+
+	for (int i = 0; i < repeats; i++)
+	{
+		rate[i] = results[i].instructions / results[i].seconds;
+		mean += rate[i] / repeats;
+	}
+	for (int i = 0; i < repeats; i++)
+		variance += (rate[i] - mean) * (rate[i] - mean) / repeats;
+
+	double cycle_rate = mean * results[0].cycles / results[0].instructions;
+	printf("%-12s %10.1f %10.1f %9.2f %7.1f%%\n", name, mean / 1e6, cycle_rate / 1e6,
+		1e9 / mean, 100.0 * sqrt(variance) / mean);
+}
+
+int main(int argc, char **argv)
+{
+	int frames = BENCH_DEFAULT_FRAMES;
+	int repeats = BENCH_DEFAULT_REPEATS;
+	bool use_jit = false;
+	int option;
+
+	while ((option = getopt(argc, argv, "f:r:j")) != -1)
+	{
+		switch (option)
+		{
+			case 'f': frames = atoi(optarg); break;
+			case 'r': repeats = atoi(optarg); break;
+			case 'j': use_jit = true; break;
+			default:
+				printf("usage: %s [-f frames] [-r repeats] [-j] [workload ...]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (repeats < 1) repeats = 1;
+	if (repeats > BENCH_MAX_REPEATS) repeats = BENCH_MAX_REPEATS;
+
+	printf("%d frames x %d repeats, %s\n", frames, repeats, use_jit ? "jit" : "interpreter");
+	printf("%-12s %10s %10s %9s %8s\n", "workload", "Minstr/s", "Mcycles/s", "ns/instr", "stddev");
+
+	bool ok = true;
+	for (int w = 0; w < WORKLOAD_COUNT; w++)
+	{
+		bool selected = optind == argc;
+		for (int i = optind; i < argc; i++)
+			selected |= strcmp(argv[i], workloads[w].name) == 0;
+		if (!selected)
+			continue;
+
+		Result results[BENCH_MAX_REPEATS];
+		for (int i = 0; i < repeats && ok; i++)
+			ok = run_workload(&workloads[w], frames, use_jit, &results[i]);
+		if (!ok)
+		{
+			printf("%-12s failed\n", workloads[w].name);
+			return 1;
+		}
+		report(workloads[w].name, results, repeats);
+		if (use_jit)
+			print_jit_stats(&results[0].jit_stats, stdout);
+	}
+
+	fill_random(bench_chr, sizeof(bench_chr));
+	fill_random(bench_frame, sizeof(bench_frame));
+	for (int isa = 0; isa < PIXEL_ISA_COUNT; isa++)
+	{
+		const PixelKernels *kernels = get_pixel_kernels(isa);
+		if (kernels != NULL && !pixels_match(kernels))
+		{
+			printf("%s pixel kernels differ from scalar\n", kernels->name);
+			return 1;
+		}
+	}
+
+	bool header = false;
+	for (int w = 0; w < PIXEL_WORKLOAD_COUNT; w++)
+	{
+		bool selected = optind == argc;
+		for (int i = optind; i < argc; i++)
+			selected |= strcmp(argv[i], pixel_workloads[w].name) == 0;
+		if (!selected)
+			continue;
+
+		if (!header)
+			printf("\n%-12s %-6s %18s %7s\n", "kernel", "isa", "time", "speedup");
+		header = true;
+		report_pixels(&pixel_workloads[w], frames, repeats);
+	}
+
+	return 0;
+}
@@ -0,0 +1,85 @@
+#include "blip.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+// Only depends on the constants, one copy serves every instance
+static int32_t kernel[BLIP_PHASES][BLIP_TAPS];
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+/* Blackman windowed sinc, cut off a little under Nyquist. Every phase
+   is rounded so its taps sum to exactly 1 << BLIP_SHIFT, or the
+   integrator would drift */
+static void make_kernel()
+{
+	const double cutoff = 0.45; // Of the sample rate
+	const double half = BLIP_TAPS / 2;
+
+	for (int phase = 0; phase < BLIP_PHASES; phase++)
+	{
+		double taps[BLIP_TAPS];
+		double sum = 0;
+		for (int i = 0; i < BLIP_TAPS; i++)
+		{
+			double t = i - half + 1 - (double) phase / BLIP_PHASES;
+			double x = 2 * cutoff * t;
+			double sinc = fabs(x) < 1e-9 ? 1 : sin(M_PI * x) / (M_PI * x);
+			double window = fabs(t) >= half ? 0 :
+				0.42 + 0.5 * cos(M_PI * t / half) + 0.08 * cos(2 * M_PI * t / half);
+			taps[i] = sinc * window;
+			sum += taps[i];
+		}
+
+		int total = 0, largest = 0;
+		for (int i = 0; i < BLIP_TAPS; i++)
+		{
+			kernel[phase][i] = lround(taps[i] / sum * (1 << BLIP_SHIFT));
+			total += kernel[phase][i];
+			if (kernel[phase][i] > kernel[phase][largest])
+				largest = i;
+		}
+		kernel[phase][largest] += (1 << BLIP_SHIFT) - total;
+	}
+}
+
+bool init_blip(Blip *blip, double clock_rate, int sample_rate)
+{
+	memset(blip, 0, sizeof(Blip));
+
+	// Room for a frame at 50 Hz, with the kernel's tail after it
+	if (sample_rate <= 0 || sample_rate / 50 + 1 > BLIP_MAX_SAMPLES)
+	{
+		printf("Unsupported sample rate %d\n", sample_rate);
+		return false;
+	}
+
+	blip->factor = (uint64_t) ((double) sample_rate / clock_rate * 4294967296.0);
+	pthread_once(&kernel_once, &make_kernel);
+	blip->kernel = kernel;
+	return true;
+}
+
+int end_blip_frame(Blip *blip, uint32_t clocks, int16_t *samples)
+{
+	uint64_t position = clocks * blip->factor + blip->offset;
+	int count = position >> 32;
+	if (count > BLIP_MAX_SAMPLES)
+		count = BLIP_MAX_SAMPLES;
+
+	for (int i = 0; i < count; i++)
+	{
+		blip->integrator += blip->deltas[i];
+		int64_t level = blip->integrator >> BLIP_SHIFT;
+		blip->dc += (level * 65536 - blip->dc) / 1024;
+
+		int64_t sample = level - (blip->dc >> 16);
+		samples[i] = sample > INT16_MAX ? INT16_MAX : sample < INT16_MIN ? INT16_MIN : sample;
+	}
+
+	// The kernels of the last steps reach into the next frame
+	memmove(blip->deltas, blip->deltas + count, BLIP_TAPS * sizeof(int32_t));
+	memset(blip->deltas + BLIP_TAPS, 0, count * sizeof(int32_t));
+	blip->offset = position & 0xFFFFFFFF;
+	return count;
+}
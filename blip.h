@@ -0,0 +1,56 @@
+/*
+
+Band-limited synthesis
+
+- Sound is described as steps: "at clock t the output moved by delta"
+- Each step is added as a windowed sinc (the derivative of a band
+  limited step) at its exact sub-sample position, so square waves come
+  out without aliasing at any pitch
+- Once per frame the steps are summed up into 16 bit samples, with the
+  DC offset filtered out like the console's own output capacitor does
+- Converting clocks to samples is 32.32 fixed point, the fraction of a
+  sample left at the end of a frame carries into the next one
+
+*/
+#ifndef BLIP_H_
+#define BLIP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BLIP_PHASES      64   // Sub-sample positions
+#define BLIP_TAPS        16   // Kernel width in samples
+#define BLIP_SHIFT       14   // Kernel taps sum to 1 << BLIP_SHIFT
+#define BLIP_MAX_SAMPLES 1024 // Per frame, 48 kHz needs 800
+
+typedef struct blip {
+	uint64_t factor; // Samples per clock, 32.32
+	uint64_t offset; // Fraction of a sample already into this frame, 32.32
+	const int32_t (*kernel)[BLIP_TAPS]; // BLIP_PHASES rows, shared by every instance
+
+	int32_t deltas[BLIP_MAX_SAMPLES + BLIP_TAPS];
+	int64_t integrator;
+	int64_t dc; // Running average, 16 extra bits of precision
+} Blip;
+
+// False when a frame of clock_rate / frame_rate clocks doesn't fit
+bool init_blip(Blip *blip, double clock_rate, int sample_rate);
+
+// clock is counted from the start of the current frame
+static inline void add_blip_delta(Blip *blip, uint32_t clock, int delta)
+{
+	uint64_t position = clock * blip->factor + blip->offset;
+	uint64_t sample = position >> 32;
+	if (sample >= BLIP_MAX_SAMPLES)
+		return;
+
+	const int32_t *kernel = blip->kernel[(position >> (32 - 6)) & (BLIP_PHASES - 1)];
+	int32_t *out = blip->deltas + sample;
+	for (int i = 0; i < BLIP_TAPS; i++)
+		out[i] += kernel[i] * delta;
+}
+
+// Ends the frame after clocks, returns the number of samples written
+int end_blip_frame(Blip *blip, uint32_t clocks, int16_t *samples);
+
+#endif
@@ -0,0 +1,142 @@
+#include "capture.h"
+#include <string.h>
+
+static bool write_frame(Capture *capture, const uint8_t frame[PPU_HEIGHT][PPU_WIDTH])
+{
+	static const char header[] = "P6\n256 240\n255\n";
+	uint8_t rgba[PPU_WIDTH * 4];
+	uint8_t rgb[PPU_HEIGHT * PPU_WIDTH * 3];
+
+	// A row at a time through the SIMD palette lookup, then drop alpha
+	uint8_t *out = rgb;
+	for (int y = 0; y < PPU_HEIGHT; y++)
+	{
+		capture->kernels->indexed_to_rgba(frame[y], rgba, PPU_WIDTH);
+		for (int x = 0; x < PPU_WIDTH; x++)
+		{
+			*out++ = rgba[x * 4];
+			*out++ = rgba[x * 4 + 1];
+			*out++ = rgba[x * 4 + 2];
+		}
+	}
+
+	if (capture->format == capture_ppm && fwrite(header, 1, sizeof(header) - 1, capture->file) != sizeof(header) - 1)
+		return false;
+	return fwrite(rgb, 1, sizeof(rgb), capture->file) == sizeof(rgb);
+}
+
+/* Takes the buffers in the same alternating order they're filled in */
+static void *capture_writer(void *arg)
+{
+	Capture *capture = arg;
+	int current = 0;
+
+	pthread_mutex_lock(&capture->lock);
+	while (true)
+	{
+		while (!capture->queued[current] && !capture->stopping)
+			pthread_cond_wait(&capture->queued_frame, &capture->lock);
+		if (!capture->queued[current])
+			break;
+
+		// The emulation leaves a queued buffer alone, no need to hold the lock
+		pthread_mutex_unlock(&capture->lock);
+		bool ok = !capture->failed && write_frame(capture, capture->frames[current]);
+		pthread_mutex_lock(&capture->lock);
+
+		if (ok)
+			capture->written++;
+		else if (!capture->failed)
+		{
+			printf("Couldn't write captured frame\n");
+			capture->failed = true;
+		}
+		capture->queued[current] = false;
+		pthread_cond_signal(&capture->freed_frame);
+		current ^= 1;
+	}
+	pthread_mutex_unlock(&capture->lock);
+
+	return NULL;
+}
+
+bool start_capture(Capture *capture, const char *path, int format, int every, bool lossless)
+{
+	memset(capture, 0, sizeof(Capture));
+	capture->format = format;
+	capture->every = every > 1 ? every : 1;
+	capture->lossless = lossless;
+	capture->kernels = best_pixel_kernels();
+
+	if (strcmp(path, "-") == 0)
+	{
+		capture->file = stdout;
+	}
+	else
+	{
+		capture->file = fopen(path, "wb");
+		capture->close_file = true;
+		if (capture->file == NULL)
+		{
+			printf("Couldn't create %s\n", path);
+			return false;
+		}
+	}
+
+	pthread_mutex_init(&capture->lock, NULL);
+	pthread_cond_init(&capture->queued_frame, NULL);
+	pthread_cond_init(&capture->freed_frame, NULL);
+	if (pthread_create(&capture->writer, NULL, &capture_writer, capture) != 0)
+	{
+		printf("Couldn't start the capture thread\n");
+		if (capture->close_file)
+			fclose(capture->file);
+		return false;
+	}
+
+	return true;
+}
+
+void capture_frame(Capture *capture, const uint8_t framebuffer[PPU_HEIGHT][PPU_WIDTH])
+{
+	if (capture->seen++ % capture->every != 0)
+		return;
+
+	int buffer = capture->next;
+	pthread_mutex_lock(&capture->lock);
+	if (capture->queued[buffer] && !capture->lossless)
+	{
+		capture->dropped++;
+		pthread_mutex_unlock(&capture->lock);
+		return;
+	}
+	while (capture->queued[buffer])
+		pthread_cond_wait(&capture->freed_frame, &capture->lock);
+	pthread_mutex_unlock(&capture->lock);
+
+	memcpy(capture->frames[buffer], framebuffer, sizeof(capture->frames[buffer]));
+
+	pthread_mutex_lock(&capture->lock);
+	capture->queued[buffer] = true;
+	capture->next ^= 1;
+	pthread_cond_signal(&capture->queued_frame);
+	pthread_mutex_unlock(&capture->lock);
+}
+
+bool stop_capture(Capture *capture)
+{
+	pthread_mutex_lock(&capture->lock);
+	capture->stopping = true;
+	pthread_cond_signal(&capture->queued_frame);
+	pthread_mutex_unlock(&capture->lock);
+	pthread_join(capture->writer, NULL);
+
+	bool ok = !capture->failed && fflush(capture->file) == 0;
+	if (capture->close_file)
+		ok &= fclose(capture->file) == 0;
+
+	pthread_cond_destroy(&capture->freed_frame);
+	pthread_cond_destroy(&capture->queued_frame);
+	pthread_mutex_destroy(&capture->lock);
+	return ok;
+}
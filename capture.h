@@ -0,0 +1,65 @@
+/*
+
+Frame capture
+
+- Streams finished frames to a file or stdout, as raw RGB24 or as a
+  sequence of binary PPMs, either of which an external encoder takes
+  straight from a pipe
+- Two frame buffers: the emulation thread copies the indexed frame into
+  one while a writer thread converts and writes the other, so the
+  emulation never waits on I/O
+- Every nth frame only, when every is above 1
+- If the writer falls behind, frames are dropped and counted, unless the
+  capture is lossless, in which case the emulation waits for a buffer
+
+*/
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include "ppu.h"
+#include "video.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum capture_format {
+	capture_raw = 0, // 256x240 RGB24, frame after frame
+	capture_ppm = 1, // P6 header before every frame
+};
+
+typedef struct capture {
+	FILE *file;
+	bool close_file; // False for stdout
+	int format;
+	int every;
+	bool lossless;
+	const PixelKernels *kernels;
+
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t queued_frame; // Writer waits on this
+	pthread_cond_t freed_frame;  // Lossless emulation waits on this
+
+	uint8_t frames[2][PPU_HEIGHT][PPU_WIDTH];
+	bool queued[2]; // Filled and waiting for the writer
+	int next;       // Buffer the next frame goes into
+	bool stopping;
+	bool failed;    // A write failed, nothing more gets written
+
+	/* Counters */
+	uint64_t seen;
+	uint64_t written;
+	uint64_t dropped;
+} Capture;
+
+// path "-" is stdout. every <= 1 captures every frame
+bool start_capture(Capture *capture, const char *path, int format, int every, bool lossless);
+
+// Called by the emulation once per finished frame
+void capture_frame(Capture *capture, const uint8_t framebuffer[PPU_HEIGHT][PPU_WIDTH]);
+
+// Writes what's queued and closes the output. False if any write failed
+bool stop_capture(Capture *capture);
+
+#endif
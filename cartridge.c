@@ -0,0 +1,39 @@
+#include "cartridge.h"
+#include "video.h"
+#include <string.h>
+
+bool load_cartridge(Cartridge *cart, char *filename)
+{
+	memset(cart, 0, sizeof(Cartridge));
+	if (!load_rom(&cart->rom, filename))
+		return false;
+
+	Rom *rom = &cart->rom;
+	if (!decode_prg(&cart->decoded, rom->pgr_rom, rom->pgr_rom_size))
+	{
+		free_rom(rom);
+		return false;
+	}
+
+	if (rom->chr_rom_size > 0)
+	{
+		cart->tiles = malloc((size_t) rom->chr_rom_size * 4);
+		if (cart->tiles == NULL)
+		{
+			printf("Unable to allocate the CHR tile cache\n");
+			free_decoded_prg(&cart->decoded);
+			free_rom(rom);
+			return false;
+		}
+		best_pixel_kernels()->decode_tiles(rom->chr_rom, cart->tiles, rom->chr_rom_size / TILE_BYTES);
+	}
+	return true;
+}
+
+void free_cartridge(Cartridge *cart)
+{
+	free(cart->tiles);
+	free_decoded_prg(&cart->decoded);
+	free_rom(&cart->rom);
+	memset(cart, 0, sizeof(Cartridge));
+}
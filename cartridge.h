@@ -0,0 +1,32 @@
+/*
+
+Cartridges
+
+- What a game never changes while it runs: the ROM file, mapped read
+  only, its PRG ROM already decoded for the CPU and its CHR ROM already
+  decoded for the PPU
+- Loaded once and shared by any number of instances on any threads,
+  nothing writes to it after load_cartridge()
+- Each instance keeps its own RAM, PRG-RAM and CHR-RAM
+
+*/
+#ifndef CARTRIDGE_H_
+#define CARTRIDGE_H_
+
+#include "cpu.h"
+#include "rom.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct cartridge {
+	Rom rom;
+	DecodedPrg decoded; // For every instance's Cpu.decoded
+	uint8_t *tiles; // CHR ROM in Ppu.tiles layout, NULL for CHR-RAM carts
+} Cartridge;
+
+bool load_cartridge(Cartridge *cart, char *filename);
+
+// Only once no instance uses it anymore
+void free_cartridge(Cartridge *cart);
+
+#endif
@@ -1,18 +1,47 @@
 #include "cpu.h"
-
-static uint8_t read_byte(Cpu* cpu, uint16_t addr)
+#include "jit.h"
+#include "trace.h"
+#include <string.h>
+
+#ifdef CPU_PROFILE
+#include "profile.h"
+// Where an instruction starts, before its fetch moves PC and the cycle count
+#define PROFILE_LOCALS uint16_t profile_pc = 0; int profile_cycle = 0;
+#define PROFILE_FETCH(cpu) profile_pc = (cpu)->PC; profile_cycle = (cpu)->cycle_count;
+#define PROFILE_INSTRUCTION(cpu, opcode) \
+	if ((cpu)->profile != NULL) profile_instruction((cpu)->profile, profile_pc, profile_cycle, (opcode));
+#else
+#define PROFILE_LOCALS
+#define PROFILE_FETCH(cpu)
+#define PROFILE_INSTRUCTION(cpu, opcode)
+#endif
+
+// Instruction bodies are inlined into the per-opcode handlers generated from
+// CPU_OPCODE_TABLE, so the addressing mode switch folds away at compile time.
+#if defined(__GNUC__)
+#define CPU_INLINE inline __attribute__((always_inline))
+#else
+#define CPU_INLINE inline
+#endif
+
+// Threaded dispatch needs labels as values (a GNU extension)
+#if defined(__GNUC__) && !defined(CPU_NO_COMPUTED_GOTO)
+#define CPU_COMPUTED_GOTO
+#endif
+
+static CPU_INLINE uint8_t read_byte(Cpu* cpu, uint16_t addr)
 {
 	cpu->cycle_count ++;
 	return read_cpu_memory(cpu->memspace, addr);
 }
 
-static void write_byte(Cpu* cpu, uint16_t addr, uint8_t byte)
+static CPU_INLINE void write_byte(Cpu* cpu, uint16_t addr, uint8_t byte)
 {
 	cpu->cycle_count ++;
 	write_cpu_memory(cpu->memspace, addr, byte);
 }
 
-static uint8_t pop_stack(Cpu *cpu)
+static CPU_INLINE uint8_t pop_stack(Cpu *cpu)
 {
 	// Accounting for the extra cycle used to preincrement the SP
 	cpu->cycle_count ++;
@@ -22,61 +51,105 @@ static uint8_t pop_stack(Cpu *cpu)
 	return byte;
 }
 
-static void push_stack(Cpu *cpu, uint8_t byte)
+static CPU_INLINE void push_stack(Cpu *cpu, uint8_t byte)
 {
 	write_byte(cpu, (0x0000 | cpu->SP), byte);
 	cpu->SP --;
 }
 
-static void set_negative_and_zero(Cpu *cpu, uint8_t byte)
+/* N and Z are only worked out from the result when something reads them */
+static CPU_INLINE void set_negative_and_zero(Cpu *cpu, uint8_t byte)
+{
+	cpu->nz_result = byte;
+}
+
+static CPU_INLINE void set_flag(Cpu *cpu, uint8_t flag, bool condition)
+{
+	cpu->P = condition ? (cpu->P | flag) : (cpu->P & ~flag);
+}
+
+static CPU_INLINE void set_carry(Cpu *cpu, bool condition)
 {
-	cpu->Z = (byte == 0);
-	cpu->N = (byte & 0x80) != 0;
+	cpu->P = (cpu->P & ~FLAG_C) | condition;
 }
 
-static void add_with_carry(Cpu *cpu, uint8_t byte)
+static CPU_INLINE void add_with_carry(Cpu *cpu, uint8_t byte)
 {
-	uint8_t result = cpu->A + byte + cpu->C;
+	uint8_t carry = cpu->P & FLAG_C;
+	uint8_t result = cpu->A + byte + carry;
 
-	cpu->C = (cpu->A + byte + cpu->C) > 0xFF;
-	cpu->Z = (cpu->A == 0);
-	cpu->N = (cpu->A & 0x80) != 0;
-	cpu->V = ((cpu->A ^ result) & (byte ^ result)) & 0x80;
+	set_carry(cpu, (cpu->A + byte + carry) > 0xFF);
+	set_negative_and_zero(cpu, result);
+	set_flag(cpu, FLAG_V, ((cpu->A ^ result) & (byte ^ result)) & 0x80);
 
 	cpu->A = result;
 }
 
 /* Writing status flags to a byte */
-static uint8_t write_status_flag(Cpu *cpu)
-{
-	uint8_t byte;
-
-	byte &=  cpu->C;
-	byte &= (cpu->Z << 1);
-	byte &= (cpu->I << 2);
-	byte &= (cpu->D << 3);
-	byte &= (cpu->B << 4);
-	byte &= (1 << 5); // Unused flag always set to 1
-	byte &= (cpu->V << 6);
-	byte &= (cpu->N << 7);
-	
-	return byte;
+static CPU_INLINE uint8_t write_status_flag(Cpu *cpu)
+{
+	return get_status_flags(cpu) | FLAG_U; // Unused flag always set to 1
+}
+
+/* Interrupts were just unmasked, end the run so a held IRQ gets taken */
+static CPU_INLINE void check_irq(Cpu *cpu)
+{
+	if (cpu->irq_lines && !(cpu->P & FLAG_I))
+		cpu->deadline = 0;
 }
 
 /* Reading a byte into the status flags */
-static void read_status_flag(Cpu *cpu, uint8_t byte)
+static CPU_INLINE void read_status_flag(Cpu *cpu, uint8_t byte)
 {
-	cpu->C = byte & 1;
-	cpu->Z = byte & 2;
-	cpu->I = byte & 4;
-	cpu->D = byte & 8;
-	cpu->B = byte & 16;
-	cpu->V = byte & 64;
-	cpu->N = byte & 128;
+	set_status_flags(cpu, byte);
+}
+
+/* Fetch the operand bytes that follow the opcode */
+static CPU_INLINE uint16_t fetch_operand(Cpu *cpu, int addr_mode)
+{
+	switch (addr_mode)
+	{
+		case implied:
+		case accumulator:
+			return read_byte(cpu, cpu->PC);
+
+		case absolute:
+		case absolute_x:
+		case absolute_y:
+		case indirect:
+		{
+			uint8_t low = read_byte(cpu, cpu->PC++);
+			uint8_t high = read_byte(cpu, cpu->PC++);
+			return (high << 8) | low;
+		}
+
+		default:
+			return read_byte(cpu, cpu->PC++);
+	}
+}
+
+/* Number of bytes the instruction occupies, opcode included */
+int instruction_length(int addr_mode)
+{
+	switch (addr_mode)
+	{
+		case implied:
+		case accumulator:
+			return 1;
+
+		case absolute:
+		case absolute_x:
+		case absolute_y:
+		case indirect:
+			return 3;
+
+		default:
+			return 2;
+	}
 }
 
 /* Fetch memory location for instruction's operations */
-static uint16_t fetch_instruction_addr(Cpu *cpu, int addr_mode, bool is_read)
+static CPU_INLINE uint16_t fetch_instruction_addr(Cpu *cpu, int addr_mode, uint16_t operand, bool is_read)
 {
 	uint16_t memory_addr = 0;
 
@@ -84,21 +157,16 @@ static uint16_t fetch_instruction_addr(Cpu *cpu, int addr_mode, bool is_read)
 	{
 		case implied:
 		case accumulator:
-			memory_addr = read_byte(cpu, cpu->PC);
-			break;
-		
 		case immediate:
 		case relative:
-			memory_addr = read_byte(cpu, cpu->PC++);
-			break;
-
 		case zero_page:
-			memory_addr = read_byte(cpu, cpu->PC++);
+		case absolute:
+			memory_addr = operand;
 			break;
 
 		case zero_page_x:
 		{
-			uint8_t addr = read_byte(cpu, cpu->PC++);
+			uint8_t addr = operand;
 			read_byte(cpu, (0x00FF | addr));
 			addr += cpu->X;
 			memory_addr = (0x00FF | addr);
@@ -107,25 +175,17 @@ static uint16_t fetch_instruction_addr(Cpu *cpu, int addr_mode, bool is_read)
 
 		case zero_page_y:
 		{
-			uint8_t addr = read_byte(cpu, cpu->PC++);
+			uint8_t addr = operand;
 			read_byte(cpu, (0x00FF | addr));
 			addr += cpu->Y;
 			memory_addr = (0x00FF | addr);
 			break;
 		}
 
-		case absolute:
-		{
-			uint8_t low = read_byte(cpu, cpu->PC++);
-			uint8_t high = read_byte(cpu, cpu->PC++);
-			memory_addr = (high << 8) | low;
-			break;
-		}
-
 		case absolute_x:
 		{
-			uint8_t low = read_byte(cpu, cpu->PC++);
-			uint8_t high = read_byte(cpu, cpu->PC++);
+			uint8_t low = operand & 0x00FF;
+			uint8_t high = (operand & 0xFF00) >> 8;
 			uint8_t new_low = low + cpu->X;
 			
 			if (new_low < low)
@@ -146,8 +206,8 @@ static uint16_t fetch_instruction_addr(Cpu *cpu, int addr_mode, bool is_read)
 
 		case absolute_y:
 		{
-			uint8_t low = read_byte(cpu, cpu->PC++);
-			uint8_t high = read_byte(cpu, cpu->PC++);
+			uint8_t low = operand & 0x00FF;
+			uint8_t high = (operand & 0xFF00) >> 8;
 			uint8_t new_low = low + cpu->Y;
 			
 			if (new_low < low)
@@ -166,17 +226,15 @@ static uint16_t fetch_instruction_addr(Cpu *cpu, int addr_mode, bool is_read)
 
 		case indirect:
 		{
-			uint8_t pointer_low = read_byte(cpu, cpu->PC++);
-			uint8_t pointer_high = read_byte(cpu, cpu->PC++);
-			uint8_t addr_low = read_byte(cpu, (pointer_high << 8) | pointer_low);
-			uint8_t addr_high = read_byte(cpu, ((pointer_high << 8) | pointer_low) + 1);
+			uint8_t addr_low = read_byte(cpu, operand);
+			uint8_t addr_high = read_byte(cpu, operand + 1);
 			memory_addr = (addr_high << 8) | addr_low;
 			break;
 		}
 
 		case indirect_x:
 		{
-			uint8_t pointer_addr = read_byte(cpu, cpu->PC++);
+			uint8_t pointer_addr = operand;
 			read_byte(cpu, (0x0000 | pointer_addr));
 			pointer_addr += cpu->X;
 			uint8_t low = read_byte(cpu, (0x0000 | pointer_addr));
@@ -187,7 +245,7 @@ static uint16_t fetch_instruction_addr(Cpu *cpu, int addr_mode, bool is_read)
 
 		case indirect_y:
 		{
-			uint8_t pointer_addr = read_byte(cpu, cpu->PC++);
+			uint8_t pointer_addr = operand;
 			uint8_t addr_low = read_byte(cpu, (0x0000 | pointer_addr));
 			uint8_t addr_high = read_byte(cpu, (0x0000 | pointer_addr) + 1);
 			uint8_t new_low = addr_low + cpu->Y;
@@ -210,9 +268,8 @@ static uint16_t fetch_instruction_addr(Cpu *cpu, int addr_mode, bool is_read)
 	return memory_addr;
 }
 
-void branch(Cpu *cpu, bool condition)
+static CPU_INLINE void branch(Cpu *cpu, uint8_t operand, bool condition)
 {
-	uint8_t operand = (uint8_t) fetch_instruction_addr(cpu, relative, false);
 	uint8_t PCL = (cpu->PC & 0x00FF);
 	uint8_t PCH = (cpu->PC & 0xFF00) >> 8;
 	uint8_t new_PCL = PCL + operand;
@@ -235,10 +292,10 @@ void branch(Cpu *cpu, bool condition)
 	cpu->PC += 1;
 }
 
-void BRK(Cpu *cpu, int addr_mode)
+CPU_INLINE void BRK(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, immediate, false); // So that we read and increment PC
-	cpu->B = 1;
+	cpu->PC ++; // Skip the padding byte after the opcode
+	cpu->P |= FLAG_B;
 	uint8_t PCH = (cpu->PC & 0xFF00) >> 8;
 	uint8_t PCL = (cpu->PC & 0x00FF);
 	push_stack(cpu, PCH);
@@ -249,205 +306,205 @@ void BRK(Cpu *cpu, int addr_mode)
 	cpu->PC = (PCH << 8) | PCL;
 }
 
-void RTI(Cpu *cpu, int addr_mode)
+CPU_INLINE void RTI(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	cpu->cycle_count -= 1;
+	// pop_stack charges a stack pointer increment for every pull
+	cpu->cycle_count -= 2;
 	read_status_flag(cpu, pop_stack(cpu));
 	uint8_t PCL = pop_stack(cpu);
 	uint8_t PCH = pop_stack(cpu);
 	cpu->PC = (PCH << 8) | PCL;
+	check_irq(cpu);
 }
 
-void LDA(Cpu *cpu, int addr_mode)
+CPU_INLINE void LDA(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, true);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, true);
 	uint8_t byte = read_byte(cpu, addr);
 	cpu->A = byte;
 	set_negative_and_zero(cpu, cpu->A);
 }
 
-void LDX(Cpu *cpu, int addr_mode)
+CPU_INLINE void LDX(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, true);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, true);
 	uint8_t byte = read_byte(cpu, addr);
 	cpu->X = byte;
 	set_negative_and_zero(cpu, cpu->X);
 }
 
-void LDY(Cpu *cpu, int addr_mode)
+CPU_INLINE void LDY(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, true);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, true);
 	uint8_t byte = read_byte(cpu, addr);
 	cpu->Y = byte;
 	set_negative_and_zero(cpu, cpu->Y);
 }
 
-void STA(Cpu *cpu, int addr_mode)
+CPU_INLINE void STA(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, false);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, false);
 	write_byte(cpu, addr, cpu->A);
 }
 
-void STX(Cpu *cpu, int addr_mode)
+CPU_INLINE void STX(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, false);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, false);
 	write_byte(cpu, addr, cpu->X);
 }
 
-void STY(Cpu *cpu, int addr_mode)
+CPU_INLINE void STY(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, false);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, false);
 	write_byte(cpu, addr, cpu->Y);
 }
 
-void TAX(Cpu *cpu, int addr_mode)
+CPU_INLINE void TAX(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	cpu->X = cpu->A;
 	set_negative_and_zero(cpu, cpu->X);
 }
 
-void TAY(Cpu *cpu, int addr_mode)
+CPU_INLINE void TAY(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	cpu->Y = cpu->A;
 	set_negative_and_zero(cpu, cpu->Y);
 }
 
-void TSX(Cpu *cpu, int addr_mode)
+CPU_INLINE void TSX(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	cpu->X = cpu->SP;
 	set_negative_and_zero(cpu, cpu->X);
 }
 
-void TXA(Cpu *cpu, int addr_mode)
+CPU_INLINE void TXA(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	cpu->A = cpu->X;
 	set_negative_and_zero(cpu, cpu->A);
 }
 
-void TXS(Cpu *cpu, int addr_mode)
+CPU_INLINE void TXS(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	cpu->SP = cpu->X;
 }
 
-void TYA(Cpu *cpu, int addr_mode)
+CPU_INLINE void TYA(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	cpu->A = cpu->Y;
 	set_negative_and_zero(cpu, cpu->A);
 }
 
-void PHA(Cpu *cpu, int addr_mode)
+CPU_INLINE void PHA(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	push_stack(cpu, cpu->A);
 }
 
-void PHP(Cpu *cpu, int addr_mode)
+CPU_INLINE void PHP(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	push_stack(cpu, write_status_flag(cpu));
 }
 
-void PLA(Cpu *cpu, int addr_mode)
+CPU_INLINE void PLA(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	cpu->A = pop_stack(cpu);
 	set_negative_and_zero(cpu, cpu->A);
 }
 
-void PLP(Cpu *cpu, int addr_mode)
+CPU_INLINE void PLP(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	read_status_flag(cpu, pop_stack(cpu));
+	check_irq(cpu);
 }
 
-void AND(Cpu *cpu, int addr_mode)
+CPU_INLINE void AND(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, true);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, true);
 	uint8_t byte = read_byte(cpu, addr);
 	cpu->A &= byte;
 	set_negative_and_zero(cpu, cpu->A);
 }
 
-void EOR(Cpu *cpu, int addr_mode)
+CPU_INLINE void EOR(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, true);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, true);
 	uint8_t byte = read_byte(cpu, addr);
 	cpu->A ^= byte;
 	set_negative_and_zero(cpu, cpu->A);
 }
 
-void ORA(Cpu *cpu, int addr_mode)
+CPU_INLINE void ORA(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, true);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, true);
 	uint8_t byte = read_byte(cpu, addr);
 	cpu->A |= byte;
 	set_negative_and_zero(cpu, cpu->A);
 }
 
-void BIT(Cpu *cpu, int addr_mode)
+CPU_INLINE void BIT(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, true);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, true);
 	uint8_t byte = read_byte(cpu, addr);
 	uint8_t temp_and = cpu->A & byte;
 
-	cpu->Z = (temp_and == 0);
-	cpu->V = (byte & 0x40) != 0;
-	cpu->N = (byte & 0x80) != 0;
+	// Z comes from A & M while N is bit 7 of M, bit 8 carries N when both are set
+	cpu->nz_result = temp_and | ((byte & 0x80) << 1);
+	set_flag(cpu, FLAG_V, (byte & 0x40) != 0);
 }
 
-void ADC(Cpu *cpu, int addr_mode)
+CPU_INLINE void ADC(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, true);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, true);
 	uint8_t byte = read_byte(cpu, addr);
 	add_with_carry(cpu, byte);
 }
 
-void SBC(Cpu *cpu, int addr_mode)
+CPU_INLINE void SBC(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, true);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, true);
 	uint8_t byte = read_byte(cpu, addr);
 	add_with_carry(cpu, (255 - byte));
 }
 
-void CMP(Cpu *cpu, int addr_mode)
+CPU_INLINE void CMP(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, true);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, true);
 	uint8_t byte = read_byte(cpu, addr);
 	uint8_t result = cpu->A - byte;
-	cpu->C = (cpu->A >= byte);
-	cpu->Z = (cpu->A == byte);
-	cpu->N = (result & 0x80) != 0;
+	set_carry(cpu, cpu->A >= byte);
+	set_negative_and_zero(cpu, result);
 }
 
-void CPX(Cpu *cpu, int addr_mode)
+CPU_INLINE void CPX(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, true);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, true);
 	uint8_t byte = read_byte(cpu, addr);
 	uint8_t result = cpu->X - byte;
-	cpu->C = (cpu->X >= byte);
-	cpu->Z = (cpu->X == byte);
-	cpu->N = (result & 0x80) != 0;
+	set_carry(cpu, cpu->X >= byte);
+	set_negative_and_zero(cpu, result);
 }
 
-void CPY(Cpu *cpu, int addr_mode)
+CPU_INLINE void CPY(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, true);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, true);
 	uint8_t byte = read_byte(cpu, addr);
 	uint8_t result = cpu->Y - byte;
-	cpu->C = (cpu->Y >= byte);
-	cpu->Z = (cpu->Y == byte);
-	cpu->N = (result & 0x80) != 0;
+	set_carry(cpu, cpu->Y >= byte);
+	set_negative_and_zero(cpu, result);
 }
 
-void INC(Cpu *cpu, int addr_mode)
+CPU_INLINE void INC(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, false);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, false);
 	uint8_t byte = read_byte(cpu, addr);
 	write_byte(cpu, addr, byte);
 	byte += 1;
@@ -456,9 +513,9 @@ void INC(Cpu *cpu, int addr_mode)
 	set_negative_and_zero(cpu, byte);
 }
 
-void DEC(Cpu *cpu, int addr_mode)
+CPU_INLINE void DEC(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, false);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, false);
 	uint8_t byte = read_byte(cpu, addr);
 	write_byte(cpu, addr, byte);
 	byte -= 1;
@@ -467,41 +524,41 @@ void DEC(Cpu *cpu, int addr_mode)
 	set_negative_and_zero(cpu, byte);
 }
 
-void INX(Cpu *cpu, int addr_mode)
+CPU_INLINE void INX(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	cpu->X += 1;
 	set_negative_and_zero(cpu, cpu->X);
 }
 
-void INY(Cpu *cpu, int addr_mode)
+CPU_INLINE void INY(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	cpu->Y += 1;
 	set_negative_and_zero(cpu, cpu->Y);
 }
 
-void DEX(Cpu *cpu, int addr_mode)
+CPU_INLINE void DEX(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	cpu->X -= 1;
 	set_negative_and_zero(cpu, cpu->X);
 }
 
-void DEY(Cpu *cpu, int addr_mode)
+CPU_INLINE void DEY(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	cpu->Y -= 1;
 	set_negative_and_zero(cpu, cpu->Y);
 }
 
-void ASL(Cpu *cpu, int addr_mode)
+CPU_INLINE void ASL(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, false);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, false);
 
 	if (addr_mode == accumulator)
 	{
-		cpu->C = (cpu->A & 0x80) != 0;
+		set_carry(cpu, (cpu->A & 0x80) != 0);
 		cpu->A = cpu->A << 1;
 		set_negative_and_zero(cpu, cpu->A);
 		return;
@@ -509,20 +566,20 @@ void ASL(Cpu *cpu, int addr_mode)
 
 	uint8_t byte = read_byte(cpu, addr);
 	write_byte(cpu, addr, byte);
-	cpu->C = (byte & 0x80) != 0;
+	set_carry(cpu, (byte & 0x80) != 0);
 
 	byte = byte << 1;
 	write_byte(cpu, addr, byte);
 	set_negative_and_zero(cpu, byte);
 }
 
-void LSR(Cpu *cpu, int addr_mode)
+CPU_INLINE void LSR(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, false);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, false);
 
 	if (addr_mode == accumulator)
 	{
-		cpu->C = (cpu->A & 0x01) != 0;
+		set_carry(cpu, (cpu->A & 0x01) != 0);
 		cpu->A = cpu->A >> 1;
 		set_negative_and_zero(cpu, cpu->A);
 		return;
@@ -530,23 +587,23 @@ void LSR(Cpu *cpu, int addr_mode)
 
 	uint8_t byte = read_byte(cpu, addr);
 	write_byte(cpu, addr, byte);
-	cpu->C = (byte & 0x01) != 0;
+	set_carry(cpu, (byte & 0x01) != 0);
 
 	byte = byte >> 1;
 	write_byte(cpu, addr, byte);
 	set_negative_and_zero(cpu, byte);
 }
 
-void ROL(Cpu *cpu, int addr_mode)
+CPU_INLINE void ROL(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, false);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, false);
 
 	if (addr_mode == accumulator)
 	{
 		uint8_t old_bit_7 = (cpu->A & 0x80) != 0;
 		cpu->A = cpu->A << 1;
-		cpu->A |= cpu->C;
-		cpu->C = old_bit_7;
+		cpu->A |= cpu->P & FLAG_C;
+		set_carry(cpu, old_bit_7);
 		set_negative_and_zero(cpu, cpu->A);
 		return;
 	}
@@ -556,23 +613,23 @@ void ROL(Cpu *cpu, int addr_mode)
 	
 	uint8_t old_bit_7 = (byte & 0x80) != 0;
 	byte = byte << 1;
-	byte |= cpu->C;
-	cpu->C = old_bit_7;
+	byte |= cpu->P & FLAG_C;
+	set_carry(cpu, old_bit_7);
 
 	write_byte(cpu, addr, byte);
 	set_negative_and_zero(cpu, byte);
 }	
 
-void ROR(Cpu *cpu, int addr_mode)
+CPU_INLINE void ROR(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, false);
+	uint16_t addr = fetch_instruction_addr(cpu, addr_mode, operand, false);
 
 	if (addr_mode == accumulator)
 	{
 		uint8_t old_bit_0 = (cpu->A & 0x01) != 0;
 		cpu->A = cpu->A >> 1;
-		cpu->A |= (cpu->C == 1) << 7;
-		cpu->C = old_bit_0;
+		cpu->A |= (cpu->P & FLAG_C) << 7;
+		set_carry(cpu, old_bit_0);
 		set_negative_and_zero(cpu, cpu->A);
 		return;
 	}
@@ -582,132 +639,389 @@ void ROR(Cpu *cpu, int addr_mode)
 	
 	uint8_t old_bit_0 = (byte & 0x01) != 0;
 	byte = byte >> 1;
-	byte |= (cpu->C == 1) << 7;
-	cpu->C = old_bit_0;
+	byte |= (cpu->P & FLAG_C) << 7;
+	set_carry(cpu, old_bit_0);
 
 	write_byte(cpu, addr, byte);
 	set_negative_and_zero(cpu, byte);
 }	
 
-void JMP(Cpu *cpu, int addr_mode)
+/* Idle loops: games wait for vblank or their NMI handler by spinning on
+   a flag, and close the loop with a JMP back (branches can't go back
+   here). Loops that only read are fast-forwarded in whole trips, stopping
+   short of the deadline so the rest runs exactly as it would have */
+#define IDLE_LOOP_MAX_BYTES 16
+
+static bool idle_instruction(void (*instruction)(Cpu *cpu, int addr_mode, uint16_t operand), int addr_mode)
+{
+	static void (*const allowed[])(Cpu *cpu, int addr_mode, uint16_t operand) = {
+		&LDA, &LDX, &LDY, &BIT, &AND, &ORA, &EOR, &ADC, &SBC, &CMP, &CPX, &CPY,
+		&TAX, &TAY, &TXA, &TYA, &TSX, &INX, &INY, &DEX, &DEY,
+		&CLC, &SEC, &CLV, &CLD, &SED, &NOP,
+		&BCC, &BCS, &BNE, &BEQ, &BPL, &BMI, &BVC, &BVS,
+	};
+
+	if (instruction == &ASL || instruction == &LSR || instruction == &ROL || instruction == &ROR)
+		return addr_mode == accumulator;
+
+	for (unsigned i = 0; i < sizeof(allowed) / sizeof(allowed[0]); i++)
+		if (allowed[i] == instruction)
+			return true;
+	return false;
+}
+
+static uint64_t read_idle_until(Cpu *cpu, uint16_t addr)
+{
+	SharedMemory *mem = cpu->memspace;
+	if (mem->read_pages[addr >> 8] != NULL)
+		return EVENT_NEVER; // Only the CPU writes memory
+
+	IoHandler *handler = mem->io_handlers[mem->io_pages[addr >> 8]];
+	if (handler == NULL)
+		return EVENT_NEVER; // Open bus
+	return handler->idle_until != NULL ? handler->idle_until(handler->context, addr) : 0;
+}
+
+/* Until when every trip around the loop reads the same values, 0 if it
+   does anything but read memory and registers */
+static uint64_t idle_loop_until(Cpu *cpu)
+{
+	SharedMemory *mem = cpu->memspace;
+	IdleLoop *loop = &cpu->idle;
+	uint64_t until = EVENT_NEVER;
+
+	if (mem->read_pages[loop->start >> 8] == NULL || mem->read_pages[(loop->end - 1) >> 8] == NULL)
+		return 0;
+
+	uint16_t pc = loop->start;
+	while (pc < loop->end - 3)
+	{
+		uint8_t opcode = peek_cpu_memory(mem, pc);
+		int addr_mode = addressing_modes[opcode];
+		int length = instruction_length(addr_mode);
+		uint16_t operand = peek_cpu_memory(mem, pc + 1);
+		if (length == 3)
+			operand |= peek_cpu_memory(mem, pc + 2) << 8;
+		pc += length;
+
+		if (!idle_instruction(opcodes[opcode], addr_mode))
+			return 0;
+
+		uint16_t addr;
+		switch (addr_mode)
+		{
+			case implied:
+			case accumulator:
+			case relative:
+				continue;
+
+			// Immediate operands are resolved as zero page addresses
+			case immediate:
+			case zero_page:   addr = operand & 0xFF; break;
+			case zero_page_x: addr = (operand + cpu->X) & 0xFF; break;
+			case zero_page_y: addr = (operand + cpu->Y) & 0xFF; break;
+			case absolute:    addr = operand; break;
+			case absolute_x:  addr = operand + cpu->X; break;
+			case absolute_y:  addr = operand + cpu->Y; break;
+			default:          return 0;
+		}
+
+		// Indexed reads crossing a page touch the wrong page first
+		uint64_t first = read_idle_until(cpu, (operand & 0xFF00) | (addr & 0xFF));
+		uint64_t second = read_idle_until(cpu, addr);
+		until = first < until ? first : until;
+		until = second < until ? second : until;
+	}
+
+	// Decoding has to land on the JMP back
+	return pc == loop->end - 3 ? until : 0;
+}
+
+/* Called on every short jump back. Once two trips in a row took the same
+   cycles and instructions and ended with the same registers, the loop is
+   a pure function of memory it only reads, so until the next event (or
+   the polled register changing) every trip is the same as the last */
+static void skip_idle_loop(Cpu *cpu, uint16_t end)
+{
+	IdleLoop *loop = &cpu->idle;
+	uint64_t now = cpu_time(cpu);
+	uint64_t period = now - loop->time;
+	uint64_t instructions = cpu->instruction_count - loop->instructions;
+
+	bool same = loop->start == cpu->PC && loop->end == end &&
+		loop->A == cpu->A && loop->X == cpu->X && loop->Y == cpu->Y &&
+		loop->SP == cpu->SP && loop->P == cpu->P && loop->nz_result == cpu->nz_result;
+
+	loop->time = now;
+	loop->instructions = cpu->instruction_count;
+	if (!same || period != loop->period || instructions != loop->period_instructions)
+	{
+		loop->start = cpu->PC;
+		loop->end = end;
+		loop->A = cpu->A;
+		loop->X = cpu->X;
+		loop->Y = cpu->Y;
+		loop->SP = cpu->SP;
+		loop->P = cpu->P;
+		loop->nz_result = cpu->nz_result;
+		loop->period = same ? period : 0;
+		loop->period_instructions = instructions;
+		return;
+	}
+
+	// Traces, logs and profiles want every instruction
+	if (cpu->tracer != NULL || cpu->should_log || cpu->profile != NULL)
+		return;
+
+	int room = cpu->deadline - 1 - cpu->cycle_count;
+	uint64_t until = idle_loop_until(cpu);
+	if (room <= 0 || until <= now)
+		return;
+	if (until - now > (uint64_t) room)
+		until = now + room;
+
+	uint64_t trips = (until - now) / period;
+	cpu->cycle_count += trips * period;
+	cpu->instruction_count += trips * instructions;
+	cpu->idle_cycles += trips * period;
+	loop->time += trips * period;
+	loop->instructions += trips * instructions;
+}
+
+CPU_INLINE void JMP(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	uint16_t jmp_addr = fetch_instruction_addr(cpu, addr_mode, false);
+	uint16_t jmp_addr = fetch_instruction_addr(cpu, addr_mode, operand, false);
+	uint16_t end = cpu->PC;
 	cpu->PC = jmp_addr;
+
+	if (addr_mode == absolute && cpu->skip_idle_loops &&
+	    jmp_addr < end && end - jmp_addr <= IDLE_LOOP_MAX_BYTES)
+		skip_idle_loop(cpu, end);
 }
 
-void JSR(Cpu *cpu, int addr_mode)
+CPU_INLINE void JSR(Cpu *cpu, int addr_mode, uint16_t operand)
 {
 	cpu->cycle_count ++;
-	uint16_t jmp_addr = fetch_instruction_addr(cpu, addr_mode, false);
+	uint16_t jmp_addr = fetch_instruction_addr(cpu, addr_mode, operand, false);
 	push_stack(cpu, (cpu->PC & 0xFF00) >> 8);
 	push_stack(cpu, (uint8_t) (cpu->PC & 0x00FF) - 1);
 	cpu->PC = jmp_addr;
 }
 
-void RTS(Cpu *cpu, int addr_mode)
+CPU_INLINE void RTS(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 	uint8_t pc_low = pop_stack(cpu);
 	uint8_t pc_high = pop_stack(cpu);
 	cpu->PC = (pc_high << 8) | pc_low;
 	cpu->PC ++;
 }
 
-void BCC(Cpu *cpu, int addr_mode)
+CPU_INLINE void BCC(Cpu *cpu, int addr_mode, uint16_t operand)
+{
+	branch(cpu, operand, !(cpu->P & FLAG_C));
+}
+
+CPU_INLINE void BCS(Cpu *cpu, int addr_mode, uint16_t operand)
+{
+	branch(cpu, operand, (cpu->P & FLAG_C));
+}
+
+CPU_INLINE void BNE(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	branch(cpu, (cpu->C == 0));
+	branch(cpu, operand, !flag_zero(cpu));
 }
 
-void BCS(Cpu *cpu, int addr_mode)
+CPU_INLINE void BEQ(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	branch(cpu, (cpu->C == 1));
+	branch(cpu, operand, flag_zero(cpu));
 }
 
-void BNE(Cpu *cpu, int addr_mode)
+CPU_INLINE void BPL(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	branch(cpu, (cpu->Z == 0));
+	branch(cpu, operand, !flag_negative(cpu));
 }
 
-void BEQ(Cpu *cpu, int addr_mode)
+CPU_INLINE void BMI(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	branch(cpu, (cpu->Z == 1));
+	branch(cpu, operand, flag_negative(cpu));
 }
 
-void BPL(Cpu *cpu, int addr_mode)
+CPU_INLINE void BVC(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	branch(cpu, (cpu->N == 0));
+	branch(cpu, operand, !(cpu->P & FLAG_V));
 }
 
-void BMI(Cpu *cpu, int addr_mode)
+CPU_INLINE void BVS(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	branch(cpu, (cpu->N == 1));
+	branch(cpu, operand, (cpu->P & FLAG_V));
 }
 
-void BVC(Cpu *cpu, int addr_mode)
+CPU_INLINE void CLC(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	branch(cpu, (cpu->V == 0));
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
+	cpu->P &= ~FLAG_C;
 }
 
-void BVS(Cpu *cpu, int addr_mode)
+CPU_INLINE void CLI(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	branch(cpu, (cpu->V == 1));
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
+	cpu->P &= ~FLAG_I;
+	check_irq(cpu);
 }
 
-void CLC(Cpu *cpu, int addr_mode)
+CPU_INLINE void CLD(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
-	cpu->C = 0;
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
+	cpu->P &= ~FLAG_D;
 }
 
-void CLI(Cpu *cpu, int addr_mode)
+CPU_INLINE void CLV(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
-	cpu->I = 0;
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
+	cpu->P &= ~FLAG_V;
 }
 
-void CLD(Cpu *cpu, int addr_mode)
+CPU_INLINE void SEC(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
-	cpu->D = 0;
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
+	cpu->P |= FLAG_C;
 }
 
-void CLV(Cpu *cpu, int addr_mode)
+CPU_INLINE void SEI(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
-	cpu->V = 0;
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
+	cpu->P |= FLAG_I;
 }
 
-void SEC(Cpu *cpu, int addr_mode)
+CPU_INLINE void SED(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
-	cpu->C = 1;
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
+	cpu->P |= FLAG_D;
 }
 
-void SEI(Cpu *cpu, int addr_mode)
+CPU_INLINE void NOP(Cpu *cpu, int addr_mode, uint16_t operand)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
-	cpu->I = 0;
+	fetch_instruction_addr(cpu, addr_mode, operand, false);
 }
 
-void SED(Cpu *cpu, int addr_mode)
+#define OPCODE_FUNCTION(code, instruction, mode) [code] = &instruction,
+#define OPCODE_ADDRESSING_MODE(code, instruction, mode) [code] = mode,
+#define OPCODE_NAME(code, instruction, mode) [code] = #instruction,
+
+void (*const opcodes[256]) (Cpu *cpu, int addr_mode, uint16_t operand) = {
+	CPU_OPCODE_TABLE(OPCODE_FUNCTION)
+};
+
+const int addressing_modes[256] = {
+	CPU_OPCODE_TABLE(OPCODE_ADDRESSING_MODE)
+};
+
+const char *const opcode_names[256] = {
+	CPU_OPCODE_TABLE(OPCODE_NAME)
+};
+
+#define OPCODE_HANDLER_FUNCTION(code, instruction, mode) \
+	static void handler_##code(Cpu *cpu, uint16_t operand) \
+	{ \
+		instruction(cpu, mode, operand); \
+	}
+#define OPCODE_HANDLER_ENTRY(code, instruction, mode) [code] = &handler_##code,
+
+CPU_OPCODE_TABLE(OPCODE_HANDLER_FUNCTION)
+
+// Per-opcode handlers with the addressing mode baked in
+void (*const cpu_opcode_handlers[256])(Cpu *cpu, uint16_t operand) = {
+	CPU_OPCODE_TABLE(OPCODE_HANDLER_ENTRY)
+};
+
+/* Look up where a page of code starts in the decoded PRG. Instructions
+   keep coming from the same page, so this only runs on jumps between
+   pages and bank switches */
+static void find_code_page(Cpu *cpu, uint8_t *page)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
-	cpu->D = 1;
+	size_t offset = (uintptr_t) page - (uintptr_t) cpu->decoded.rom;
+	cpu->code_page = page;
+	cpu->code_base = offset < cpu->decoded.size ? &cpu->decoded.instructions[offset] : NULL;
 }
 
-void NOP(Cpu *cpu, int addr_mode)
+/* The decoded instruction at PC, when PC is in PRG ROM and the operand
+   bytes are the ones that follow it in ROM. NULL for code anywhere else
+   (RAM, PRG-RAM, I/O) and for operands crossing into another bank */
+static CPU_INLINE const DecodedInstruction *lookup_instruction(Cpu *cpu)
 {
-	fetch_instruction_addr(cpu, addr_mode, false);
+	uint8_t **pages = cpu->memspace->read_pages;
+	uint8_t *page = pages[cpu->PC >> 8];
+	if (page != cpu->code_page)
+		find_code_page(cpu, page);
+	if (cpu->code_base == NULL)
+		return NULL;
+
+	const DecodedInstruction *entry = &cpu->code_base[cpu->PC & 0xFF];
+	if ((cpu->PC & 0xFF) + entry->length > CPU_PAGE_SIZE &&
+	    pages[((cpu->PC >> 8) + 1) & 0xFF] != page + CPU_PAGE_SIZE)
+		return NULL;
+
+	// Account for the opcode and operand reads we skipped
+	// (single byte instructions still do a dummy read)
+	cpu->cycle_count += entry->length + (entry->length == 1);
+	cpu->PC += entry->length;
+	return entry;
 }
 
-void init_cpu(Cpu *cpu, SharedMemory *mem, bool debug_state)
+bool decode_prg(DecodedPrg *prg, const uint8_t *rom, size_t size)
+{
+	prg->rom = rom;
+	prg->size = size;
+	prg->instructions = malloc(size * sizeof(DecodedInstruction));
+	if (prg->instructions == NULL)
+	{
+		printf("Unable to allocate the instruction decode cache\n");
+		prg->size = 0;
+		return false;
+	}
+
+	for (size_t i = 0; i < size; i++)
+	{
+		DecodedInstruction *entry = &prg->instructions[i];
+		entry->opcode = rom[i];
+		entry->length = instruction_length(addressing_modes[rom[i]]);
+		// Past the end of ROM, lookup_instruction() never uses these bytes
+		entry->operand = i + 1 < size ? rom[i + 1] : 0;
+		if (entry->length == 3 && i + 2 < size)
+			entry->operand |= rom[i + 2] << 8;
+	}
+	return true;
+}
+
+void free_decoded_prg(DecodedPrg *prg)
+{
+	free(prg->instructions);
+	memset(prg, 0, sizeof(DecodedPrg));
+}
+
+void init_cpu(Cpu *cpu, SharedMemory *mem, char *log_file)
 {
 	cpu->cycle_count = 0;
+	cpu->frame_count = 0;
+	cpu->instruction_count = 0;
+	cpu->deadline = 0;
+	cpu->nmi_pending = false;
+	cpu->irq_lines = 0;
+	cpu->skip_idle_loops = true;
+	memset(&cpu->idle, 0, sizeof(IdleLoop));
+	cpu->idle_cycles = 0;
+	init_scheduler(&cpu->scheduler);
 	cpu->memspace = mem;
+	cpu->jit = NULL;
+	cpu->tracer = NULL;
+	cpu->profile = NULL;
 
-	cpu->should_log = debug_state;
-	if (cpu->should_log)
-		init_logger(&cpu->logger, "debug.log");
+	memset(&cpu->decoded, 0, sizeof(DecodedPrg));
+	cpu->code_page = NULL;
+	cpu->code_base = NULL;
+
+	cpu->should_log = log_file != NULL && init_logger(&cpu->logger, log_file);
 	
 	cpu->PC = 0xFFFC;
 	cpu->SP = 0xFD;
@@ -723,15 +1037,205 @@ void cleanup_cpu(Cpu *cpu)
 		cleanup_logger(&cpu->logger);
 }
 
-static void (*instruction)(Cpu *cpu, int addr_mode);
-void execute_cpu_instructions(Cpu *cpu)
+void step_cpu(Cpu *cpu)
 {
-	while (cpu->cycle_count < CPU_CYCLES_PER_FRAME)
+	cpu->instruction_count ++;
+	const DecodedInstruction *entry = lookup_instruction(cpu);
+	if (entry != NULL)
+	{
+		cpu_opcode_handlers[entry->opcode](cpu, entry->operand);
+		return;
+	}
+
+	uint8_t opcode = read_byte(cpu, cpu->PC++);
+	int addr_mode = addressing_modes[opcode];
+	opcodes[opcode](cpu, addr_mode, fetch_operand(cpu, addr_mode));
+}
+
+void interpret_cpu_instructions(Cpu *cpu)
+{
+#ifdef CPU_COMPUTED_GOTO
+	// Each opcode gets its own copy of the instruction body with the
+	// addressing mode baked in, and its own indirect jump to the next opcode.
+	// Instructions coming from the decode cache skip straight to execute_XX
+	// with the cached operand.
+	#define OPCODE_FETCH_LABEL(code, instruction, mode) [code] = &&fetch_##code,
+	#define OPCODE_EXECUTE_LABEL(code, instruction, mode) [code] = &&execute_##code,
+	static const void *const fetch_table[256] = {
+		CPU_OPCODE_TABLE(OPCODE_FETCH_LABEL)
+	};
+	static const void *const execute_table[256] = {
+		CPU_OPCODE_TABLE(OPCODE_EXECUTE_LABEL)
+	};
+	uint16_t operand = 0;
+	uint8_t opcode;
+	const DecodedInstruction *entry;
+	PROFILE_LOCALS
+
+	#define DISPATCH() \
+		if (cpu->cycle_count >= cpu->deadline) return; \
+		cpu->instruction_count ++; \
+		PROFILE_FETCH(cpu) \
+		entry = lookup_instruction(cpu); \
+		if (entry != NULL) \
+		{ \
+			PROFILE_INSTRUCTION(cpu, entry->opcode) \
+			operand = entry->operand; \
+			goto *execute_table[entry->opcode]; \
+		} \
+		opcode = read_byte(cpu, cpu->PC++); \
+		PROFILE_INSTRUCTION(cpu, opcode) \
+		goto *fetch_table[opcode];
+
+	#define OPCODE_HANDLER(code, instruction, mode) \
+		fetch_##code: operand = fetch_operand(cpu, mode); \
+		execute_##code: instruction(cpu, mode, operand); DISPATCH();
+
+	DISPATCH();
+	CPU_OPCODE_TABLE(OPCODE_HANDLER)
+
+	#undef OPCODE_HANDLER
+	#undef DISPATCH
+	#undef OPCODE_EXECUTE_LABEL
+	#undef OPCODE_FETCH_LABEL
+#else
+	PROFILE_LOCALS
+	while (cpu->cycle_count < cpu->deadline)
 	{
+		cpu->instruction_count ++;
+		PROFILE_FETCH(cpu)
+		const DecodedInstruction *entry = lookup_instruction(cpu);
+		if (entry != NULL)
+		{
+			PROFILE_INSTRUCTION(cpu, entry->opcode)
+			cpu_opcode_handlers[entry->opcode](cpu, entry->operand);
+			continue;
+		}
+
 		uint8_t opcode = read_byte(cpu, cpu->PC++);
+		PROFILE_INSTRUCTION(cpu, opcode)
 		int addr_mode = addressing_modes[opcode];
 		
-		instruction = opcodes[opcode];
-		(*instruction)(cpu, addr_mode);
+		void (*instruction)(Cpu *cpu, int addr_mode, uint16_t operand) = opcodes[opcode];
+		(*instruction)(cpu, addr_mode, fetch_operand(cpu, addr_mode));
 	}
-}
\ No newline at end of file
+#endif
+}
+
+/* One nestest.log style line for the instruction at PC */
+static void log_instruction(Cpu *cpu)
+{
+	TraceRecord record;
+	char line[128];
+	capture_trace_record(cpu, &record);
+	format_trace_record(&record, line, sizeof(line) - 1);
+	strcat(line, "\n");
+	write_log(&cpu->logger, line);
+}
+
+static void run_until_deadline(Cpu *cpu)
+{
+	if (cpu->tracer != NULL || cpu->should_log)
+	{
+		while (cpu->cycle_count < cpu->deadline)
+		{
+			if (cpu->tracer != NULL)
+				trace_instruction(cpu->tracer, cpu);
+			if (cpu->should_log)
+				log_instruction(cpu);
+			step_cpu(cpu);
+		}
+		return;
+	}
+
+#ifdef CPU_PROFILE
+	if (cpu->jit != NULL && cpu->profile == NULL)
+#else
+	if (cpu->jit != NULL)
+#endif
+	{
+		execute_jit_instructions(cpu->jit, cpu);
+		return;
+	}
+
+	interpret_cpu_instructions(cpu);
+}
+
+/* Push PC and P and jump through the vector, the same sequence as BRK
+   without the B flag */
+static void take_interrupt(Cpu *cpu, uint16_t vector)
+{
+#ifdef CPU_PROFILE
+	if (cpu->profile != NULL)
+		profile_interrupt(cpu->profile, cpu, peek_cpu_memory(cpu->memspace, vector) |
+			(peek_cpu_memory(cpu->memspace, vector + 1) << 8));
+#endif
+	cpu->cycle_count += 2; // Opcode and operand reads that get thrown away
+	push_stack(cpu, (cpu->PC & 0xFF00) >> 8);
+	push_stack(cpu, cpu->PC & 0x00FF);
+	push_stack(cpu, write_status_flag(cpu) & ~FLAG_B);
+	cpu->P |= FLAG_I;
+
+	uint8_t PCL = read_byte(cpu, vector);
+	uint8_t PCH = read_byte(cpu, vector + 1);
+	cpu->PC = (PCH << 8) | PCL;
+}
+
+static void poll_interrupts(Cpu *cpu)
+{
+	if (cpu->nmi_pending)
+	{
+		cpu->nmi_pending = false;
+		take_interrupt(cpu, 0xFFFA);
+	}
+	else if (cpu->irq_lines && !(cpu->P & FLAG_I))
+	{
+		take_interrupt(cpu, 0xFFFE);
+	}
+}
+
+void trigger_nmi(Cpu *cpu)
+{
+	cpu->nmi_pending = true;
+	cpu->deadline = 0;
+}
+
+void set_irq(Cpu *cpu, uint8_t source, bool asserted)
+{
+	if (asserted)
+		cpu->irq_lines |= source;
+	else
+		cpu->irq_lines &= ~source;
+	check_irq(cpu);
+}
+
+void execute_cpu_instructions(Cpu *cpu)
+{
+	uint64_t frame_start = cpu->frame_count * CPU_CYCLES_PER_FRAME;
+
+	// Run in stretches between scheduled events, the CPU only stops
+	// early when an interrupt line changes under it
+	while (cpu->cycle_count < CPU_CYCLES_PER_FRAME)
+	{
+		run_due_events(&cpu->scheduler, frame_start + cpu->cycle_count);
+		poll_interrupts(cpu);
+
+		// Events can change what a polling loop reads without it
+		// reading anything, so the trips it is checked on can't span one
+		cpu->idle.end = 0;
+
+		uint64_t next = cpu->scheduler.next - frame_start;
+		cpu->deadline = next < CPU_CYCLES_PER_FRAME ? (int) next : CPU_CYCLES_PER_FRAME;
+		run_until_deadline(cpu);
+	}
+
+	// The last instruction can run past the frame, carry the overshoot
+	cpu->cycle_count -= CPU_CYCLES_PER_FRAME;
+	cpu->frame_count ++;
+
+#ifdef CPU_PROFILE
+	// The instruction still being timed started in the frame that just ended
+	if (cpu->profile != NULL)
+		cpu->profile->last_cycle -= CPU_CYCLES_PER_FRAME;
+#endif
+}
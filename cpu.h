@@ -19,11 +19,67 @@ Ideas
 #define CPU_H_
 
 #include "log.h"
+#include "scheduler.h"
 #include "shared_mem.h"
 #include <stdbool.h>
 #include <stdint.h>
 
-#define CPU_CYCLES_PER_FRAME 1
+// NTSC: 341 * 262 / 3 PPU dots, override with -DCPU_CYCLES_PER_FRAME=n
+#ifndef CPU_CYCLES_PER_FRAME
+#define CPU_CYCLES_PER_FRAME 29781
+#endif
+
+// Where the JIT looks for code to translate, its blocks are indexed by PC
+#define DECODE_CACHE_START 0x8000
+#define DECODE_CACHE_SIZE  0x8000
+
+/* Processor status flags, as laid out in P */
+#define FLAG_C 0x01 // Carry
+#define FLAG_Z 0x02 // Zero
+#define FLAG_I 0x04 // Interrupt disable
+#define FLAG_D 0x08 // Decimal
+#define FLAG_B 0x10 // Break
+#define FLAG_U 0x20 // Unused
+#define FLAG_V 0x40 // Overflow
+#define FLAG_N 0x80 // Negative
+
+/* Devices that can hold the IRQ line low, bits in irq_lines */
+#define IRQ_MAPPER 0x01
+#define IRQ_FRAME  0x02 // APU frame counter
+#define IRQ_DMC    0x04
+
+struct cpu;
+struct jit;
+struct tracer;
+struct profile;
+
+typedef struct decoded_instruction {
+	uint16_t operand; // Operand bytes, little endian
+	uint8_t opcode;
+	uint8_t length;   // Opcode and operand bytes
+} DecodedInstruction;
+
+/* PRG ROM decoded as if an instruction started at every byte. Only
+   depends on the ROM bytes, so it's built once per cartridge and read
+   by any number of instances, whatever banks they have mapped */
+typedef struct decoded_prg {
+	const uint8_t *rom;
+	size_t size;
+	DecodedInstruction *instructions; // One per ROM byte
+} DecodedPrg;
+
+// The short loop the CPU last jumped back into, see skip_idle_loop()
+typedef struct idle_loop {
+	uint16_t start;
+	uint16_t end; // Just past the JMP back to start, 0 for no loop
+	uint8_t A, X, Y, SP, P;
+	uint16_t nz_result;
+
+	uint64_t time;         // cpu_time() at the last jump back
+	uint64_t instructions; // instruction_count then
+	uint64_t period;       // Cycles the trip before that took, 0 if unknown
+	uint64_t period_instructions;
+} IdleLoop;
 
 typedef struct cpu {
 	uint8_t A;   // Accumulator
@@ -32,20 +88,34 @@ typedef struct cpu {
 	uint8_t SP;  // Stack pointer
 	uint16_t PC; // Program counter
 
-	/* Processor status flags */
-	uint8_t C; // Carry
-	uint8_t Z; // Zero
-	uint8_t I; // Interrupt disable
-	uint8_t D; // Decimal
-	uint8_t B; // Break
-	uint8_t V; // Overflow
-	uint8_t N; // Negative
+	/* Processor status flags. N and Z are evaluated lazily from the last
+	   result, so their bits in P are stale; use get_status_flags() */
+	uint8_t P;
+	uint16_t nz_result; // Z if the low byte is 0, N if bit 7 or 8 is set
 	
-	int cycle_count;
+	int cycle_count;            // Cycles into the current frame
+	int deadline;               // cycle_count at which to stop for the scheduler
+	uint64_t frame_count;
+	uint64_t instruction_count; // Instructions executed since init_cpu
+	Scheduler scheduler;
+
+	bool nmi_pending;  // Edge triggered, taken before the next instruction
+	uint8_t irq_lines; // Level triggered, taken while FLAG_I is clear
+
+	bool skip_idle_loops; // Fast-forward through polling loops, on by default
+	IdleLoop idle;
+	uint64_t idle_cycles; // Skipped so far
+
 	SharedMemory *memspace;
+	DecodedPrg decoded; // Shared, owned by whoever loaded the ROM. Empty runs everything uncached
+	uint8_t *code_page; // read_pages entry the last instruction came from
+	const DecodedInstruction *code_base; // Its decoded bytes, NULL when it isn't PRG ROM
+	struct jit *jit; // Optional dynamic recompiler, NULL to interpret
+	struct tracer *tracer; // Optional binary trace, forces the interpreter
+	struct profile *profile; // Only looked at in CPU_PROFILE builds
 
 	Logger logger;
-	bool should_log;
+	bool should_log; // A nestest.log style line per instruction, forces the interpreter
 } Cpu;
 
 enum addressing_modes {
@@ -65,107 +135,192 @@ enum addressing_modes {
 };
 
 // Official instructions
-void LDA(Cpu *cpu, int addr_mode); // Load accumulator 
-void LDX(Cpu *cpu, int addr_mode); // Load X register
-void LDY(Cpu *cpu, int addr_mode); // Load Y register 
-void STA(Cpu *cpu, int addr_mode); // Store accumulator
-void STX(Cpu *cpu, int addr_mode); // Store X register
-void STY(Cpu *cpu, int addr_mode); // Store Y register
-void TAX(Cpu *cpu, int addr_mode); // Transfer accumulator to X
-void TAY(Cpu *cpu, int addr_mode); // Transfer accumulator to Y
-void TXA(Cpu *cpu, int addr_mode); // Transfer X to accumulator
-void TYA(Cpu *cpu, int addr_mode); // Transfer Y to accumulator
-void TSX(Cpu *cpu, int addr_mode); // Transfer SP to X
-void TXS(Cpu *cpu, int addr_mode); // Transfer X to SP
-void PHA(Cpu *cpu, int addr_mode); // Push accumulator to stack
-void PHP(Cpu *cpu, int addr_mode); // Push processor status to stack
-void PLA(Cpu *cpu, int addr_mode); // Pull accumulator from stack
-void PLP(Cpu *cpu, int addr_mode); // Pull processor status from stack
-void AND(Cpu *cpu, int addr_mode); // AND
-void EOR(Cpu *cpu, int addr_mode); // XOR
-void ORA(Cpu *cpu, int addr_mode); // OR
-void BIT(Cpu *cpu, int addr_mode); // Bit test
-void ADC(Cpu *cpu, int addr_mode); // Add with carry
-void SBC(Cpu *cpu, int addr_mode); // Subtract with carry
-void CMP(Cpu *cpu, int addr_mode); // Compare accumulator
-void CPX(Cpu *cpu, int addr_mode); // Compare X register
-void CPY(Cpu *cpu, int addr_mode); // Compare Y register
-void INC(Cpu *cpu, int addr_mode); // Increment value in memory
-void INX(Cpu *cpu, int addr_mode); // Increment X register 
-void INY(Cpu *cpu, int addr_mode); // Increment Y register 
-void DEC(Cpu *cpu, int addr_mode); // Decrement value in memory
-void DEX(Cpu *cpu, int addr_mode); // Decrement X register
-void DEY(Cpu *cpu, int addr_mode); // Decrement Y register
-void ASL(Cpu *cpu, int addr_mode); // Arithmetic shift left
-void LSR(Cpu *cpu, int addr_mode); // Arithmetic shift right
-void ROL(Cpu *cpu, int addr_mode); // Rotate left
-void ROR(Cpu *cpu, int addr_mode); // Rotate right
-void JMP(Cpu *cpu, int addr_mode); // Jump
-void JSR(Cpu *cpu, int addr_mode); // Jump to subroutine
-void RTS(Cpu *cpu, int addr_mode); // Return from subroutine
-void BCC(Cpu *cpu, int addr_mode); // Branch if carry flag clear
-void BCS(Cpu *cpu, int addr_mode); // Branch if carry flag set
-void BNE(Cpu *cpu, int addr_mode); // Branch if zero flag clear
-void BEQ(Cpu *cpu, int addr_mode); // Branch if zero flag set
-void BPL(Cpu *cpu, int addr_mode); // Branch if negative flag clear
-void BMI(Cpu *cpu, int addr_mode); // Branch if negative flag set
-void BVC(Cpu *cpu, int addr_mode); // Branch if overflow flag clear
-void BVS(Cpu *cpu, int addr_mode); // Branch if overflow flag set
-void CLC(Cpu *cpu, int addr_mode); // Clear carry flag
-void CLD(Cpu *cpu, int addr_mode); // Clear decimal flag
-void CLI(Cpu *cpu, int addr_mode); // Clear interrupt disable
-void CLV(Cpu *cpu, int addr_mode); // Clear overflow flag
-void SEC(Cpu *cpu, int addr_mode); // Set carry flag
-void SED(Cpu *cpu, int addr_mode); // Set deciaml flag
-void SEI(Cpu *cpu, int addr_mode); // Set interrupt disable
-void BRK(Cpu *cpu, int addr_mode); // Break
-void NOP(Cpu *cpu, int addr_mode); // No operation
-void RTI(Cpu *cpu, int addr_mode); // Return from interrupt
-
-// For now we're replacing unofficial instructions
-// with NOP
-static void (*opcodes[256]) (Cpu *cpu, int addr_mode) = {
-	// 0,    1,    2,    3,    4,    5,   6,     7,    8,    9,   A,     B,    C,    D,   E,     F
-	&BRK, &ORA, &NOP, &NOP, &NOP, &ORA, &ASL, &NOP, &PHP, &ORA, &ASL, &NOP, &NOP, &ORA, &ASL, &NOP, // 0
-	&BPL, &ORA, &NOP, &NOP, &NOP, &ORA, &ASL, &NOP, &CLC, &ORA, &NOP, &NOP, &NOP, &ORA, &ASL, &NOP, // 1
-	&JSR, &AND, &NOP, &NOP, &BIT, &AND, &ROL, &NOP, &PLP, &AND, &ROL, &NOP, &BIT, &AND, &ROL, &NOP, // 2
-	&BMI, &AND, &NOP, &NOP, &NOP, &AND, &ROL, &NOP, &SEC, &AND, &NOP, &NOP, &NOP, &AND, &ROL, &NOP, // 3
-	&RTI, &EOR, &NOP, &NOP, &NOP, &EOR, &LSR, &NOP, &PHA, &EOR, &LSR, &NOP, &JMP, &EOR, &LSR, &NOP, // 4
-	&BVC, &EOR, &NOP, &NOP, &NOP, &EOR, &LSR, &NOP, &CLI, &EOR, &NOP, &NOP, &NOP, &EOR, &LSR, &NOP, // 5
-	&RTS, &ADC, &NOP, &NOP, &NOP, &ADC, &ROR, &NOP, &PLA, &ADC, &ROR, &NOP, &JMP, &ADC, &ROR, &NOP, // 6
-	&BVS, &ADC, &NOP, &NOP, &NOP, &ADC, &ROR, &NOP, &SEI, &ADC, &NOP, &NOP, &NOP, &ADC, &ROR, &NOP, // 7
-	&NOP, &STA, &NOP, &NOP, &STY, &STA, &STX, &NOP, &DEY, &NOP, &TXA, &NOP, &STY, &STA, &STX, &NOP, // 8
-	&BCC, &STA, &NOP, &NOP, &STY, &STA, &STX, &NOP, &TYA, &STA, &TXS, &NOP, &NOP, &STA, &NOP, &NOP, // 9
-	&LDY, &LDA, &LDX, &NOP, &LDY, &LDA, &LDX, &NOP, &TAY, &LDA, &TAX, &NOP, &LDY, &LDA, &LDX, &NOP, // A
-	&BCS, &LDA, &NOP, &NOP, &LDY, &LDA, &LDX, &NOP, &CLV, &LDA, &TSX, &NOP, &LDY, &LDA, &LDX, &NOP, // B
-	&CPY, &CMP, &NOP, &NOP, &CPY, &CMP, &DEC, &NOP, &INY, &CMP, &DEX, &NOP, &CPY, &CMP, &DEX, &NOP, // C
-	&BNE, &CMP, &NOP, &NOP, &NOP, &CMP, &DEC, &NOP, &CLD, &CMP, &NOP, &NOP, &NOP, &CMP, &DEC, &NOP, // D
-	&CPX, &SBC, &NOP, &NOP, &CPX, &SBC, &INC, &NOP, &INX, &SBC, &NOP, &NOP, &CPX, &SBC, &INC, &NOP, // E
-	&BEQ, &SBC, &NOP, &NOP, &NOP, &SBC, &INC, &NOP, &SED, &SBC, &NOP, &NOP, &NOP, &SBC, &INC, &NOP  // F
-};
+void LDA(Cpu *cpu, int addr_mode, uint16_t operand); // Load accumulator 
+void LDX(Cpu *cpu, int addr_mode, uint16_t operand); // Load X register
+void LDY(Cpu *cpu, int addr_mode, uint16_t operand); // Load Y register 
+void STA(Cpu *cpu, int addr_mode, uint16_t operand); // Store accumulator
+void STX(Cpu *cpu, int addr_mode, uint16_t operand); // Store X register
+void STY(Cpu *cpu, int addr_mode, uint16_t operand); // Store Y register
+void TAX(Cpu *cpu, int addr_mode, uint16_t operand); // Transfer accumulator to X
+void TAY(Cpu *cpu, int addr_mode, uint16_t operand); // Transfer accumulator to Y
+void TXA(Cpu *cpu, int addr_mode, uint16_t operand); // Transfer X to accumulator
+void TYA(Cpu *cpu, int addr_mode, uint16_t operand); // Transfer Y to accumulator
+void TSX(Cpu *cpu, int addr_mode, uint16_t operand); // Transfer SP to X
+void TXS(Cpu *cpu, int addr_mode, uint16_t operand); // Transfer X to SP
+void PHA(Cpu *cpu, int addr_mode, uint16_t operand); // Push accumulator to stack
+void PHP(Cpu *cpu, int addr_mode, uint16_t operand); // Push processor status to stack
+void PLA(Cpu *cpu, int addr_mode, uint16_t operand); // Pull accumulator from stack
+void PLP(Cpu *cpu, int addr_mode, uint16_t operand); // Pull processor status from stack
+void AND(Cpu *cpu, int addr_mode, uint16_t operand); // AND
+void EOR(Cpu *cpu, int addr_mode, uint16_t operand); // XOR
+void ORA(Cpu *cpu, int addr_mode, uint16_t operand); // OR
+void BIT(Cpu *cpu, int addr_mode, uint16_t operand); // Bit test
+void ADC(Cpu *cpu, int addr_mode, uint16_t operand); // Add with carry
+void SBC(Cpu *cpu, int addr_mode, uint16_t operand); // Subtract with carry
+void CMP(Cpu *cpu, int addr_mode, uint16_t operand); // Compare accumulator
+void CPX(Cpu *cpu, int addr_mode, uint16_t operand); // Compare X register
+void CPY(Cpu *cpu, int addr_mode, uint16_t operand); // Compare Y register
+void INC(Cpu *cpu, int addr_mode, uint16_t operand); // Increment value in memory
+void INX(Cpu *cpu, int addr_mode, uint16_t operand); // Increment X register 
+void INY(Cpu *cpu, int addr_mode, uint16_t operand); // Increment Y register 
+void DEC(Cpu *cpu, int addr_mode, uint16_t operand); // Decrement value in memory
+void DEX(Cpu *cpu, int addr_mode, uint16_t operand); // Decrement X register
+void DEY(Cpu *cpu, int addr_mode, uint16_t operand); // Decrement Y register
+void ASL(Cpu *cpu, int addr_mode, uint16_t operand); // Arithmetic shift left
+void LSR(Cpu *cpu, int addr_mode, uint16_t operand); // Arithmetic shift right
+void ROL(Cpu *cpu, int addr_mode, uint16_t operand); // Rotate left
+void ROR(Cpu *cpu, int addr_mode, uint16_t operand); // Rotate right
+void JMP(Cpu *cpu, int addr_mode, uint16_t operand); // Jump
+void JSR(Cpu *cpu, int addr_mode, uint16_t operand); // Jump to subroutine
+void RTS(Cpu *cpu, int addr_mode, uint16_t operand); // Return from subroutine
+void BCC(Cpu *cpu, int addr_mode, uint16_t operand); // Branch if carry flag clear
+void BCS(Cpu *cpu, int addr_mode, uint16_t operand); // Branch if carry flag set
+void BNE(Cpu *cpu, int addr_mode, uint16_t operand); // Branch if zero flag clear
+void BEQ(Cpu *cpu, int addr_mode, uint16_t operand); // Branch if zero flag set
+void BPL(Cpu *cpu, int addr_mode, uint16_t operand); // Branch if negative flag clear
+void BMI(Cpu *cpu, int addr_mode, uint16_t operand); // Branch if negative flag set
+void BVC(Cpu *cpu, int addr_mode, uint16_t operand); // Branch if overflow flag clear
+void BVS(Cpu *cpu, int addr_mode, uint16_t operand); // Branch if overflow flag set
+void CLC(Cpu *cpu, int addr_mode, uint16_t operand); // Clear carry flag
+void CLD(Cpu *cpu, int addr_mode, uint16_t operand); // Clear decimal flag
+void CLI(Cpu *cpu, int addr_mode, uint16_t operand); // Clear interrupt disable
+void CLV(Cpu *cpu, int addr_mode, uint16_t operand); // Clear overflow flag
+void SEC(Cpu *cpu, int addr_mode, uint16_t operand); // Set carry flag
+void SED(Cpu *cpu, int addr_mode, uint16_t operand); // Set deciaml flag
+void SEI(Cpu *cpu, int addr_mode, uint16_t operand); // Set interrupt disable
+void BRK(Cpu *cpu, int addr_mode, uint16_t operand); // Break
+void NOP(Cpu *cpu, int addr_mode, uint16_t operand); // No operation
+void RTI(Cpu *cpu, int addr_mode, uint16_t operand); // Return from interrupt
 
-static int addressing_modes[256] = {
-//0   1  2   3  4  5  6  7  8  9  A  B   C  D  E  F
-	0, 11, 0, 11, 3, 3, 3, 3, 0, 2, 1, 2,  7, 7, 7, 7, // 0
-	6, 12, 0, 12, 4, 4, 4, 4, 0, 9, 0, 9,  8, 8, 8, 8, // 1
-	7, 11, 0, 11, 3, 3, 3, 3, 0, 2, 1, 2,  7, 7, 7, 7, // 2
-	6, 12, 0, 12, 4, 4, 4, 4, 0, 9, 0, 9,  8, 8, 8, 8, // 3
-	0, 11, 0, 11, 3, 3, 3, 3, 0, 2, 1, 2,  7, 7, 7, 7, // 4
-	6, 12, 0, 12, 4, 4, 4, 4, 0, 9, 0, 9,  8, 8, 8, 8, // 5
-	0, 11, 0, 11, 3, 3, 3, 3, 0, 2, 1, 2, 10, 7, 7, 7, // 6
-	6, 12, 0, 12, 4, 4, 4, 4, 0, 9, 0, 9,  8, 8, 8, 8, // 7
-	2, 11, 2, 11, 3, 3, 3, 3, 0, 2, 0, 2,  8, 8, 8, 8, // 8
-	6, 12, 0, 12, 4, 4, 5, 5, 0, 9, 0, 9,  8, 8, 9, 9, // 9
-	2, 11, 2, 11, 3, 3, 3, 3, 0, 2, 0, 2,  7, 7, 7, 7, // A
-	6, 12, 0, 12, 4, 4, 5, 5, 0, 9, 0, 9,  8, 8, 9, 9, // B
-	2, 11, 2, 11, 3, 3, 3, 3, 0, 2, 0, 2,  7, 7, 7, 7, // C
-	6, 12, 0, 12, 4, 4, 4, 4, 0, 9, 0, 9,  8, 8, 8, 8, // D
-	2, 11, 2, 11, 3, 3, 3, 3, 0, 2, 0, 2,  7, 7, 7, 7, // E
-	6, 12, 0, 12, 4, 4, 4, 4, 0, 9, 0, 9,  8, 8, 8, 8  // F
-};
+// Opcode table: X(opcode, instruction, addressing mode) for all 256 opcodes.
+// Everything that dispatches on an opcode is generated from this list, so the
+// addressing mode of each opcode is known at compile time.
+// For now we're replacing unofficial instructions with NOP
+#define CPU_OPCODE_TABLE(X) \
+	X(0x00, BRK, implied) X(0x01, ORA, indirect_x) X(0x02, NOP, implied) X(0x03, NOP, indirect_x) \
+	X(0x04, NOP, zero_page) X(0x05, ORA, zero_page) X(0x06, ASL, zero_page) X(0x07, NOP, zero_page) \
+	X(0x08, PHP, implied) X(0x09, ORA, immediate) X(0x0A, ASL, accumulator) X(0x0B, NOP, immediate) \
+	X(0x0C, NOP, absolute) X(0x0D, ORA, absolute) X(0x0E, ASL, absolute) X(0x0F, NOP, absolute) \
+	X(0x10, BPL, relative) X(0x11, ORA, indirect_y) X(0x12, NOP, implied) X(0x13, NOP, indirect_y) \
+	X(0x14, NOP, zero_page_x) X(0x15, ORA, zero_page_x) X(0x16, ASL, zero_page_x) X(0x17, NOP, zero_page_x) \
+	X(0x18, CLC, implied) X(0x19, ORA, absolute_y) X(0x1A, NOP, implied) X(0x1B, NOP, absolute_y) \
+	X(0x1C, NOP, absolute_x) X(0x1D, ORA, absolute_x) X(0x1E, ASL, absolute_x) X(0x1F, NOP, absolute_x) \
+	X(0x20, JSR, absolute) X(0x21, AND, indirect_x) X(0x22, NOP, implied) X(0x23, NOP, indirect_x) \
+	X(0x24, BIT, zero_page) X(0x25, AND, zero_page) X(0x26, ROL, zero_page) X(0x27, NOP, zero_page) \
+	X(0x28, PLP, implied) X(0x29, AND, immediate) X(0x2A, ROL, accumulator) X(0x2B, NOP, immediate) \
+	X(0x2C, BIT, absolute) X(0x2D, AND, absolute) X(0x2E, ROL, absolute) X(0x2F, NOP, absolute) \
+	X(0x30, BMI, relative) X(0x31, AND, indirect_y) X(0x32, NOP, implied) X(0x33, NOP, indirect_y) \
+	X(0x34, NOP, zero_page_x) X(0x35, AND, zero_page_x) X(0x36, ROL, zero_page_x) X(0x37, NOP, zero_page_x) \
+	X(0x38, SEC, implied) X(0x39, AND, absolute_y) X(0x3A, NOP, implied) X(0x3B, NOP, absolute_y) \
+	X(0x3C, NOP, absolute_x) X(0x3D, AND, absolute_x) X(0x3E, ROL, absolute_x) X(0x3F, NOP, absolute_x) \
+	X(0x40, RTI, implied) X(0x41, EOR, indirect_x) X(0x42, NOP, implied) X(0x43, NOP, indirect_x) \
+	X(0x44, NOP, zero_page) X(0x45, EOR, zero_page) X(0x46, LSR, zero_page) X(0x47, NOP, zero_page) \
+	X(0x48, PHA, implied) X(0x49, EOR, immediate) X(0x4A, LSR, accumulator) X(0x4B, NOP, immediate) \
+	X(0x4C, JMP, absolute) X(0x4D, EOR, absolute) X(0x4E, LSR, absolute) X(0x4F, NOP, absolute) \
+	X(0x50, BVC, relative) X(0x51, EOR, indirect_y) X(0x52, NOP, implied) X(0x53, NOP, indirect_y) \
+	X(0x54, NOP, zero_page_x) X(0x55, EOR, zero_page_x) X(0x56, LSR, zero_page_x) X(0x57, NOP, zero_page_x) \
+	X(0x58, CLI, implied) X(0x59, EOR, absolute_y) X(0x5A, NOP, implied) X(0x5B, NOP, absolute_y) \
+	X(0x5C, NOP, absolute_x) X(0x5D, EOR, absolute_x) X(0x5E, LSR, absolute_x) X(0x5F, NOP, absolute_x) \
+	X(0x60, RTS, implied) X(0x61, ADC, indirect_x) X(0x62, NOP, implied) X(0x63, NOP, indirect_x) \
+	X(0x64, NOP, zero_page) X(0x65, ADC, zero_page) X(0x66, ROR, zero_page) X(0x67, NOP, zero_page) \
+	X(0x68, PLA, implied) X(0x69, ADC, immediate) X(0x6A, ROR, accumulator) X(0x6B, NOP, immediate) \
+	X(0x6C, JMP, indirect) X(0x6D, ADC, absolute) X(0x6E, ROR, absolute) X(0x6F, NOP, absolute) \
+	X(0x70, BVS, relative) X(0x71, ADC, indirect_y) X(0x72, NOP, implied) X(0x73, NOP, indirect_y) \
+	X(0x74, NOP, zero_page_x) X(0x75, ADC, zero_page_x) X(0x76, ROR, zero_page_x) X(0x77, NOP, zero_page_x) \
+	X(0x78, SEI, implied) X(0x79, ADC, absolute_y) X(0x7A, NOP, implied) X(0x7B, NOP, absolute_y) \
+	X(0x7C, NOP, absolute_x) X(0x7D, ADC, absolute_x) X(0x7E, ROR, absolute_x) X(0x7F, NOP, absolute_x) \
+	X(0x80, NOP, immediate) X(0x81, STA, indirect_x) X(0x82, NOP, immediate) X(0x83, NOP, indirect_x) \
+	X(0x84, STY, zero_page) X(0x85, STA, zero_page) X(0x86, STX, zero_page) X(0x87, NOP, zero_page) \
+	X(0x88, DEY, implied) X(0x89, NOP, immediate) X(0x8A, TXA, implied) X(0x8B, NOP, immediate) \
+	X(0x8C, STY, absolute_x) X(0x8D, STA, absolute_x) X(0x8E, STX, absolute_x) X(0x8F, NOP, absolute_x) \
+	X(0x90, BCC, relative) X(0x91, STA, indirect_y) X(0x92, NOP, implied) X(0x93, NOP, indirect_y) \
+	X(0x94, STY, zero_page_x) X(0x95, STA, zero_page_x) X(0x96, STX, zero_page_y) X(0x97, NOP, zero_page_y) \
+	X(0x98, TYA, implied) X(0x99, STA, absolute_y) X(0x9A, TXS, implied) X(0x9B, NOP, absolute_y) \
+	X(0x9C, NOP, absolute_x) X(0x9D, STA, absolute_x) X(0x9E, NOP, absolute_y) X(0x9F, NOP, absolute_y) \
+	X(0xA0, LDY, immediate) X(0xA1, LDA, indirect_x) X(0xA2, LDX, immediate) X(0xA3, NOP, indirect_x) \
+	X(0xA4, LDY, zero_page) X(0xA5, LDA, zero_page) X(0xA6, LDX, zero_page) X(0xA7, NOP, zero_page) \
+	X(0xA8, TAY, implied) X(0xA9, LDA, immediate) X(0xAA, TAX, implied) X(0xAB, NOP, immediate) \
+	X(0xAC, LDY, absolute) X(0xAD, LDA, absolute) X(0xAE, LDX, absolute) X(0xAF, NOP, absolute) \
+	X(0xB0, BCS, relative) X(0xB1, LDA, indirect_y) X(0xB2, NOP, implied) X(0xB3, NOP, indirect_y) \
+	X(0xB4, LDY, zero_page_x) X(0xB5, LDA, zero_page_x) X(0xB6, LDX, zero_page_y) X(0xB7, NOP, zero_page_y) \
+	X(0xB8, CLV, implied) X(0xB9, LDA, absolute_y) X(0xBA, TSX, implied) X(0xBB, NOP, absolute_y) \
+	X(0xBC, LDY, absolute_x) X(0xBD, LDA, absolute_x) X(0xBE, LDX, absolute_y) X(0xBF, NOP, absolute_y) \
+	X(0xC0, CPY, immediate) X(0xC1, CMP, indirect_x) X(0xC2, NOP, immediate) X(0xC3, NOP, indirect_x) \
+	X(0xC4, CPY, zero_page) X(0xC5, CMP, zero_page) X(0xC6, DEC, zero_page) X(0xC7, NOP, zero_page) \
+	X(0xC8, INY, implied) X(0xC9, CMP, immediate) X(0xCA, DEX, implied) X(0xCB, NOP, immediate) \
+	X(0xCC, CPY, absolute) X(0xCD, CMP, absolute) X(0xCE, DEX, absolute) X(0xCF, NOP, absolute) \
+	X(0xD0, BNE, relative) X(0xD1, CMP, indirect_y) X(0xD2, NOP, implied) X(0xD3, NOP, indirect_y) \
+	X(0xD4, NOP, zero_page_x) X(0xD5, CMP, zero_page_x) X(0xD6, DEC, zero_page_x) X(0xD7, NOP, zero_page_x) \
+	X(0xD8, CLD, implied) X(0xD9, CMP, absolute_y) X(0xDA, NOP, implied) X(0xDB, NOP, absolute_y) \
+	X(0xDC, NOP, absolute_x) X(0xDD, CMP, absolute_x) X(0xDE, DEC, absolute_x) X(0xDF, NOP, absolute_x) \
+	X(0xE0, CPX, immediate) X(0xE1, SBC, indirect_x) X(0xE2, NOP, immediate) X(0xE3, NOP, indirect_x) \
+	X(0xE4, CPX, zero_page) X(0xE5, SBC, zero_page) X(0xE6, INC, zero_page) X(0xE7, NOP, zero_page) \
+	X(0xE8, INX, implied) X(0xE9, SBC, immediate) X(0xEA, NOP, implied) X(0xEB, NOP, immediate) \
+	X(0xEC, CPX, absolute) X(0xED, SBC, absolute) X(0xEE, INC, absolute) X(0xEF, NOP, absolute) \
+	X(0xF0, BEQ, relative) X(0xF1, SBC, indirect_y) X(0xF2, NOP, implied) X(0xF3, NOP, indirect_y) \
+	X(0xF4, NOP, zero_page_x) X(0xF5, SBC, zero_page_x) X(0xF6, INC, zero_page_x) X(0xF7, NOP, zero_page_x) \
+	X(0xF8, SED, implied) X(0xF9, SBC, absolute_y) X(0xFA, NOP, implied) X(0xFB, NOP, absolute_y) \
+	X(0xFC, NOP, absolute_x) X(0xFD, SBC, absolute_x) X(0xFE, INC, absolute_x) X(0xFF, NOP, absolute_x)
+
+// Generic instruction and addressing mode for every opcode, defined in cpu.c
+extern void (*const opcodes[256]) (Cpu *cpu, int addr_mode, uint16_t operand);
+extern const int addressing_modes[256];
+extern const char *const opcode_names[256];
+
+static inline bool flag_zero(Cpu *cpu)
+{
+	return (cpu->nz_result & 0x00FF) == 0;
+}
+
+static inline bool flag_negative(Cpu *cpu)
+{
+	return (cpu->nz_result & 0x0180) != 0;
+}
+
+static inline uint8_t get_status_flags(Cpu *cpu)
+{
+	uint8_t status = cpu->P & ~(FLAG_N | FLAG_Z);
+	if (flag_zero(cpu)) status |= FLAG_Z;
+	if (flag_negative(cpu)) status |= FLAG_N;
+	return status;
+}
+
+static inline void set_status_flags(Cpu *cpu, uint8_t status)
+{
+	cpu->P = status;
+	cpu->nz_result = ((status & FLAG_N) << 1) | !(status & FLAG_Z);
+}
 
-void execute_cpu_instructions(Cpu *cpu);
+// Absolute time in CPU cycles, the scheduler's clock
+static inline uint64_t cpu_time(Cpu *cpu)
+{
+	return cpu->frame_count * CPU_CYCLES_PER_FRAME + cpu->cycle_count;
+}
+
+// For I/O handlers that scheduled an event: the CPU is running towards
+// a deadline picked before, stop after this instruction and pick again
+static inline void reschedule_cpu(Cpu *cpu)
+{
+	cpu->deadline = 0;
+}
+
+// Per-opcode handlers taking an already fetched operand
+extern void (*const cpu_opcode_handlers[256])(Cpu *cpu, uint16_t operand);
+
+int instruction_length(int addr_mode);
+void step_cpu(Cpu *cpu); // Execute a single instruction
+void interpret_cpu_instructions(Cpu *cpu); // Up to the deadline, never through the JIT
+void execute_cpu_instructions(Cpu *cpu); // Run one frame
+
+/* Interrupt lines, safe to call from event and I/O handlers. The CPU
+   notices after the instruction it's in the middle of */
+void trigger_nmi(Cpu *cpu);
+void set_irq(Cpu *cpu, uint8_t source, bool asserted);
 void cleanup_cpu(Cpu *cpu);
-void init_cpu(Cpu *cpu, SharedMemory *mem, bool debug_state);
+void init_cpu(Cpu *cpu, SharedMemory *mem, char *log_file); // NULL log_file to disable logging
+
+// Decode ROM for any number of CPUs to share, through their `decoded`
+bool decode_prg(DecodedPrg *prg, const uint8_t *rom, size_t size);
+void free_decoded_prg(DecodedPrg *prg);
 
 #endif
\ No newline at end of file
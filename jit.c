@@ -0,0 +1,601 @@
+#include "jit.h"
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+
+// Cpu* lives in rbx for the whole block, rax/rcx/rdx are scratch
+#define REG_AL 0
+#define REG_CL 1
+#define REG_DL 2
+#define REG_BASE_RAX 0
+#define REG_BASE_RBX 3
+
+#define CPU_FIELD(field) ((int32_t) offsetof(Cpu, field))
+
+// Largest number of cycles any single instruction takes in cpu.c
+#define JIT_MAX_INSTRUCTION_CYCLES 8
+
+// Enough room for the longest instruction sequence we emit
+#define JIT_MAX_INSTRUCTION_BYTES 96
+
+static void emit8(Jit *jit, uint8_t byte)
+{
+	jit->code[jit->code_used++] = byte;
+}
+
+static void emit16(Jit *jit, uint16_t value)
+{
+	emit8(jit, value & 0xFF);
+	emit8(jit, value >> 8);
+}
+
+static void emit32(Jit *jit, uint32_t value)
+{
+	emit16(jit, value & 0xFFFF);
+	emit16(jit, value >> 16);
+}
+
+static void emit64(Jit *jit, uint64_t value)
+{
+	emit32(jit, value & 0xFFFFFFFF);
+	emit32(jit, value >> 32);
+}
+
+/* opcode with a [base + disp32] memory operand */
+static void emit_mem(Jit *jit, uint8_t opcode, int reg, int base, int32_t disp)
+{
+	emit8(jit, opcode);
+	emit8(jit, 0x80 | (reg << 3) | base);
+	emit32(jit, disp);
+}
+
+/* mov r8, [rbx + field] */
+static void emit_load_field(Jit *jit, int reg, int32_t field)
+{
+	emit_mem(jit, 0x8A, reg, REG_BASE_RBX, field);
+}
+
+/* mov [rbx + field], r8 */
+static void emit_store_field(Jit *jit, int reg, int32_t field)
+{
+	emit_mem(jit, 0x88, reg, REG_BASE_RBX, field);
+}
+
+#define CC_NB 0x3 // Not below (no borrow)
+
+/* Record reg as the result N and Z are evaluated from */
+static void emit_negative_and_zero(Jit *jit, int reg)
+{
+	// movzx reg32, reg8
+	emit8(jit, 0x0F); emit8(jit, 0xB6);
+	emit8(jit, 0xC0 | (reg << 3) | reg);
+
+	// mov word [rbx + nz_result], reg16
+	emit8(jit, 0x66);
+	emit_mem(jit, 0x89, reg, REG_BASE_RBX, CPU_FIELD(nz_result));
+}
+
+/* or byte [rbx + P], flag */
+static void emit_set_flag(Jit *jit, uint8_t flag)
+{
+	emit_mem(jit, 0x80, 1, REG_BASE_RBX, CPU_FIELD(P));
+	emit8(jit, flag);
+}
+
+/* and byte [rbx + P], ~flag */
+static void emit_clear_flag(Jit *jit, uint8_t flag)
+{
+	emit_mem(jit, 0x80, 4, REG_BASE_RBX, CPU_FIELD(P));
+	emit8(jit, ~flag);
+}
+
+/* mov rax, [rbx + memspace] */
+static void emit_load_memspace(Jit *jit)
+{
+	emit8(jit, 0x48);
+	emit_mem(jit, 0x8B, REG_AL, REG_BASE_RBX, CPU_FIELD(memspace));
+}
+
+/* mov r8, [rax + addr] with rax pointing at the SharedMemory */
+static void emit_load_ram(Jit *jit, int reg, uint16_t addr)
+{
+	emit_load_memspace(jit);
+	emit_mem(jit, 0x8A, reg, REG_BASE_RAX, offsetof(SharedMemory, ram) + (addr % INTERNAL_RAM_SIZE));
+}
+
+static void emit_store_ram(Jit *jit, int reg, uint16_t addr)
+{
+	emit_load_memspace(jit);
+	emit_mem(jit, 0x88, reg, REG_BASE_RAX, offsetof(SharedMemory, ram) + (addr % INTERNAL_RAM_SIZE));
+
+	// or byte [rax + dirty_pages + page / 8], page bit
+	emit_mem(jit, 0x80, 1, REG_BASE_RAX, offsetof(SharedMemory, dirty_pages) + (addr >> 11));
+	emit8(jit, 1 << ((addr >> 8) & 7));
+}
+
+/* Commit the cycles, instructions and PC the emitted code has skipped updating */
+static void emit_sync(Jit *jit, int *pending_cycles, int *pending_instructions, uint16_t pc)
+{
+	if (*pending_instructions != 0)
+	{
+		// add qword [rbx + instruction_count], imm32
+		emit8(jit, 0x48);
+		emit_mem(jit, 0x81, 0, REG_BASE_RBX, CPU_FIELD(instruction_count));
+		emit32(jit, *pending_instructions);
+		*pending_instructions = 0;
+	}
+
+	if (*pending_cycles != 0)
+	{
+		// add dword [rbx + cycle_count], imm32
+		emit_mem(jit, 0x81, 0, REG_BASE_RBX, CPU_FIELD(cycle_count));
+		emit32(jit, *pending_cycles);
+		*pending_cycles = 0;
+	}
+
+	// mov word [rbx + PC], imm16
+	emit8(jit, 0x66);
+	emit_mem(jit, 0xC7, 0, REG_BASE_RBX, CPU_FIELD(PC));
+	emit16(jit, pc);
+}
+
+static void emit_call_handler(Jit *jit, uint8_t opcode, uint16_t operand)
+{
+	emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0xDF); // mov rdi, rbx
+	emit8(jit, 0xBE); emit32(jit, operand);                // mov esi, imm32
+	emit8(jit, 0x48); emit8(jit, 0xB8);                    // mov rax, imm64
+	emit64(jit, (uint64_t) (uintptr_t) cpu_opcode_handlers[opcode]);
+	emit8(jit, 0xFF); emit8(jit, 0xD0);                    // call rax
+}
+
+static void emit_epilogue(Jit *jit)
+{
+	emit8(jit, 0x5B); // pop rbx
+	emit8(jit, 0xC3); // ret
+}
+
+/* Leave the block if the handler just wrote over code in PRG */
+static void emit_generation_check(Jit *jit, uint32_t generation)
+{
+	emit_load_memspace(jit);
+	emit_mem(jit, 0x81, 7, REG_BASE_RAX, offsetof(SharedMemory, prg_generation));
+	emit32(jit, generation);
+
+	// je over the epilogue
+	emit8(jit, 0x74); emit8(jit, 2);
+	emit_epilogue(jit);
+}
+
+/* Leave the block if the handler moved the deadline or ran past it (an
+   interrupt line changed, or an OAM DMA stalled the CPU), so we stop
+   where the interpreter would */
+static void emit_deadline_check(Jit *jit)
+{
+	emit_mem(jit, 0x8B, REG_AL, REG_BASE_RBX, CPU_FIELD(cycle_count)); // mov eax, [rbx + cycle_count]
+	emit_mem(jit, 0x3B, REG_AL, REG_BASE_RBX, CPU_FIELD(deadline));    // cmp eax, [rbx + deadline]
+
+	// jl over the epilogue
+	emit8(jit, 0x7C); emit8(jit, 2);
+	emit_epilogue(jit);
+}
+
+static bool is_block_terminator(uint8_t opcode)
+{
+	switch (opcode)
+	{
+		case 0x00: // BRK
+		case 0x20: // JSR
+		case 0x40: // RTI
+		case 0x4C: // JMP absolute
+		case 0x60: // RTS
+		case 0x6C: // JMP indirect
+		case 0x28: // PLP and CLI can unmask a held IRQ, which
+		case 0x58: // has to be taken before the next instruction
+			return true;
+
+		default:
+			return (opcode & 0x1F) == 0x10; // Branches
+	}
+}
+
+static bool writes_memory(void (*instruction)(Cpu *cpu, int addr_mode, uint16_t operand), int addr_mode)
+{
+	if (instruction == &STA || instruction == &STX || instruction == &STY ||
+		instruction == &INC || instruction == &DEC)
+		return true;
+
+	if (instruction == &ASL || instruction == &LSR ||
+		instruction == &ROL || instruction == &ROR)
+		return addr_mode != accumulator;
+
+	return false;
+}
+
+/* Register transfers, increments and flag changes */
+static bool emit_implied(Jit *jit, void (*instruction)(Cpu *cpu, int addr_mode, uint16_t operand))
+{
+	struct { void (*instruction)(Cpu *, int, uint16_t); int32_t from, to; bool sets_flags; } transfers[] = {
+		{ &TAX, CPU_FIELD(A),  CPU_FIELD(X),  true },
+		{ &TAY, CPU_FIELD(A),  CPU_FIELD(Y),  true },
+		{ &TXA, CPU_FIELD(X),  CPU_FIELD(A),  true },
+		{ &TYA, CPU_FIELD(Y),  CPU_FIELD(A),  true },
+		{ &TSX, CPU_FIELD(SP), CPU_FIELD(X),  true },
+		{ &TXS, CPU_FIELD(X),  CPU_FIELD(SP), false },
+	};
+	struct { void (*instruction)(Cpu *, int, uint16_t); int32_t reg; uint8_t modrm; } steps[] = {
+		{ &INX, CPU_FIELD(X), 0xC1 }, // inc cl
+		{ &INY, CPU_FIELD(Y), 0xC1 },
+		{ &DEX, CPU_FIELD(X), 0xC9 }, // dec cl
+		{ &DEY, CPU_FIELD(Y), 0xC9 },
+	};
+	struct { void (*instruction)(Cpu *, int, uint16_t); uint8_t flag; bool value; } flags[] = {
+		{ &CLC, FLAG_C, false }, { &SEC, FLAG_C, true },
+		{ &SEI, FLAG_I, true }, // CLI goes through the handler to check for IRQs
+		{ &CLD, FLAG_D, false }, { &SED, FLAG_D, true },
+		{ &CLV, FLAG_V, false },
+	};
+
+	if (instruction == &NOP)
+		return true;
+
+	for (unsigned i = 0; i < sizeof(transfers) / sizeof(transfers[0]); i++)
+	{
+		if (transfers[i].instruction != instruction) continue;
+		emit_load_field(jit, REG_CL, transfers[i].from);
+		emit_store_field(jit, REG_CL, transfers[i].to);
+		if (transfers[i].sets_flags)
+			emit_negative_and_zero(jit, REG_CL);
+		return true;
+	}
+
+	for (unsigned i = 0; i < sizeof(steps) / sizeof(steps[0]); i++)
+	{
+		if (steps[i].instruction != instruction) continue;
+		emit_load_field(jit, REG_CL, steps[i].reg);
+		emit8(jit, 0xFE); emit8(jit, steps[i].modrm);
+		emit_store_field(jit, REG_CL, steps[i].reg);
+		emit_negative_and_zero(jit, REG_CL);
+		return true;
+	}
+
+	for (unsigned i = 0; i < sizeof(flags) / sizeof(flags[0]); i++)
+	{
+		if (flags[i].instruction != instruction) continue;
+		if (flags[i].value)
+			emit_set_flag(jit, flags[i].flag);
+		else
+			emit_clear_flag(jit, flags[i].flag);
+		return true;
+	}
+
+	return false;
+}
+
+/* Loads, stores, logic and compares against internal RAM */
+static bool emit_ram_access(Jit *jit, void (*instruction)(Cpu *cpu, int addr_mode, uint16_t operand), uint16_t addr)
+{
+	struct { void (*instruction)(Cpu *, int, uint16_t); int32_t reg; } loads[] = {
+		{ &LDA, CPU_FIELD(A) }, { &LDX, CPU_FIELD(X) }, { &LDY, CPU_FIELD(Y) },
+	};
+	struct { void (*instruction)(Cpu *, int, uint16_t); int32_t reg; } stores[] = {
+		{ &STA, CPU_FIELD(A) }, { &STX, CPU_FIELD(X) }, { &STY, CPU_FIELD(Y) },
+	};
+	struct { void (*instruction)(Cpu *, int, uint16_t); uint8_t opcode; } logic[] = {
+		{ &AND, 0x20 }, { &ORA, 0x08 }, { &EOR, 0x30 },
+	};
+	struct { void (*instruction)(Cpu *, int, uint16_t); int32_t reg; } compares[] = {
+		{ &CMP, CPU_FIELD(A) }, { &CPX, CPU_FIELD(X) }, { &CPY, CPU_FIELD(Y) },
+	};
+
+	// Only internal RAM is side effect free
+	if (addr >= 0x2000)
+		return false;
+
+	for (unsigned i = 0; i < 3; i++)
+	{
+		if (loads[i].instruction == instruction)
+		{
+			emit_load_ram(jit, REG_CL, addr);
+			emit_store_field(jit, REG_CL, loads[i].reg);
+			emit_negative_and_zero(jit, REG_CL);
+			return true;
+		}
+
+		if (stores[i].instruction == instruction)
+		{
+			emit_load_field(jit, REG_CL, stores[i].reg);
+			emit_store_ram(jit, REG_CL, addr);
+			return true;
+		}
+
+		if (logic[i].instruction == instruction)
+		{
+			emit_load_ram(jit, REG_CL, addr);
+			emit_load_field(jit, REG_DL, CPU_FIELD(A));
+			emit8(jit, logic[i].opcode); emit8(jit, 0xCA); // op dl, cl
+			emit_store_field(jit, REG_DL, CPU_FIELD(A));
+			emit_negative_and_zero(jit, REG_DL);
+			return true;
+		}
+
+		if (compares[i].instruction == instruction)
+		{
+			emit_load_ram(jit, REG_CL, addr);
+			emit_load_field(jit, REG_DL, compares[i].reg);
+			emit8(jit, 0x38); emit8(jit, 0xCA);               // cmp dl, cl
+			emit8(jit, 0x0F); emit8(jit, 0x90 | CC_NB); emit8(jit, 0xC0); // setnb al
+			emit8(jit, 0x28); emit8(jit, 0xCA);               // sub dl, cl
+			emit_negative_and_zero(jit, REG_DL);
+			emit_clear_flag(jit, FLAG_C);
+			emit_mem(jit, 0x08, REG_AL, REG_BASE_RBX, CPU_FIELD(P)); // or [rbx + P], al
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void flush_blocks(Jit *jit, uint32_t generation)
+{
+	memset(jit->blocks, 0, sizeof(jit->blocks));
+	memset(jit->heat, 0, sizeof(jit->heat));
+	jit->blocks_used = 0;
+	jit->code_used = 0;
+	jit->generation = generation;
+	jit->stats.flushes ++;
+}
+
+/* The code buffer is never writable and executable at once: writable
+   while blocks are emitted, executable while they run */
+static bool set_code_writable(Jit *jit, bool writable)
+{
+	if (jit->code_writable == writable)
+		return true;
+
+	int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+	if (mprotect(jit->code, JIT_CODE_SIZE, protection) != 0)
+	{
+		printf("Unable to change the JIT's code buffer protection\n");
+		return false;
+	}
+	jit->code_writable = writable;
+	return true;
+}
+
+static JitBlock *translate_block(Jit *jit, Cpu *cpu, uint16_t start)
+{
+	SharedMemory *mem = cpu->memspace;
+	int worst_case = JIT_MAX_BLOCK_LENGTH * JIT_MAX_INSTRUCTION_BYTES + 16;
+
+	if (jit->blocks_used == JIT_MAX_BLOCKS || jit->code_used + worst_case > JIT_CODE_SIZE)
+		flush_blocks(jit, jit->generation);
+	if (!set_code_writable(jit, true))
+		return NULL;
+
+	JitBlock *block = &jit->block_pool[jit->blocks_used++];
+	block->code = (void (*)(Cpu *)) (jit->code + jit->code_used);
+	block->instruction_count = 0;
+
+	emit8(jit, 0x53);                                     // push rbx
+	emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0xFB); // mov rbx, rdi
+
+	int pending_cycles = 0;
+	int pending_instructions = 0;
+	int pc = start; // Not wrapped, so running off $FFFF is visible
+	bool terminated = false;
+
+	while (!terminated && block->instruction_count < JIT_MAX_BLOCK_LENGTH && pc <= 0xFFFF)
+	{
+		uint8_t opcode = peek_cpu_memory(mem, pc);
+		int addr_mode = addressing_modes[opcode];
+		int length = instruction_length(addr_mode);
+
+		// Past $FFFF is RAM, which prg_generation doesn't cover
+		if (pc + length > 0x10000)
+			break;
+
+		uint16_t operand = peek_cpu_memory(mem, pc + 1);
+		if (length == 3)
+			operand |= peek_cpu_memory(mem, pc + 2) << 8;
+
+		void (*instruction)(Cpu *, int, uint16_t) = opcodes[opcode];
+		int fetch_cycles = length + (length == 1);
+		bool native = false;
+
+		// Immediate operands are resolved as zero page addresses by cpu.c
+		if (addr_mode == implied)
+			native = emit_implied(jit, instruction);
+		else if (addr_mode == immediate || addr_mode == zero_page || addr_mode == absolute)
+			native = emit_ram_access(jit, instruction, operand);
+
+		block->instruction_count ++;
+		pending_instructions ++;
+		pc += length;
+
+		if (native)
+		{
+			// Every RAM access we emit is a single read or write
+			pending_cycles += fetch_cycles + (addr_mode != implied);
+			jit->stats.native_instructions ++;
+			continue;
+		}
+
+		pending_cycles += fetch_cycles;
+		emit_sync(jit, &pending_cycles, &pending_instructions, pc);
+		emit_call_handler(jit, opcode, operand);
+		jit->stats.called_instructions ++;
+
+		terminated = is_block_terminator(opcode);
+		if (!terminated && writes_memory(instruction, addr_mode))
+			emit_generation_check(jit, jit->generation);
+		if (!terminated)
+			emit_deadline_check(jit);
+	}
+
+	if (!terminated)
+		emit_sync(jit, &pending_cycles, &pending_instructions, pc);
+	emit_epilogue(jit);
+
+	block->max_cycles = (block->instruction_count - 1) * JIT_MAX_INSTRUCTION_CYCLES;
+	jit->stats.code_bytes += jit->code + jit->code_used - (uint8_t *) block->code;
+	jit->blocks[start - DECODE_CACHE_START] = block;
+	jit->stats.blocks_translated ++;
+	return block;
+}
+
+static JitBlock *find_block(Jit *jit, Cpu *cpu)
+{
+	uint16_t pc = cpu->PC;
+	if (pc < DECODE_CACHE_START || pc > 0xFFFD)
+		return NULL;
+
+	if (jit->generation != cpu->memspace->prg_generation)
+		flush_blocks(jit, cpu->memspace->prg_generation);
+
+	int index = pc - DECODE_CACHE_START;
+	if (jit->blocks[index] != NULL)
+		return jit->blocks[index];
+
+	if (++jit->heat[index] < jit->hot_threshold)
+		return NULL;
+
+	// A block of one branch, jump or RTI costs more to enter than to step
+	if (is_block_terminator(peek_cpu_memory(cpu->memspace, pc)))
+	{
+		jit->heat[index] = 0;
+		return NULL;
+	}
+
+	return translate_block(jit, cpu, pc);
+}
+
+bool init_jit(Jit *jit)
+{
+	memset(jit, 0, sizeof(Jit));
+
+	void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED)
+	{
+		printf("Unable to map memory for the JIT\n");
+		return false;
+	}
+
+	jit->code = code;
+	jit->code_writable = true;
+	jit->hot_threshold = JIT_HOT_THRESHOLD;
+	return true;
+}
+
+void cleanup_jit(Jit *jit)
+{
+	if (jit->code != NULL)
+		munmap(jit->code, JIT_CODE_SIZE);
+	jit->code = NULL;
+}
+
+/* Run the interpreter's own loop up to deadline, or the real one if
+   that's sooner. Handlers only ever pull the deadline in to 0, which
+   has to survive the swap back */
+static void interpret_until(Jit *jit, Cpu *cpu, int deadline)
+{
+	int real_deadline = cpu->deadline;
+	uint64_t instructions = cpu->instruction_count;
+
+	if (deadline < real_deadline)
+		cpu->deadline = deadline;
+	interpret_cpu_instructions(cpu);
+	if (cpu->deadline == deadline)
+		cpu->deadline = real_deadline;
+
+	jit->stats.interpreted_instructions += cpu->instruction_count - instructions;
+}
+
+void execute_jit_instructions(Jit *jit, Cpu *cpu)
+{
+	while (cpu->cycle_count < cpu->deadline)
+	{
+		JitBlock *block = find_block(jit, cpu);
+
+		// Blocks only run when they can't overshoot the deadline, so we
+		// stop on exactly the same instruction the interpreter would
+		if (block != NULL && cpu->cycle_count + block->max_cycles < cpu->deadline &&
+		    set_code_writable(jit, false))
+		{
+			block->code(cpu);
+			jit->stats.block_executions ++;
+			jit->stats.block_instructions += block->instruction_count;
+			continue;
+		}
+
+		// Code outside PRG never gets a block, and single steps would
+		// cost more than the interpreter does on its own
+		if (cpu->PC < DECODE_CACHE_START || cpu->PC > 0xFFFD)
+		{
+			interpret_until(jit, cpu, cpu->cycle_count + JIT_INTERPRET_CYCLES);
+			continue;
+		}
+
+		// Cold PRG code, or a block too close to the deadline. Stepped,
+		// so every instruction warms up its PC
+		step_cpu(cpu);
+		jit->stats.interpreted_instructions ++;
+	}
+}
+
+#else
+
+bool init_jit(Jit *jit)
+{
+	memset(jit, 0, sizeof(Jit));
+	printf("The JIT is only available on x86-64\n");
+	return false;
+}
+
+void cleanup_jit(Jit *jit)
+{
+}
+
+void execute_jit_instructions(Jit *jit, Cpu *cpu)
+{
+	while (cpu->cycle_count < cpu->deadline)
+	{
+		step_cpu(cpu);
+		jit->stats.interpreted_instructions ++;
+	}
+}
+
+#endif
+
+void add_jit_stats(JitStats *total, JitStats *stats)
+{
+	total->blocks_translated += stats->blocks_translated;
+	total->block_executions += stats->block_executions;
+	total->block_instructions += stats->block_instructions;
+	total->interpreted_instructions += stats->interpreted_instructions;
+	total->native_instructions += stats->native_instructions;
+	total->called_instructions += stats->called_instructions;
+	total->code_bytes += stats->code_bytes;
+	total->flushes += stats->flushes;
+}
+
+void print_jit_stats(JitStats *stats, FILE *stream)
+{
+	uint64_t total = stats->block_instructions + stats->interpreted_instructions;
+
+	fprintf(stream, "JIT blocks translated:    %llu (%llu flushes, %llu KB code)\n",
+		(unsigned long long) stats->blocks_translated, (unsigned long long) stats->flushes,
+		(unsigned long long) stats->code_bytes / 1024);
+	fprintf(stream, "JIT translated opcodes:   %llu native, %llu handler calls\n",
+		(unsigned long long) stats->native_instructions,
+		(unsigned long long) stats->called_instructions);
+	fprintf(stream, "JIT block executions:     %llu\n",
+		(unsigned long long) stats->block_executions);
+	fprintf(stream, "Instructions in blocks:   %llu (%.1f%%)\n",
+		(unsigned long long) stats->block_instructions,
+		total ? 100.0 * stats->block_instructions / total : 0.0);
+	fprintf(stream, "Instructions interpreted: %llu\n",
+		(unsigned long long) stats->interpreted_instructions);
+}
@@ -0,0 +1,73 @@
+/*
+
+Basic block recompiler (x86-64)
+
+- Hot straight-line code in PRG ROM is translated to native code
+- A block ends at the first branch, JMP, JSR, RTS, RTI or BRK, and
+  after CLI or PLP so a held IRQ is noticed. Code that would make a
+  block of just that one instruction is stepped instead
+- The code buffer is mapped writable while blocks are emitted and
+  executable while they run, never both
+- Register and RAM only instructions are emitted inline, everything
+  else (I/O, stack, control flow) calls the interpreter's handler
+- Blocks are thrown away whenever the code in PRG changes
+- Code outside PRG (RAM, or open bus a game fell into) never gets a
+  block and runs on the interpreter's own loop, a stretch at a time
+
+*/
+#ifndef JIT_H_
+#define JIT_H_
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define JIT_HOT_THRESHOLD 16    // Executions before a PC gets translated
+#define JIT_MAX_BLOCK_LENGTH 32 // Instructions per block
+#define JIT_MAX_BLOCKS 8192
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+#define JIT_INTERPRET_CYCLES 1024 // Interpreted in one go outside PRG, between looks for a block
+
+typedef struct jit_block {
+	void (*code)(Cpu *cpu);
+	int instruction_count;
+	int max_cycles; // Upper bound on cycles spent before the last instruction
+} JitBlock;
+
+typedef struct jit_stats {
+	uint64_t blocks_translated;
+	uint64_t block_executions;
+	uint64_t block_instructions;       // Instructions executed inside blocks
+	uint64_t interpreted_instructions; // Instructions executed by step_cpu
+	uint64_t native_instructions;      // Translated inline (static count)
+	uint64_t called_instructions;      // Translated as handler calls (static count)
+	uint64_t code_bytes;               // Emitted, across flushes
+	uint64_t flushes;
+} JitStats;
+
+typedef struct jit {
+	uint8_t *code;
+	int code_used;
+	bool code_writable; // Otherwise executable, never both
+
+	JitBlock *blocks[DECODE_CACHE_SIZE]; // Indexed by PC - DECODE_CACHE_START
+	uint8_t heat[DECODE_CACHE_SIZE];
+	JitBlock block_pool[JIT_MAX_BLOCKS];
+	int blocks_used;
+
+	int hot_threshold;   // JIT_HOT_THRESHOLD, 1 translates everything on sight
+	uint32_t generation; // SharedMemory prg_generation the blocks belong to
+	JitStats stats;
+} Jit;
+
+// Returns false when native code can't be generated on this host
+bool init_jit(Jit *jit);
+void cleanup_jit(Jit *jit);
+void execute_jit_instructions(Jit *jit, Cpu *cpu);
+
+// Summing stats lets one report cover several instances
+void add_jit_stats(JitStats *total, JitStats *stats);
+void print_jit_stats(JitStats *stats, FILE *stream);
+
+#endif
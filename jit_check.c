@@ -0,0 +1,313 @@
+#include "jit_check.h"
+#include "cartridge.h"
+#include "cpu.h"
+#include "jit.h"
+#include "mapper.h"
+#include "nestest.h"
+#include "rom_index.h"
+#include <string.h>
+
+typedef struct checkpoint {
+	uint64_t time;
+	uint64_t instructions;
+	uint32_t memory; // CRC of RAM, PRG-RAM and PRG
+	uint16_t PC;
+	uint8_t A, X, Y, SP, P;
+} Checkpoint;
+
+// One of the two machines being compared
+typedef struct side {
+	SharedMemory mem;
+	Mapper mapper; // nestest only
+	Cpu cpu;
+	uint8_t prg[0x8000]; // Random programs only, mapped writable
+
+	uint32_t seed; // Picks checkpoint times and interrupts, same on both sides
+	bool interrupts;
+	int event;
+
+	Checkpoint *checkpoints; // This frame's
+	int count;
+} Side;
+
+// Enough for a checkpoint every cycle
+#define MAX_CHECKPOINTS (CPU_CYCLES_PER_FRAME + 1)
+
+static uint32_t xorshift(uint32_t seed)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static void record_checkpoint(Side *side)
+{
+	Cpu *cpu = &side->cpu;
+	if (side->count == MAX_CHECKPOINTS)
+		return;
+
+	Checkpoint *checkpoint = &side->checkpoints[side->count++];
+	checkpoint->time = cpu_time(cpu);
+	checkpoint->instructions = cpu->instruction_count;
+	checkpoint->memory = rom_crc32(0, side->mem.ram, INTERNAL_RAM_SIZE);
+	checkpoint->memory = rom_crc32(checkpoint->memory, prg_ram_contents(&side->mem), PRG_RAM_SIZE);
+	checkpoint->memory = rom_crc32(checkpoint->memory, side->prg, sizeof(side->prg));
+	checkpoint->PC = cpu->PC;
+	checkpoint->A = cpu->A;
+	checkpoint->X = cpu->X;
+	checkpoint->Y = cpu->Y;
+	checkpoint->SP = cpu->SP;
+	checkpoint->P = get_status_flags(cpu);
+}
+
+static void checkpoint_event(void *context, uint64_t time)
+{
+	Side *side = context;
+	record_checkpoint(side);
+
+	side->seed = xorshift(side->seed);
+	if (side->interrupts)
+	{
+		if (side->seed % 16 == 0)
+			trigger_nmi(&side->cpu);
+		set_irq(&side->cpu, IRQ_MAPPER, (side->seed >> 8) % 4 == 0);
+	}
+	schedule_event(&side->cpu.scheduler, side->event, time + 1 + (side->seed >> 12) % JIT_CHECK_MAX_STRETCH);
+}
+
+static bool init_side(Side *side, Cartridge *cart, uint32_t seed, Checkpoint *checkpoints)
+{
+	init_shared_memory(&side->mem);
+	memset(side->prg, 0, sizeof(side->prg));
+	if (cart != NULL && !init_mapper(&side->mapper, &cart->rom, &side->mem))
+		return false;
+	if (cart == NULL)
+		map_memory(&side->mem, 0x8000, 0xFFFF, side->prg, sizeof(side->prg), true);
+
+	// Random programs run out of writable memory, so nothing is decoded ahead
+	init_cpu(&side->cpu, &side->mem, NULL);
+	if (cart != NULL)
+		side->cpu.decoded = cart->decoded;
+	side->seed = seed;
+	side->interrupts = cart == NULL;
+	side->checkpoints = checkpoints;
+	side->count = 0;
+	side->event = add_event(&side->cpu.scheduler, &checkpoint_event, side);
+	schedule_event(&side->cpu.scheduler, side->event, 1 + seed % JIT_CHECK_MAX_STRETCH);
+	return true;
+}
+
+static void cleanup_side(Side *side, bool has_mapper)
+{
+	cleanup_cpu(&side->cpu);
+	cleanup_shared_memory(&side->mem);
+	if (has_mapper)
+		cleanup_mapper(&side->mapper);
+}
+
+/* Runs of random instructions, each ending in a JMP or JSR to the start
+   of a random run, or an RTS or RTI. Operands point into RAM and now
+   and then into PRG. Interrupt vectors lead back to the start */
+static void generate_program(Side *side, uint32_t seed)
+{
+	uint16_t runs[JIT_CHECK_PROGRAM_SIZE];
+	uint16_t jumps[JIT_CHECK_PROGRAM_SIZE]; // JMP and JSR operands, patched at the end
+	int run_count = 0, jump_count = 0, left = 0;
+	uint16_t pc = 0x8000;
+	uint8_t *prg = side->prg - 0x8000;
+
+	while (pc < 0x8000 + JIT_CHECK_PROGRAM_SIZE)
+	{
+		if (left == 0)
+		{
+			seed = xorshift(seed);
+			runs[run_count++] = pc;
+			left = 1 + seed % JIT_MAX_BLOCK_LENGTH;
+		}
+
+		uint8_t opcode;
+		do
+		{
+			seed = xorshift(seed);
+			opcode = seed & 0xFF;
+		} while (opcode == 0x00 || opcode == 0x20 || opcode == 0x40 ||
+		         opcode == 0x4C || opcode == 0x60 || opcode == 0x6C);
+
+		int addr_mode = addressing_modes[opcode];
+		int length = instruction_length(addr_mode);
+		seed = xorshift(seed);
+		uint16_t addr = seed % 64 == 0 ? 0x8000 + (seed >> 8) % JIT_CHECK_PROGRAM_SIZE : (seed >> 8) % INTERNAL_RAM_SIZE;
+		if (addr_mode == immediate || addr_mode == zero_page)
+			addr &= 0xFF;
+
+		prg[pc] = opcode;
+		if (length >= 2)
+			prg[pc + 1] = addr & 0xFF;
+		if (length == 3)
+			prg[pc + 2] = addr >> 8;
+		pc += length;
+
+		if (--left > 0)
+			continue;
+
+		seed = xorshift(seed);
+		const uint8_t endings[8] = { 0x4C, 0x4C, 0x4C, 0x4C, 0x20, 0x20, 0x60, 0x40 };
+		prg[pc] = endings[seed % 8];
+		if (prg[pc] == 0x4C || prg[pc] == 0x20)
+		{
+			jumps[jump_count++] = pc + 1;
+			pc += 2;
+		}
+		pc ++;
+	}
+
+	prg[pc] = 0x4C;
+	jumps[jump_count++] = pc + 1;
+	for (int i = 0; i < jump_count; i++)
+	{
+		seed = xorshift(seed);
+		uint16_t target = runs[seed % run_count];
+		prg[jumps[i]] = target & 0xFF;
+		prg[jumps[i] + 1] = target >> 8;
+	}
+
+	// Every vector to $8000
+	for (int vector = 0xFFFA; vector <= 0xFFFE; vector += 2)
+	{
+		prg[vector] = 0x00;
+		prg[vector + 1] = 0x80;
+	}
+
+	for (int i = 0; i < INTERNAL_RAM_SIZE; i++)
+	{
+		seed = xorshift(seed);
+		side->mem.ram[i] = seed;
+	}
+}
+
+static void print_checkpoint(const char *label, Checkpoint *checkpoint)
+{
+	printf("%s PC:%04X A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu INS:%llu MEM:%08X\n", label,
+		checkpoint->PC, checkpoint->A, checkpoint->X, checkpoint->Y, checkpoint->P, checkpoint->SP,
+		(unsigned long long) checkpoint->time, (unsigned long long) checkpoint->instructions,
+		checkpoint->memory);
+}
+
+/* Runs both sides a frame at a time, comparing every checkpoint and
+   the state at the end of the frame */
+static bool run_side_by_side(Side *interpreter, Side *recompiled, const char *name, long *checked)
+{
+	for (int frame = 0; frame < JIT_CHECK_FRAMES; frame++)
+	{
+		interpreter->count = 0;
+		recompiled->count = 0;
+		execute_cpu_instructions(&interpreter->cpu);
+		execute_cpu_instructions(&recompiled->cpu);
+		record_checkpoint(interpreter);
+		record_checkpoint(recompiled);
+
+		for (int i = 0; i < interpreter->count; i++)
+		{
+			Checkpoint *want = &interpreter->checkpoints[i];
+			Checkpoint *got = &recompiled->checkpoints[i];
+			if (i < recompiled->count && memcmp(want, got, sizeof(Checkpoint)) == 0)
+				continue;
+
+			printf("%s: JIT differs from the interpreter in frame %d, checkpoint %d\n", name, frame, i);
+			print_checkpoint("want:", want);
+			if (i < recompiled->count)
+				print_checkpoint("got: ", got);
+			return false;
+		}
+		*checked += interpreter->count;
+	}
+	return true;
+}
+
+bool run_jit_check(char *nestest_file, int programs)
+{
+	Cartridge cart;
+	if (!load_cartridge(&cart, nestest_file))
+		return false;
+
+	Side *interpreter = malloc(sizeof(Side));
+	Side *recompiled = malloc(sizeof(Side));
+	Jit *jit = malloc(sizeof(Jit));
+	Checkpoint *checkpoints = malloc(2 * MAX_CHECKPOINTS * sizeof(Checkpoint));
+	if (interpreter == NULL || recompiled == NULL || jit == NULL || checkpoints == NULL)
+	{
+		printf("Unable to allocate the JIT check\n");
+		free_cartridge(&cart);
+		return false;
+	}
+
+	JitStats stats = {0};
+	long checked = 0;
+	bool ok = false;
+
+	// nestest, as run_nestest() starts it
+	if (init_side(interpreter, &cart, 1, checkpoints) &&
+	    init_side(recompiled, &cart, 1, checkpoints + MAX_CHECKPOINTS) && init_jit(jit))
+	{
+		Side *sides[2] = { interpreter, recompiled };
+		for (int i = 0; i < 2; i++)
+		{
+			sides[i]->cpu.PC = NESTEST_START_PC;
+			sides[i]->cpu.cycle_count = NESTEST_START_CYCLES;
+			set_status_flags(&sides[i]->cpu, NESTEST_START_STATUS);
+		}
+		recompiled->cpu.jit = jit;
+		jit->hot_threshold = 1; // Translate everything, however rarely it runs
+
+		ok = run_side_by_side(interpreter, recompiled, nestest_file, &checked);
+		add_jit_stats(&stats, &jit->stats);
+		cleanup_jit(jit);
+		cleanup_side(interpreter, true);
+		cleanup_side(recompiled, true);
+	}
+	if (ok)
+		printf("%s: %ld checkpoints match\n", nestest_file, checked);
+
+	int matched = 0;
+	checked = 0;
+	for (int i = 0; ok && i < programs; i++)
+	{
+		uint32_t seed = 0x9E3779B9 * (i + 1);
+		char name[32];
+		snprintf(name, sizeof(name), "random program %d", i);
+
+		init_side(interpreter, NULL, seed, checkpoints);
+		init_side(recompiled, NULL, seed, checkpoints + MAX_CHECKPOINTS);
+		if (!init_jit(jit))
+		{
+			ok = false;
+			break;
+		}
+
+		generate_program(interpreter, seed);
+		memcpy(recompiled->prg, interpreter->prg, sizeof(interpreter->prg));
+		memcpy(recompiled->mem.ram, interpreter->mem.ram, INTERNAL_RAM_SIZE);
+		interpreter->cpu.PC = 0x8000;
+		recompiled->cpu.PC = 0x8000;
+		recompiled->cpu.jit = jit;
+		jit->hot_threshold = 1;
+
+		ok = run_side_by_side(interpreter, recompiled, name, &checked);
+		matched += ok;
+		add_jit_stats(&stats, &jit->stats);
+		cleanup_jit(jit);
+		cleanup_side(interpreter, false);
+		cleanup_side(recompiled, false);
+	}
+	if (programs > 0)
+		printf("%d of %d random programs match, %ld checkpoints\n", matched, programs, checked);
+	print_jit_stats(&stats, stdout);
+
+	free(checkpoints);
+	free(jit);
+	free(recompiled);
+	free(interpreter);
+	free_cartridge(&cart);
+	return ok;
+}
@@ -0,0 +1,30 @@
+/*
+
+JIT lockstep check
+
+- Runs the same code on the interpreter and on the JIT side by side,
+  and compares registers, flags, cycle and instruction counts and
+  memory at checkpoints a random number of cycles apart
+- Checkpoints are scheduler events, so blocks get cut short by the
+  deadline at every possible point
+- First nestest.nes from $C000 (automation mode), then random programs:
+  runs of random instructions over RAM and PRG joined by jumps, calls
+  and returns, under NMIs and IRQs at random times. Their PRG is
+  writable, so some stores land on code the JIT already translated
+- The JIT translates every PC it sees here, not only hot ones
+
+*/
+#ifndef JIT_CHECK_H_
+#define JIT_CHECK_H_
+
+#include <stdbool.h>
+
+#define JIT_CHECK_FRAMES          4    // Run per program
+#define JIT_CHECK_MAX_STRETCH     300  // Cycles between two checkpoints, at most
+#define JIT_CHECK_PROGRAM_SIZE    6000 // Bytes of random code from $8000
+#define JIT_CHECK_DEFAULT_PROGRAMS 300
+
+// Returns true when nestest and every random program matched
+bool run_jit_check(char *nestest_file, int programs);
+
+#endif
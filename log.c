@@ -1,18 +1,20 @@
 #include "log.h"
 
-void init_logger(Logger *logger, char* outfile)
+bool init_logger(Logger *logger, char* outfile)
 {
-	logger->file_stream = fopen(outfile, "a");
+	logger->outfile = outfile;
+	logger->file_stream = fopen(outfile, "w");
 	if (logger->file_stream == NULL)
 	{
 		printf("File stream was unable to be created: %s\n", outfile);
-		exit(0);
+		return false;
 	}
+	return true;
 }
 
 void write_log(Logger *logger, char* buffer)
 {
-	fprintf(logger->file_stream, buffer, 0);
+	fputs(buffer, logger->file_stream);
 }
 
 void cleanup_logger(Logger *logger)
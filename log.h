@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
 
 typedef struct log
 {
@@ -7,6 +8,6 @@ typedef struct log
 	char* outfile;
 } Logger;
 
-void init_logger(Logger *logger, char* outfile);
+bool init_logger(Logger *logger, char* outfile);
 void write_log(Logger *logger, char* buffer);
 void cleanup_logger(Logger *logger);
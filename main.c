@@ -1,16 +1,544 @@
+#include "batch.h"
+#include "capture.h"
 #include "cpu.h"
+#include "jit_check.h"
+#include "movie.h"
+#include "nes.h"
+#include "nestest.h"
+#include "profile.h"
+#include "render_thread.h"
+#include "rewind.h"
 #include "rom.h"
+#include "rom_index.h"
+#include "runahead.h"
+#include "trace.h"
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-int main()
+static double now()
 {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/* Totals for every job that ran on the JIT */
+static void print_batch_jit_stats(BatchJob *jobs, int count)
+{
+	JitStats total = {0};
+	for (int i = 0; i < count; i++)
+		add_jit_stats(&total, &jobs[i].jit_stats);
+	print_jit_stats(&total, stdout);
+}
+
+/* <directory>/<job index>-<file name without its folders>.log, for a
+   job's CPU log. The index keeps two jobs from sharing a file */
+static char *job_log_file(char *directory, int job, char *file)
+{
+	if (directory == NULL)
+		return NULL;
+
+	char *name = strrchr(file, '/');
+	name = name != NULL ? name + 1 : file;
+	size_t size = strlen(directory) + strlen(name) + 18;
+	char *log_file = malloc(size);
+	if (log_file != NULL)
+		snprintf(log_file, size, "%s/%d-%s.log", directory, job, name);
+	return log_file;
+}
+
+/* A ROM argument is a path, or with -i a file CRC or a file name the
+   index knows. Anything else is left for load_rom() to complain about */
+static char *rom_argument(RomIndex *index, char *argument)
+{
+	if (index->entries == NULL || access(argument, F_OK) == 0)
+		return argument;
+
+	char *path = find_indexed_rom(index, argument);
+	return path != NULL ? path : argument;
+}
+
+static void free_job_logs(BatchJob *jobs, int count)
+{
+	for (int i = 0; i < count; i++)
+		free(jobs[i].log_file);
+}
+
+int main(int argc, char **argv)
+{
+	// -j or --jit anywhere runs run, batch and replay on the JIT, -l <dir>
+	// has batch and replay log every job's CPU to <dir>/<job>-<rom or movie>.log,
+	// -i <index file> lets run and batch name ROMs by file CRC or file name.
+	// The commands below only see the other arguments
+	bool use_jit = false;
+	char *log_directory = NULL;
+	RomIndex index = {0};
+	int arguments = 1;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jit") == 0)
+			use_jit = true;
+		else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+			log_directory = argv[++i];
+		else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+		{
+			if (!read_rom_index(&index, argv[++i]))
+				return 1;
+		}
+		else
+			argv[arguments++] = argv[i];
+	}
+	argc = arguments;
+
+	// nes index <directory> <index file>
+	if (argc == 4 && strcmp(argv[1], "index") == 0)
+	{
+		free_rom_index(&index);
+		build_rom_index(&index, argv[2], 0);
+		printf("Indexed %d roms\n", index.count);
+
+		bool ok = write_rom_index(&index, argv[3]);
+		free_rom_index(&index);
+		return ok ? 0 : 1;
+	}
+
+	// nes run <rom> <frames> [trace file], a trace runs on the interpreter
+	// and turns into a log with nes trace
+	if ((argc == 4 || argc == 5) && strcmp(argv[1], "run") == 0)
+	{
+		Nes *nes = malloc(sizeof(Nes));
+		Tracer tracer;
+		if (nes == NULL || !init_nes(nes, rom_argument(&index, argv[2]), NULL, use_jit))
+			return 1;
+		if (argc == 5 && !start_trace(&tracer, argv[4]))
+			return 1;
+		if (argc == 5)
+			nes->cpu.tracer = &tracer;
+
+		int frames = atoi(argv[3]);
+		double start = now();
+		run_nes_frames(nes, frames);
+		double elapsed = now() - start;
+
+		printf("%d frames PC:%04X %llu instructions %.3fs, %.0f frames/s\n", frames, nes->cpu.PC,
+			(unsigned long long) nes->cpu.instruction_count, elapsed, frames / elapsed);
+		if (argc == 5)
+		{
+			stop_trace(&tracer);
+			printf("Traced %llu instructions, the CPU waited on the writer %llu times\n",
+				(unsigned long long) tracer.head, (unsigned long long) tracer.stalls);
+		}
+		else if (nes->jit != NULL)
+			print_jit_stats(&nes->jit->stats, stdout);
+		cleanup_nes(nes);
+		free(nes);
+		free_rom_index(&index);
+		return 0;
+	}
+
+	// nes batch <frames> <rom> [rom ...]
+	if (argc >= 4 && strcmp(argv[1], "batch") == 0)
+	{
+		int count = argc - 3;
+		BatchJob *jobs = calloc(count, sizeof(BatchJob));
+		for (int i = 0; i < count; i++)
+		{
+			jobs[i].rom_file = rom_argument(&index, argv[i + 3]);
+			jobs[i].log_file = job_log_file(log_directory, i, jobs[i].rom_file);
+			jobs[i].frames = atoi(argv[2]);
+			jobs[i].use_jit = use_jit;
+		}
+
+		run_batch(jobs, count, 0);
+
+		bool ok = true;
+		for (int i = 0; i < count; i++)
+		{
+			BatchJob *job = &jobs[i];
+			ok &= job->ok;
+			printf("%-40s %s PC:%04X %llu instructions %.3fs\n", job->rom_file,
+				job->ok ? "ok  " : "FAIL", job->PC,
+				(unsigned long long) job->instructions, job->seconds);
+		}
+
+		if (use_jit)
+			print_batch_jit_stats(jobs, count);
+		free_job_logs(jobs, count);
+		free(jobs);
+		free_rom_index(&index);
+		return ok ? 0 : 1;
+	}
+
+	// nes sample <rom> <frames> [cycles between samples], a PC sampling
+	// profile, in any build and on the JIT too
+	if ((argc == 4 || argc == 5) && strcmp(argv[1], "sample") == 0)
+	{
+		Nes *nes = malloc(sizeof(Nes));
+		Profile *profile = create_profile();
+		int period = argc == 5 ? atoi(argv[4]) : PROFILE_DEFAULT_SAMPLE_PERIOD;
+		if (nes == NULL || profile == NULL || !init_nes(nes, argv[2], NULL, use_jit))
+			return 1;
+		if (!start_profile_sampling(profile, &nes->cpu, period))
+			return 1;
+
+		int frames = atoi(argv[3]);
+		double start = now();
+		run_nes_frames(nes, frames);
+		double elapsed = now() - start;
+
+		print_profile(profile, stdout);
+		printf("\n%d frames in %.3fs, %.0f frames/s\n", frames, elapsed, frames / elapsed);
+		cleanup_nes(nes);
+		destroy_profile(profile);
+		free(nes);
+		return 0;
+	}
+
+#ifdef CPU_PROFILE
+	// nes profile <rom> <frames> <folded stacks file>
+	if (argc == 5 && strcmp(argv[1], "profile") == 0)
+	{
+		Nes *nes = malloc(sizeof(Nes));
+		Profile *profile = create_profile();
+		if (nes == NULL || profile == NULL || !init_nes(nes, argv[2], NULL, false))
+			return 1;
+
+		nes->cpu.profile = profile;
+		run_nes_frames(nes, atoi(argv[3]));
+		print_profile(profile, stdout);
+
+		FILE *folded = fopen(argv[4], "w");
+		if (folded != NULL)
+		{
+			write_folded_stacks(profile, folded);
+			fclose(folded);
+		}
+
+		cleanup_nes(nes);
+		destroy_profile(profile);
+		free(nes);
+		return 0;
+	}
+#endif
+
+	// nes record <rom> <frames> <raw|ppm> <output file or -> [every nth frame]
+	if ((argc == 6 || argc == 7) && strcmp(argv[1], "record") == 0)
+	{
+		Nes *nes = malloc(sizeof(Nes));
+		Capture *capture = malloc(sizeof(Capture));
+		int format = strcmp(argv[4], "ppm") == 0 ? capture_ppm : capture_raw;
+		int every = argc == 7 ? atoi(argv[6]) : 1;
+		if (nes == NULL || capture == NULL || !init_nes(nes, argv[2], NULL, false))
+			return 1;
+		if (!start_capture(capture, argv[5], format, every, true))
+			return 1;
+
+		nes->capture = capture;
+		run_nes_frames(nes, atoi(argv[3]));
+		bool ok = stop_capture(capture);
+
+		// stdout may be the video
+		fprintf(stderr, "%llu frames written\n", (unsigned long long) capture->written);
+		cleanup_nes(nes);
+		free(capture);
+		free(nes);
+		return ok ? 0 : 1;
+	}
+
+	// nes audio <rom> <frames> <output file> [sample rate], 16 bit mono PCM
+	if ((argc == 5 || argc == 6) && strcmp(argv[1], "audio") == 0)
+	{
+		Nes *nes = malloc(sizeof(Nes));
+		if (nes == NULL || !init_nes(nes, argv[2], NULL, false))
+			return 1;
+		if (argc == 6 && !set_apu_sample_rate(&nes->apu, atoi(argv[5])))
+			return 1;
+
+		FILE *out = fopen(argv[4], "wb");
+		if (out == NULL)
+		{
+			printf("Couldn't create %s\n", argv[4]);
+			return 1;
+		}
+
+		int frames = atoi(argv[3]);
+		for (int i = 0; i < frames; i++)
+		{
+			run_nes_frames(nes, 1);
+			fwrite(nes->apu.samples, sizeof(int16_t), nes->apu.sample_count, out);
+		}
+
+		fclose(out);
+		cleanup_nes(nes);
+		free(nes);
+		return 0;
+	}
+
+	// nes runahead <rom> <frames> <frames ahead> [skip], host frame times
+	if ((argc == 5 || argc == 6) && strcmp(argv[1], "runahead") == 0)
+	{
+		Nes *nes = malloc(sizeof(Nes));
+		RunAhead *run_ahead = malloc(sizeof(RunAhead));
+		bool skip = argc == 6 && strcmp(argv[5], "skip") == 0;
+		if (nes == NULL || run_ahead == NULL || !init_nes(nes, argv[2], NULL, false))
+			return 1;
+		if (!init_run_ahead(run_ahead, nes, atoi(argv[4]), skip))
+			return 1;
+
+		int frames = atoi(argv[3]);
+		double total = 0, worst = 0;
+		for (int i = 0; i < frames; i++)
+		{
+			double start = now();
+			if (!run_ahead_frame(run_ahead))
+				return 1;
+			double elapsed = now() - start;
+			total += elapsed;
+			worst = elapsed > worst ? elapsed : worst;
+		}
+
+		printf("%d frames, %d ahead%s: %.3f ms average, %.3f ms worst\n",
+			frames, run_ahead->frames, skip ? " (skipping hidden frames)" : "",
+			total / (frames > 0 ? frames : 1) * 1000, worst * 1000);
+		cleanup_run_ahead(run_ahead);
+		cleanup_nes(nes);
+		free(run_ahead);
+		free(nes);
+		return 0;
+	}
+
+	// nes pipeline <rom> <frames>, draws on this thread and then on a render
+	// thread, which has to show the same pictures a frame later
+	if (argc == 4 && strcmp(argv[1], "pipeline") == 0)
+	{
+		int frames = atoi(argv[3]);
+		Nes *nes = malloc(sizeof(Nes));
+		RenderThread *render = malloc(sizeof(RenderThread));
+		uint32_t *pictures = calloc(frames > 0 ? frames : 1, sizeof(uint32_t));
+		if (nes == NULL || render == NULL || pictures == NULL || !init_nes(nes, argv[2], NULL, false))
+			return 1;
+
+		double start = now();
+		for (int i = 0; i < frames; i++)
+		{
+			run_nes_frames(nes, 1);
+			pictures[i] = rom_crc32(0, nes->ppu.picture[0], PPU_HEIGHT * PPU_WIDTH);
+		}
+		double synchronous = now() - start;
+		cleanup_nes(nes);
+
+		if (!init_nes(nes, argv[2], NULL, false) || !start_render_thread(render, &nes->ppu))
+			return 1;
+
+		int different = 0;
+		start = now();
+		for (int i = 0; i < frames; i++)
+		{
+			run_nes_frames(nes, 1);
+			uint32_t picture = rom_crc32(0, nes->ppu.picture[0], PPU_HEIGHT * PPU_WIDTH);
+			different += i > 0 && picture != pictures[i - 1];
+		}
+		double pipelined = now() - start;
+		stop_render_thread(render);
+
+		printf("%d frames: %.0f frames/s synchronous, %.0f frames/s pipelined, %d pictures differ\n",
+			frames, frames / synchronous, frames / pipelined, different);
+		cleanup_nes(nes);
+		free(pictures);
+		free(render);
+		free(nes);
+		return different == 0 ? 0 : 1;
+	}
+
+	// nes movie <rom> <frames> <output file> [seed], records random button mashing
+	if ((argc == 5 || argc == 6) && strcmp(argv[1], "movie") == 0)
+	{
+		Nes *nes = malloc(sizeof(Nes));
+		Movie movie;
+		if (nes == NULL || !init_nes(nes, argv[2], NULL, false))
+			return 1;
+		if (!start_movie(&movie, nes, false, MOVIE_DEFAULT_CHECKSUM_INTERVAL))
+			return 1;
+
+		// xorshift32, new buttons every 8 to 39 frames
+		uint32_t seed = argc == 6 ? strtoul(argv[5], NULL, 0) : 1;
+		seed = seed ? seed : 1;
+		int frames = atoi(argv[3]), hold = 0;
+		bool ok = true;
+		for (int i = 0; ok && i < frames; i++)
+		{
+			if (hold-- == 0)
+			{
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+				nes->input.buttons[0] = seed & ~(BUTTON_SELECT | BUTTON_DOWN | BUTTON_RIGHT);
+				hold = 8 + (seed >> 27);
+			}
+			ok = record_movie_frame(&movie, nes);
+		}
+
+		ok = ok && write_movie(&movie, argv[4]);
+		free_movie(&movie);
+		cleanup_nes(nes);
+		free(nes);
+		return ok ? 0 : 1;
+	}
+
+	// nes rewind <rom> <frames> <frames kept> [keyframe interval], mashes
+	// buttons and steps back up to 255 frames every 1 to 512 frames. Each
+	// step back has to land on the state saved when that frame was captured
+	if ((argc == 5 || argc == 6) && strcmp(argv[1], "rewind") == 0)
+	{
+		int frames = atoi(argv[3]);
+		int kept = atoi(argv[4]);
+		int interval = argc == 6 ? atoi(argv[5]) : REWIND_DEFAULT_KEYFRAME_INTERVAL;
+		Nes *nes = malloc(sizeof(Nes));
+		Rewind *rewind = malloc(sizeof(Rewind));
+		uint32_t *states = calloc(frames > 0 ? frames : 1, sizeof(uint32_t)); // Savestate CRC per frame
+		if (nes == NULL || rewind == NULL || states == NULL || !init_nes(nes, argv[2], NULL, use_jit))
+			return 1;
+		if (!init_rewind(rewind, nes, kept, interval))
+			return 1;
+
+		size_t size = savestate_size(nes);
+		uint8_t *state = malloc(size);
+		if (state == NULL)
+			return 1;
+
+		uint32_t seed = 1;
+		int frame = 0, hold = 0, next_step = 1, steps = 0, wrong = 0;
+		double capturing = 0, stepping = 0, worst_step = 0;
+		for (int i = 0; i < frames; i++)
+		{
+			if (hold-- == 0)
+			{
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+				nes->input.buttons[0] = seed & ~(BUTTON_SELECT | BUTTON_DOWN | BUTTON_RIGHT);
+				hold = 8 + (seed >> 27);
+			}
+
+			run_nes_frames(nes, 1);
+			double start = now();
+			rewind_capture(rewind);
+			capturing += now() - start;
+			states[frame++] = rom_crc32(0, state, save_state(nes, state, size));
+
+			if (--next_step > 0)
+				continue;
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			next_step = 1 + seed % 512;
+			int available = rewind_frames_available(rewind);
+			int back = (seed >> 9) % (available < 256 ? available : 256);
+
+			start = now();
+			bool ok = rewind_step_back(rewind, back);
+			double elapsed = now() - start;
+			stepping += elapsed;
+			worst_step = elapsed > worst_step ? elapsed : worst_step;
+			steps ++;
+
+			frame -= back;
+			if (!ok || rom_crc32(0, state, save_state(nes, state, size)) != states[frame - 1])
+			{
+				printf("Stepping back %d frames to frame %d didn't restore its state\n", back, frame - 1);
+				wrong ++;
+			}
+		}
+
+		printf("%d frames, %d step backs, %d wrong: %.1f us per capture, %.1f us per step back (%.1f worst)\n",
+			frames, steps, wrong, capturing / (frames > 0 ? frames : 1) * 1e6,
+			stepping / (steps > 0 ? steps : 1) * 1e6, worst_step * 1e6);
+		printf("%.2f MB for the last %d frames, a keyframe every %d\n",
+			rewind_memory_usage(rewind) / 1e6, kept, interval);
+		cleanup_rewind(rewind);
+		cleanup_nes(nes);
+		free(state);
+		free(states);
+		free(rewind);
+		free(nes);
+		return wrong == 0 ? 0 : 1;
+	}
+
+	// nes replay <rom> <movie> [movie ...], checks every movie's RAM checksums
+	if (argc >= 4 && strcmp(argv[1], "replay") == 0)
+	{
+		int count = argc - 3;
+		BatchJob *jobs = calloc(count, sizeof(BatchJob));
+		for (int i = 0; i < count; i++)
+		{
+			jobs[i].rom_file = argv[2];
+			jobs[i].movie_file = argv[i + 3];
+			jobs[i].log_file = job_log_file(log_directory, i, argv[i + 3]);
+			jobs[i].use_jit = use_jit;
+		}
+
+		double start = now();
+		run_batch(jobs, count, 0);
+		double elapsed = now() - start;
+
+		bool ok = true;
+		long frames = 0;
+		for (int i = 0; i < count; i++)
+		{
+			BatchJob *job = &jobs[i];
+			ok &= job->ok;
+			frames += job->frames;
+			if (job->mismatch_frame >= 0)
+				printf("%-40s FAIL RAM differs after frame %d\n", job->movie_file, job->mismatch_frame);
+			else
+				printf("%-40s %s %d frames %.3fs\n", job->movie_file,
+					job->ok ? "ok  " : "FAIL", job->frames, job->seconds);
+		}
+
+		printf("%ld frames in %.3fs, %.0f frames/s\n", frames, elapsed, frames / elapsed);
+		if (use_jit)
+			print_batch_jit_stats(jobs, count);
+		free_job_logs(jobs, count);
+		free(jobs);
+		return ok ? 0 : 1;
+	}
+
+	// nes nestest <rom> <reference log>
+	if (argc == 4 && strcmp(argv[1], "nestest") == 0)
+		return run_nestest(argv[2], argv[3]) ? 0 : 1;
+
+	// nes jitcheck <nestest rom> [random programs]
+	if ((argc == 3 || argc == 4) && strcmp(argv[1], "jitcheck") == 0)
+		return run_jit_check(argv[2], argc == 4 ? atoi(argv[3]) : JIT_CHECK_DEFAULT_PROGRAMS) ? 0 : 1;
+
+	// nes trace <trace file> <log file>
+	if (argc == 4 && strcmp(argv[1], "trace") == 0)
+	{
+		FILE *out = fopen(argv[3], "w");
+		if (out == NULL)
+		{
+			printf("Couldn't create %s\n", argv[3]);
+			return 1;
+		}
+
+		bool ok = render_trace(argv[2], out);
+		fclose(out);
+		return ok ? 0 : 1;
+	}
+
 	/*
 	Cpu cpu;
 	SharedMemory mem;
 
-	init_cpu(&cpu, &mem, false);
+	init_shared_memory(&mem);
+	init_cpu(&cpu, &mem, NULL);
 	execute_cpu_instructions(&cpu);
 	cleanup_cpu(&cpu);
 	*/
 
-	Rom rom = load_rom("nestest.nes");
+	Rom rom;
+	if (!load_rom(&rom, "nestest.nes"))
+		return 1;
+	free_rom(&rom);
 }
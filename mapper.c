@@ -0,0 +1,299 @@
+#include "mapper.h"
+#include <string.h>
+
+/* Point a PRG window at bank number `bank` of size `size` */
+static void map_prg(Mapper *mapper, uint16_t start, int size, int bank)
+{
+	int bank_count = mapper->rom->pgr_rom_size / size;
+	if (bank_count == 0) // Window bigger than the ROM, like 32 KB mode on 16 KB: mirror all of it
+	{
+		map_memory(mapper->memspace, start, start + size - 1,
+			mapper->rom->pgr_rom, mapper->rom->pgr_rom_size, false);
+		return;
+	}
+	if (bank < 0) bank += bank_count; // Negative banks count from the end
+	bank %= bank_count;
+
+	map_memory(mapper->memspace, start, start + size - 1,
+		mapper->rom->pgr_rom + bank * size, size, false);
+}
+
+/* Point `count` 1 KB CHR windows starting at `slot` at consecutive banks */
+static void map_chr(Mapper *mapper, int slot, int count, int bank)
+{
+	int bank_count = mapper->chr_size / CHR_BANK_SIZE;
+	if (bank_count == 0) // Less than a window of CHR: every window shows the start of it
+	{
+		for (int i = 0; i < count; i++)
+			mapper->chr_banks[slot + i] = mapper->chr;
+		mapper->chr_generation ++;
+		return;
+	}
+
+	for (int i = 0; i < count; i++)
+		mapper->chr_banks[slot + i] = mapper->chr + ((bank + i) % bank_count) * CHR_BANK_SIZE;
+	mapper->chr_generation ++;
+}
+
+static void write_registers(void *context, uint16_t addr, uint8_t byte)
+{
+	Mapper *mapper = context;
+	if (addr >= 0x8000 && mapper->write != NULL)
+		mapper->write(mapper, addr, byte);
+}
+
+static void mmc1_update_banks(Mapper *mapper)
+{
+	static const int mirroring[4] = {
+		mirror_single_low, mirror_single_high, mirror_vertical, mirror_horizontal
+	};
+	mapper->state.mirroring = mirroring[mapper->state.control & 0x03];
+
+	switch ((mapper->state.control >> 2) & 0x03)
+	{
+		case 0:
+		case 1: // 32 KB at $8000
+			map_prg(mapper, 0x8000, 0x8000, (mapper->state.prg_bank & 0x0F) >> 1);
+			break;
+
+		case 2: // First bank fixed at $8000, switchable at $C000
+			map_prg(mapper, 0x8000, 0x4000, 0);
+			map_prg(mapper, 0xC000, 0x4000, mapper->state.prg_bank & 0x0F);
+			break;
+
+		case 3: // Switchable at $8000, last bank fixed at $C000
+			map_prg(mapper, 0x8000, 0x4000, mapper->state.prg_bank & 0x0F);
+			map_prg(mapper, 0xC000, 0x4000, -1);
+			break;
+	}
+
+	if (mapper->state.control & 0x10)
+	{
+		map_chr(mapper, 0, 4, mapper->state.chr_bank_0 * 4);
+		map_chr(mapper, 4, 4, mapper->state.chr_bank_1 * 4);
+	}
+	else
+	{
+		map_chr(mapper, 0, 8, (mapper->state.chr_bank_0 >> 1) * 8);
+	}
+}
+
+/* Registers are loaded serially, one bit per write */
+static void mmc1_write(Mapper *mapper, uint16_t addr, uint8_t byte)
+{
+	if (byte & 0x80)
+	{
+		mapper->state.shift = 0;
+		mapper->state.shift_count = 0;
+		mapper->state.control |= 0x0C;
+		mmc1_update_banks(mapper);
+		return;
+	}
+
+	mapper->state.shift |= (byte & 0x01) << mapper->state.shift_count;
+	if (++mapper->state.shift_count < 5)
+		return;
+
+	switch ((addr >> 13) & 0x03)
+	{
+		case 0: mapper->state.control = mapper->state.shift; break;
+		case 1: mapper->state.chr_bank_0 = mapper->state.shift; break;
+		case 2: mapper->state.chr_bank_1 = mapper->state.shift; break;
+		case 3: mapper->state.prg_bank = mapper->state.shift; break;
+	}
+
+	mapper->state.shift = 0;
+	mapper->state.shift_count = 0;
+	mmc1_update_banks(mapper);
+}
+
+static void uxrom_write(Mapper *mapper, uint16_t addr, uint8_t byte)
+{
+	mapper->state.prg_bank = byte;
+	map_prg(mapper, 0x8000, 0x4000, byte);
+}
+
+static void cnrom_write(Mapper *mapper, uint16_t addr, uint8_t byte)
+{
+	mapper->state.chr_bank_0 = byte & 0x03;
+	map_chr(mapper, 0, 8, mapper->state.chr_bank_0 * 8);
+}
+
+static void mmc3_update_banks(Mapper *mapper)
+{
+	uint8_t *r = mapper->state.bank_registers;
+
+	if (mapper->state.bank_select & 0x40)
+	{
+		map_prg(mapper, 0x8000, 0x2000, -2);
+		map_prg(mapper, 0xC000, 0x2000, r[6]);
+	}
+	else
+	{
+		map_prg(mapper, 0x8000, 0x2000, r[6]);
+		map_prg(mapper, 0xC000, 0x2000, -2);
+	}
+	map_prg(mapper, 0xA000, 0x2000, r[7]);
+	map_prg(mapper, 0xE000, 0x2000, -1);
+
+	// Two 2 KB banks and four 1 KB banks, halves swapped by bit 7
+	int low = (mapper->state.bank_select & 0x80) ? 4 : 0;
+	int high = 4 - low;
+	map_chr(mapper, low + 0, 2, r[0] & 0xFE);
+	map_chr(mapper, low + 2, 2, r[1] & 0xFE);
+	map_chr(mapper, high + 0, 1, r[2]);
+	map_chr(mapper, high + 1, 1, r[3]);
+	map_chr(mapper, high + 2, 1, r[4]);
+	map_chr(mapper, high + 3, 1, r[5]);
+}
+
+static void mmc3_write(Mapper *mapper, uint16_t addr, uint8_t byte)
+{
+	bool odd = addr & 0x01;
+
+	switch (addr & 0xE000)
+	{
+		case 0x8000:
+			if (odd)
+				mapper->state.bank_registers[mapper->state.bank_select & 0x07] = byte;
+			else
+				mapper->state.bank_select = byte;
+			mmc3_update_banks(mapper);
+			break;
+
+		case 0xA000:
+			if (!odd && mapper->state.mirroring != mirror_four_screen)
+				mapper->state.mirroring = (byte & 0x01) ? mirror_horizontal : mirror_vertical;
+			break;
+
+		case 0xC000:
+			if (odd)
+				mapper->state.irq_reload = true;
+			else
+				mapper->state.irq_latch = byte;
+			break;
+
+		case 0xE000:
+			mapper->state.irq_enabled = odd;
+			if (!odd)
+			{
+				mapper->state.irq_pending = false;
+				if (mapper->cpu != NULL)
+					set_irq(mapper->cpu, IRQ_MAPPER, false);
+			}
+			break;
+	}
+}
+
+void refresh_mapper_banks(Mapper *mapper)
+{
+	Rom *rom = mapper->rom;
+
+	switch (mapper->id)
+	{
+		case 0: // NROM, a single 16 KB bank is mirrored into $C000
+			map_memory(mapper->memspace, 0x8000, 0xFFFF, rom->pgr_rom, rom->pgr_rom_size, false);
+			map_chr(mapper, 0, 8, 0);
+			break;
+
+		case 1: // MMC1
+			mmc1_update_banks(mapper);
+			break;
+
+		case 2: // UxROM, last bank fixed at $C000
+			map_prg(mapper, 0x8000, 0x4000, mapper->state.prg_bank);
+			map_prg(mapper, 0xC000, 0x4000, -1);
+			map_chr(mapper, 0, 8, 0);
+			break;
+
+		case 3: // CNROM
+			map_memory(mapper->memspace, 0x8000, 0xFFFF, rom->pgr_rom, rom->pgr_rom_size, false);
+			map_chr(mapper, 0, 8, mapper->state.chr_bank_0 * 8);
+			break;
+
+		case 4: // MMC3
+			mmc3_update_banks(mapper);
+			break;
+	}
+}
+
+void mapper_scanline(Mapper *mapper)
+{
+	if (mapper->id != 4)
+		return;
+
+	if (mapper->state.irq_counter == 0 || mapper->state.irq_reload)
+	{
+		mapper->state.irq_counter = mapper->state.irq_latch;
+		mapper->state.irq_reload = false;
+	}
+	else
+	{
+		mapper->state.irq_counter --;
+	}
+
+	if (mapper->state.irq_counter == 0 && mapper->state.irq_enabled)
+	{
+		mapper->state.irq_pending = true;
+		if (mapper->cpu != NULL)
+			set_irq(mapper->cpu, IRQ_MAPPER, true);
+	}
+}
+
+bool init_mapper(Mapper *mapper, Rom *rom, SharedMemory *mem)
+{
+	memset(mapper, 0, sizeof(Mapper));
+	mapper->id = rom->mapper;
+	mapper->rom = rom;
+	mapper->memspace = mem;
+
+	mapper->has_chr_ram = rom->chr_rom_size == 0;
+	if (mapper->has_chr_ram)
+	{
+		mapper->chr_ram = calloc(1, CHR_RAM_SIZE);
+		if (mapper->chr_ram == NULL)
+		{
+			printf("Unable to allocate CHR-RAM\n");
+			return false;
+		}
+	}
+	mapper->chr = mapper->has_chr_ram ? mapper->chr_ram : rom->chr_rom;
+	mapper->chr_size = mapper->has_chr_ram ? CHR_RAM_SIZE : rom->chr_rom_size;
+
+	if (rom->has_vram)
+		mapper->state.mirroring = mirror_four_screen;
+	else
+		mapper->state.mirroring = rom->is_vertical_mirroring ? mirror_vertical : mirror_horizontal;
+
+	// Register writes land here, reads come straight from the PRG pointers
+	mapper->registers.write = &write_registers;
+	mapper->registers.context = mapper;
+	map_io(mem, 0x8000, 0xFFFF, &mapper->registers);
+
+	switch (mapper->id)
+	{
+		case 0: break; // NROM
+		case 2: mapper->write = &uxrom_write; break;
+		case 3: mapper->write = &cnrom_write; break;
+		case 4: mapper->write = &mmc3_write; break;
+
+		case 1: // MMC1 powers up with the last bank fixed at $C000
+			mapper->write = &mmc1_write;
+			mapper->state.control = 0x0C;
+			break;
+
+		default:
+			printf("Mapper %d is not supported\n", mapper->id);
+			cleanup_mapper(mapper);
+			return false;
+	}
+
+	refresh_mapper_banks(mapper);
+	return true;
+}
+
+void cleanup_mapper(Mapper *mapper)
+{
+	free(mapper->chr_ram);
+	mapper->chr_ram = NULL;
+}
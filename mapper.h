@@ -0,0 +1,84 @@
+/*
+
+Cartridge mappers
+
+- Each mapper owns its bank registers and exposes the PRG and CHR
+  windows as pointers into the ROM image
+- A bank switch only swaps page pointers, nothing gets copied
+- Supported: NROM (0), MMC1 (1), UxROM (2), CNROM (3), MMC3 (4)
+
+*/
+#ifndef MAPPER_H_
+#define MAPPER_H_
+
+#include "cpu.h"
+#include "rom.h"
+#include "shared_mem.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CHR_BANK_SIZE  0x0400 // The PPU pattern tables are mapped in 1 KB windows
+#define CHR_BANK_COUNT 8
+#define CHR_RAM_SIZE   0x2000
+
+enum mirroring {
+	mirror_horizontal  = 0,
+	mirror_vertical    = 1,
+	mirror_single_low  = 2,
+	mirror_single_high = 3,
+	mirror_four_screen = 4,
+};
+
+// Everything a bank switch depends on, saved and restored as one block
+typedef struct mapper_state {
+	int mirroring;
+	uint8_t prg_bank;
+	uint8_t chr_bank_0;
+	uint8_t chr_bank_1;
+
+	/* MMC1 */
+	uint8_t shift;
+	int shift_count;
+	uint8_t control;
+
+	/* MMC3 */
+	uint8_t bank_select;
+	uint8_t bank_registers[8];
+	uint8_t irq_latch;
+	uint8_t irq_counter;
+	bool irq_reload;
+	bool irq_enabled;
+	bool irq_pending;
+} MapperState;
+
+typedef struct mapper {
+	int id;
+	Rom *rom;
+	SharedMemory *memspace;
+	Cpu *cpu; // Where IRQs go, NULL to drop them
+	IoHandler registers; // Writes to $8000-$FFFF
+
+	uint8_t *chr;      // CHR ROM, or chr_ram for carts without one
+	int chr_size;
+	bool has_chr_ram;
+	uint8_t *chr_ram;  // CHR_RAM_SIZE bytes, only allocated when has_chr_ram
+
+	uint8_t *chr_banks[CHR_BANK_COUNT]; // PPU $0000-$1FFF
+	uint32_t chr_generation;            // Bumped whenever chr_banks changes
+	MapperState state;
+
+	void (*write)(struct mapper *mapper, uint16_t addr, uint8_t byte);
+
+} Mapper;
+
+// Returns false for mappers we don't support
+bool init_mapper(Mapper *mapper, Rom *rom, SharedMemory *mem);
+void cleanup_mapper(Mapper *mapper);
+
+// Re-point the PRG and CHR windows after the state was changed directly
+void refresh_mapper_banks(Mapper *mapper);
+
+// Clocked once per visible scanline (MMC3 IRQ counter)
+void mapper_scanline(Mapper *mapper);
+
+#endif
@@ -0,0 +1,192 @@
+#include "movie.h"
+#include "rom_index.h"
+#include "savestate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint32_t nes_rom_crc(Nes *nes)
+{
+	Rom *rom = &nes->cart->rom;
+	uint32_t crc = rom_crc32(0, rom->pgr_rom, rom->pgr_rom_size);
+	return rom_crc32(crc, rom->chr_rom, rom->chr_rom_size);
+}
+
+uint32_t nes_ram_checksum(Nes *nes)
+{
+	uint32_t crc = rom_crc32(0, nes->mem.ram, INTERNAL_RAM_SIZE);
+	return rom_crc32(crc, prg_ram_contents(&nes->mem), PRG_RAM_SIZE);
+}
+
+static uint32_t checksum_count(MovieHeader *header)
+{
+	return header->checksum_interval ? header->frames / header->checksum_interval : 0;
+}
+
+bool start_movie(Movie *movie, Nes *nes, bool from_savestate, int checksum_interval)
+{
+	memset(movie, 0, sizeof(Movie));
+	movie->header.magic = MOVIE_MAGIC;
+	movie->header.version = MOVIE_VERSION;
+	movie->header.rom_crc = nes_rom_crc(nes);
+	movie->header.checksum_interval = checksum_interval > 0 ? checksum_interval : MOVIE_DEFAULT_CHECKSUM_INTERVAL;
+
+	if (from_savestate)
+	{
+		size_t size = savestate_size(nes);
+		movie->savestate = malloc(size);
+		if (movie->savestate == NULL)
+		{
+			printf("Unable to allocate the movie's savestate\n");
+			return false;
+		}
+		movie->header.savestate_size = save_state(nes, movie->savestate, size);
+	}
+	return true;
+}
+
+static bool grow_movie(Movie *movie)
+{
+	uint32_t capacity = movie->capacity ? movie->capacity * 2 : 1024;
+	uint8_t *buttons = realloc(movie->buttons, capacity * 2);
+	if (buttons != NULL)
+		movie->buttons = buttons;
+
+	uint32_t *checksums = realloc(movie->checksums, (capacity / movie->header.checksum_interval + 1) * sizeof(uint32_t));
+	if (checksums != NULL)
+		movie->checksums = checksums;
+
+	if (buttons == NULL || checksums == NULL)
+	{
+		printf("Unable to grow the movie past %u frames\n", movie->capacity);
+		return false;
+	}
+	movie->capacity = capacity;
+	return true;
+}
+
+bool record_movie_frame(Movie *movie, Nes *nes)
+{
+	MovieHeader *header = &movie->header;
+	if (header->frames == movie->capacity && !grow_movie(movie))
+		return false;
+
+	memcpy(movie->buttons + header->frames * 2, nes->input.buttons, 2);
+	run_nes_frames(nes, 1);
+
+	header->frames++;
+	if (header->frames % header->checksum_interval == 0)
+		movie->checksums[header->frames / header->checksum_interval - 1] = nes_ram_checksum(nes);
+	return true;
+}
+
+bool write_movie(Movie *movie, char *filename)
+{
+	FILE *fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		printf("Couldn't write %s\n", filename);
+		return false;
+	}
+
+	MovieHeader *header = &movie->header;
+	uint32_t checksums = checksum_count(header);
+	bool ok = fwrite(header, sizeof(MovieHeader), 1, fp) == 1 &&
+	          fwrite(movie->savestate, 1, header->savestate_size, fp) == header->savestate_size &&
+	          fwrite(movie->buttons, 2, header->frames, fp) == header->frames &&
+	          fwrite(movie->checksums, sizeof(uint32_t), checksums, fp) == checksums;
+
+	fclose(fp);
+	return ok;
+}
+
+bool read_movie(Movie *movie, char *filename)
+{
+	memset(movie, 0, sizeof(Movie));
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL)
+	{
+		printf("Couldn't open %s\n", filename);
+		return false;
+	}
+
+	MovieHeader *header = &movie->header;
+	if (fread(header, sizeof(MovieHeader), 1, fp) != 1 ||
+	    header->magic != MOVIE_MAGIC || header->version != MOVIE_VERSION ||
+	    header->checksum_interval == 0)
+	{
+		printf("%s is not a movie\n", filename);
+		fclose(fp);
+		return false;
+	}
+
+	uint32_t checksums = checksum_count(header);
+	movie->savestate = malloc(header->savestate_size + 1);
+	movie->buttons = malloc(header->frames * 2 + 1);
+	movie->checksums = malloc((checksums + 1) * sizeof(uint32_t));
+	movie->capacity = header->frames;
+
+	bool ok = movie->savestate != NULL && movie->buttons != NULL && movie->checksums != NULL &&
+	          fread(movie->savestate, 1, header->savestate_size, fp) == header->savestate_size &&
+	          fread(movie->buttons, 2, header->frames, fp) == header->frames &&
+	          fread(movie->checksums, sizeof(uint32_t), checksums, fp) == checksums;
+	fclose(fp);
+
+	if (!ok)
+	{
+		printf("%s is truncated\n", filename);
+		free_movie(movie);
+	}
+	return ok;
+}
+
+void free_movie(Movie *movie)
+{
+	free(movie->savestate);
+	free(movie->buttons);
+	free(movie->checksums);
+	memset(movie, 0, sizeof(Movie));
+}
+
+bool play_movie(Movie *movie, Nes *nes, int *mismatch_frame)
+{
+	MovieHeader *header = &movie->header;
+	*mismatch_frame = -1;
+
+	if (header->rom_crc != nes_rom_crc(nes))
+	{
+		printf("Movie was recorded with a different ROM\n");
+		return false;
+	}
+	if (header->savestate_size && !load_state(nes, movie->savestate, header->savestate_size))
+		return false;
+
+	bool skip_rendering = nes->ppu.skip_rendering;
+	nes->ppu.skip_rendering = true;
+
+	uint32_t frame = 0;
+	for (uint32_t i = 0; i < checksum_count(header); i++)
+	{
+		for (; frame < (i + 1) * header->checksum_interval; frame++)
+		{
+			memcpy(nes->input.buttons, movie->buttons + frame * 2, 2);
+			run_nes_frames(nes, 1);
+		}
+
+		if (nes_ram_checksum(nes) != movie->checksums[i])
+		{
+			*mismatch_frame = frame;
+			break;
+		}
+	}
+
+	// Frames after the last checksum still run, the caller may look at them
+	for (; *mismatch_frame < 0 && frame < header->frames; frame++)
+	{
+		memcpy(nes->input.buttons, movie->buttons + frame * 2, 2);
+		run_nes_frames(nes, 1);
+	}
+
+	nes->ppu.skip_rendering = skip_rendering;
+	return *mismatch_frame < 0;
+}
@@ -0,0 +1,65 @@
+/*
+
+Input movies
+
+- The buttons of both controllers for every frame, starting from power
+  on or from a savestate stored in the movie
+- Emulation only depends on the ROM, the starting state and the buttons
+  set before each frame, so replaying a movie repeats the session exactly
+- A CRC32 of RAM and PRG-RAM is stored every checksum_interval frames;
+  playback compares them and stops at the first difference
+- Playback is headless: it runs as fast as the core goes, with the PPU
+  only keeping the flags the CPU can see (Ppu.skip_rendering)
+
+File layout: MovieHeader, then `savestate_size` bytes of savestate, two
+bytes of buttons per frame, and frames / checksum_interval checksums.
+
+*/
+#ifndef MOVIE_H_
+#define MOVIE_H_
+
+#include "nes.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MOVIE_MAGIC   0x564F4D4E // "NMOV"
+#define MOVIE_VERSION 1
+
+#define MOVIE_DEFAULT_CHECKSUM_INTERVAL 60
+
+typedef struct movie_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rom_crc; // PRG followed by CHR, like RomIndexEntry.file_crc
+	uint32_t frames;
+	uint32_t checksum_interval;
+	uint32_t savestate_size; // 0 starts from power on
+} MovieHeader;
+
+typedef struct movie {
+	MovieHeader header;
+	uint8_t *savestate;
+	uint8_t *buttons;    // Controllers 1 and 2 for each frame
+	uint32_t *checksums; // After every checksum_interval frames
+	uint32_t capacity;   // Frames allocated while recording
+} Movie;
+
+uint32_t nes_rom_crc(Nes *nes);
+uint32_t nes_ram_checksum(Nes *nes);
+
+// Starts recording from the instance's current state, or from power on
+// when from_savestate is false (the instance must be freshly initialized)
+bool start_movie(Movie *movie, Nes *nes, bool from_savestate, int checksum_interval);
+
+// Runs one frame with the buttons in nes->input and adds it to the movie
+bool record_movie_frame(Movie *movie, Nes *nes);
+
+bool write_movie(Movie *movie, char *filename);
+bool read_movie(Movie *movie, char *filename);
+void free_movie(Movie *movie);
+
+// Replays the whole movie on a freshly initialized instance. mismatch_frame
+// is the frame count at the first wrong checksum, or -1
+bool play_movie(Movie *movie, Nes *nes, int *mismatch_frame);
+
+#endif
@@ -0,0 +1,183 @@
+#include "nes.h"
+#include <string.h>
+
+/* Scanline n starts n * 341 / 3 cycles into its frame, rounded down */
+static uint64_t scanline_start(uint64_t frame, int line)
+{
+	return frame * CPU_CYCLES_PER_FRAME + line * DOTS_PER_SCANLINE / 3;
+}
+
+static void scanline_event(void *context, uint64_t time)
+{
+	Nes *nes = context;
+	uint64_t frame = time / CPU_CYCLES_PER_FRAME;
+	int line = ((time % CPU_CYCLES_PER_FRAME) * 3 + DOTS_PER_SCANLINE - 1) / DOTS_PER_SCANLINE;
+
+	// The MMC3 counts PPU A12 rises, which only happen while rendering
+	if (line < VISIBLE_SCANLINES && (nes->ppu.state.mask & (MASK_BG | MASK_SPRITES)))
+		mapper_scanline(&nes->mapper);
+
+	if (++line == SCANLINES_PER_FRAME)
+	{
+		line = 0;
+		frame ++;
+	}
+	schedule_event(&nes->cpu.scheduler, nes->scanline_event, scanline_start(frame, line));
+}
+
+/* Buttons come out A first, then 1s once all 8 are read. The top bits
+   are open bus, which is still $40 from the address */
+static uint8_t read_controller(InputState *input, int port)
+{
+	if (input->strobe)
+		input->shift[port] = input->buttons[port];
+
+	uint8_t bit = input->shift[port] & 1;
+	input->shift[port] = (input->shift[port] >> 1) | 0x80;
+	return 0x40 | bit;
+}
+
+static uint8_t read_io_registers(void *context, uint16_t addr)
+{
+	Nes *nes = context;
+	switch (addr)
+	{
+		case 0x4015: return read_apu_status(&nes->apu);
+		case 0x4016: return read_controller(&nes->input, 0);
+		case 0x4017: return read_controller(&nes->input, 1);
+		default:     return addr >> 8; // Open bus
+	}
+}
+
+static void write_io_registers(void *context, uint16_t addr, uint8_t byte)
+{
+	Nes *nes = context;
+	if (addr == 0x4014)
+	{
+		ppu_oam_dma(&nes->ppu, byte);
+	}
+	else if (addr == 0x4016)
+	{
+		// Both controllers latch while the strobe is high
+		nes->input.strobe = byte & 1;
+		if (nes->input.strobe)
+			memcpy(nes->input.shift, nes->input.buttons, sizeof(nes->input.shift));
+	}
+	else if (addr <= 0x4017)
+	{
+		write_apu_register(&nes->apu, addr, byte);
+	}
+}
+
+bool init_nes(Nes *nes, char *rom_file, char *log_file, bool use_jit)
+{
+	Cartridge *cart = malloc(sizeof(Cartridge));
+	if (cart == NULL || !load_cartridge(cart, rom_file))
+	{
+		free(cart);
+		return false;
+	}
+
+	if (!init_nes_with_cartridge(nes, cart, log_file, use_jit))
+	{
+		free_cartridge(cart);
+		free(cart);
+		return false;
+	}
+	nes->owns_cart = true;
+	return true;
+}
+
+bool init_nes_with_cartridge(Nes *nes, Cartridge *cart, char *log_file, bool use_jit)
+{
+	memset(nes, 0, sizeof(Nes));
+	nes->cart = cart;
+
+	init_shared_memory(&nes->mem);
+	if (!init_mapper(&nes->mapper, &cart->rom, &nes->mem))
+		return false;
+
+	// Only NES 2.0 headers can say there's none, iNES always gets 8 KB
+	if (cart->rom.pgr_ram_size + cart->rom.pgr_nvram_size == 0)
+		map_io(&nes->mem, 0x6000, 0x7FFF, NULL);
+
+	init_cpu(&nes->cpu, &nes->mem, log_file);
+	nes->cpu.decoded = cart->decoded;
+	nes->cpu.PC = peek_cpu_memory(&nes->mem, 0xFFFC) | (peek_cpu_memory(&nes->mem, 0xFFFD) << 8);
+	nes->mapper.cpu = &nes->cpu;
+
+	// Only the MMC3 IRQ counter needs every scanline, the PPU itself
+	// catches up when it's touched and at vblank
+	nes->scanline_event = add_event(&nes->cpu.scheduler, &scanline_event, nes);
+	if (nes->mapper.id == 4)
+		schedule_event(&nes->cpu.scheduler, nes->scanline_event, scanline_start(0, 0));
+
+	if (!init_ppu(&nes->ppu, &nes->mapper, cart->tiles, &nes->cpu, &nes->mem))
+	{
+		cleanup_cpu(&nes->cpu);
+		cleanup_mapper(&nes->mapper);
+		return false;
+	}
+
+	if (!init_apu(&nes->apu, &nes->cpu, &nes->mem, APU_DEFAULT_SAMPLE_RATE))
+	{
+		cleanup_ppu(&nes->ppu);
+		cleanup_cpu(&nes->cpu);
+		cleanup_mapper(&nes->mapper);
+		return false;
+	}
+
+	nes->io.read = &read_io_registers;
+	nes->io.write = &write_io_registers;
+	nes->io.context = nes;
+	map_io(&nes->mem, 0x4000, 0x40FF, &nes->io);
+
+	if (use_jit)
+	{
+		nes->jit = malloc(sizeof(Jit));
+		if (nes->jit != NULL && init_jit(nes->jit))
+		{
+			nes->cpu.jit = nes->jit;
+		}
+		else
+		{
+			free(nes->jit);
+			nes->jit = NULL;
+		}
+	}
+
+	return true;
+}
+
+void run_nes_frames(Nes *nes, int frames)
+{
+	for (int i = 0; i < frames; i++)
+	{
+		execute_cpu_instructions(&nes->cpu);
+		end_apu_frame(&nes->apu, cpu_time(&nes->cpu));
+
+		// Vblank has come and gone, the picture is complete
+		if (nes->capture != NULL)
+			capture_frame(nes->capture, nes->ppu.picture);
+	}
+}
+
+void cleanup_nes(Nes *nes)
+{
+	if (nes->jit != NULL)
+	{
+		cleanup_jit(nes->jit);
+		free(nes->jit);
+	}
+
+	cleanup_ppu(&nes->ppu);
+	cleanup_cpu(&nes->cpu);
+	cleanup_mapper(&nes->mapper);
+	cleanup_shared_memory(&nes->mem);
+	if (nes->owns_cart)
+	{
+		free_cartridge(nes->cart);
+		free(nes->cart);
+	}
+	memset(nes, 0, sizeof(Nes));
+}
@@ -0,0 +1,76 @@
+/*
+
+Emulator instance
+
+- Everything one running console needs, owned by a single struct
+- No state is shared between instances, so any number of them can run
+  on different threads at once
+- Components point at each other inside the struct, so a Nes must not
+  be moved or copied after init_nes()
+- The struct is only what one console changes while it runs, about
+  18 KB: registers, RAM, page tables, PPU and APU state, mapper
+  registers. The framebuffers and CHR-RAM are allocated next to it,
+  PRG-RAM only when the game first writes it, the ROM and
+  anything decoded from it live in a Cartridge that any number of
+  instances can share
+
+*/
+#ifndef NES_H_
+#define NES_H_
+
+#include "apu.h"
+#include "capture.h"
+#include "cartridge.h"
+#include "cpu.h"
+#include "jit.h"
+#include "mapper.h"
+#include "ppu.h"
+#include "rom.h"
+#include "shared_mem.h"
+#include <stdbool.h>
+
+/* Standard controller, bits of InputState.buttons */
+#define BUTTON_A      0x01
+#define BUTTON_B      0x02
+#define BUTTON_SELECT 0x04
+#define BUTTON_START  0x08
+#define BUTTON_UP     0x10
+#define BUTTON_DOWN   0x20
+#define BUTTON_LEFT   0x40
+#define BUTTON_RIGHT  0x80
+
+// Two controllers on $4016/$4017
+typedef struct input_state {
+	uint8_t buttons[2]; // Held right now, set by the host before a frame
+	uint8_t shift[2];   // Latched buttons, read out a bit at a time
+	uint8_t strobe;
+} InputState;
+
+// Allocate instances on cache lines, so no two of them share one
+#define NES_ALIGNMENT 64
+
+typedef struct nes {
+	Cartridge *cart; // Read only
+	bool owns_cart;  // Loaded by init_nes(), freed with the instance
+	SharedMemory mem;
+	Mapper mapper;
+	Cpu cpu;
+	Ppu ppu;
+	Apu apu;
+	InputState input;
+	IoHandler io; // $4000-$40FF: APU, OAM DMA, controllers
+	Jit *jit; // NULL unless requested
+	Capture *capture; // NULL unless recording, gets every finished frame
+
+	int scanline_event; // Scheduler id
+} Nes;
+
+// log_file is the instance's CPU log, NULL for none
+bool init_nes(Nes *nes, char *rom_file, char *log_file, bool use_jit);
+
+// Same with a cartridge loaded by the caller, which has to outlive the instance
+bool init_nes_with_cartridge(Nes *nes, Cartridge *cart, char *log_file, bool use_jit);
+void run_nes_frames(Nes *nes, int frames);
+void cleanup_nes(Nes *nes);
+
+#endif
@@ -0,0 +1,161 @@
+#include "nestest.h"
+#include "cartridge.h"
+#include "cpu.h"
+#include "mapper.h"
+#include "trace.h"
+#include <string.h>
+#include <time.h>
+
+#define LINE_SIZE 128
+
+typedef struct expected_state {
+	uint16_t PC;
+	unsigned int A, X, Y, P, SP;
+	unsigned long cycle;
+} ExpectedState;
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+/* Parse `digits` hex digits following `field` (e.g. "SP:") in line */
+static bool parse_hex_field(char *line, const char *field, int digits, unsigned int *value)
+{
+	char *text = line;
+	if (field != NULL)
+	{
+		text = strstr(line, field);
+		if (text == NULL) return false;
+		text += strlen(field);
+	}
+
+	*value = 0;
+	for (int i = 0; i < digits; i++)
+	{
+		int digit = hex_digit(text[i]);
+		if (digit < 0) return false;
+		*value = (*value << 4) | digit;
+	}
+	return true;
+}
+
+/* sscanf dominates the run time, so the fields are picked out by hand */
+static bool parse_log_line(char *line, ExpectedState *state)
+{
+	unsigned int pc;
+	char *cycles = strstr(line, "CYC:");
+
+	if (!parse_hex_field(line, NULL, 4, &pc) ||
+	    !parse_hex_field(line, "A:", 2, &state->A) ||
+	    !parse_hex_field(line, "X:", 2, &state->X) ||
+	    !parse_hex_field(line, "Y:", 2, &state->Y) ||
+	    !parse_hex_field(line, "P:", 2, &state->P) ||
+	    !parse_hex_field(line, "SP:", 2, &state->SP) || cycles == NULL)
+		return false;
+
+	state->PC = pc;
+	state->cycle = strtoul(cycles + 4, NULL, 10);
+	return true;
+}
+
+static bool state_matches(TraceRecord *got, ExpectedState *expected)
+{
+	return got->PC == expected->PC && got->A == expected->A &&
+	       got->X == expected->X && got->Y == expected->Y &&
+	       got->P == expected->P && got->SP == expected->SP &&
+	       got->cycle == expected->cycle;
+}
+
+static void print_divergence(char context[][LINE_SIZE], long line_number,
+                             char *expected, TraceRecord *got)
+{
+	long first = line_number - NESTEST_CONTEXT;
+	if (first < 1) first = 1;
+
+	printf("Divergence at line %ld\n", line_number);
+	for (long i = first; i < line_number; i++)
+		printf("      %s", context[i % NESTEST_CONTEXT]);
+
+	char line[LINE_SIZE];
+	format_trace_record(got, line, sizeof(line));
+	printf("want: %s", expected);
+	printf("got:  %s\n", line);
+}
+
+bool run_nestest(char *rom_file, char *log_file)
+{
+	FILE *log = fopen(log_file, "r");
+	if (log == NULL)
+	{
+		printf("Couldn't open %s\n", log_file);
+		return false;
+	}
+
+	Cartridge cart;
+	if (!load_cartridge(&cart, rom_file))
+	{
+		fclose(log);
+		return false;
+	}
+
+	SharedMemory *mem = malloc(sizeof(SharedMemory));
+	Mapper *mapper = malloc(sizeof(Mapper));
+	Cpu cpu;
+
+	init_shared_memory(mem);
+	bool ok = init_mapper(mapper, &cart.rom, mem);
+	init_cpu(&cpu, mem, NULL);
+	cpu.decoded = cart.decoded;
+	cpu.PC = NESTEST_START_PC;
+	cpu.cycle_count = NESTEST_START_CYCLES;
+	set_status_flags(&cpu, NESTEST_START_STATUS);
+
+	char context[NESTEST_CONTEXT][LINE_SIZE];
+	char line[LINE_SIZE];
+	long line_number = 0;
+	ExpectedState expected;
+	TraceRecord got;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (ok && fgets(line, sizeof(line), log) != NULL)
+	{
+		line_number ++;
+		if (!parse_log_line(line, &expected))
+		{
+			printf("Can't parse line %ld of %s\n", line_number, log_file);
+			ok = false;
+			break;
+		}
+
+		capture_trace_record(&cpu, &got);
+		if (!state_matches(&got, &expected))
+		{
+			print_divergence(context, line_number, line, &got);
+			ok = false;
+			break;
+		}
+
+		memcpy(context[line_number % NESTEST_CONTEXT], line, LINE_SIZE);
+		step_cpu(&cpu);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+	long matched = ok ? line_number : line_number - 1;
+	printf("%s: %ld instructions matched, %.2f M instructions/s\n",
+		ok ? "PASS" : "FAIL", matched, seconds > 0 ? matched / seconds / 1e6 : 0.0);
+
+	cleanup_cpu(&cpu);
+	cleanup_shared_memory(mem);
+	free(mapper);
+	free(mem);
+	free_cartridge(&cart);
+	fclose(log);
+	return ok;
+}
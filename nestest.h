@@ -0,0 +1,24 @@
+/*
+
+nestest conformance check
+
+- Runs nestest.nes from $C000 (automation mode, no PPU needed)
+- Compares the CPU state before every instruction against a reference
+  nestest.log, read one line at a time
+- Stops at the first divergence and prints the lines leading up to it
+
+*/
+#ifndef NESTEST_H_
+#define NESTEST_H_
+
+#include <stdbool.h>
+
+#define NESTEST_START_PC     0xC000
+#define NESTEST_START_CYCLES 7
+#define NESTEST_START_STATUS 0x24
+#define NESTEST_CONTEXT      8 // Matching lines shown before a divergence
+
+// Returns true when every line of the log matched
+bool run_nestest(char *rom_file, char *log_file);
+
+#endif
@@ -0,0 +1,567 @@
+#include "ppu.h"
+#include "render_thread.h"
+#include "video.h"
+#include <string.h>
+
+// Sprite pixels carry their palette RAM index plus these two flags
+#define SPRITE_BEHIND 0x20
+#define SPRITE_ZERO   0x40
+
+/* CPU cycle at which the raster reaches the first dot of `line` */
+static uint64_t line_time(uint64_t frame, int line)
+{
+	return frame * CPU_CYCLES_PER_FRAME + (line * DOTS_PER_SCANLINE + 1) / 3;
+}
+
+static bool rendering(PpuState *state)
+{
+	return state->mask & (MASK_BG | MASK_SPRITES);
+}
+
+/* Decode one row of a CHR tile, offset is any byte of that row */
+static void decode_row(Ppu *ppu, size_t offset)
+{
+	size_t tile = offset & ~0x0F;
+	int row = offset & 0x07;
+	uint8_t low = ppu->mapper->chr[tile + row];
+	uint8_t high = ppu->mapper->chr[tile + row + 8];
+	uint8_t *out = ppu->tiles + tile * 4 + row * 8;
+
+	for (int pixel = 0; pixel < 8; pixel++)
+		out[pixel] = ((low >> (7 - pixel)) & 1) | (((high >> (7 - pixel)) & 1) << 1);
+}
+
+static void map_tile_banks(Ppu *ppu)
+{
+	Mapper *mapper = ppu->mapper;
+	for (int i = 0; i < CHR_BANK_COUNT; i++)
+		ppu->tile_banks[i] = ppu->tiles + (mapper->chr_banks[i] - mapper->chr) * 4;
+	ppu->chr_generation = mapper->chr_generation;
+}
+
+void refresh_ppu_tiles(Ppu *ppu)
+{
+	if (!ppu->shared_tiles)
+		best_pixel_kernels()->decode_tiles(ppu->mapper->chr, ppu->tiles, ppu->mapper->chr_size / TILE_BYTES);
+	map_tile_banks(ppu);
+}
+
+/* Eight decoded pixels of the pattern at addr ($0000-$1FFF) */
+static const uint8_t *tile_row(Ppu *ppu, uint16_t addr, int row)
+{
+	return ppu->tile_banks[addr >> 10] + (addr & 0x3F0) * 4 + row * 8;
+}
+
+/* Which 1 KB of VRAM each of the four nametables lands in */
+static uint8_t *nametable(Ppu *ppu, int table)
+{
+	switch (ppu->mapper->state.mirroring)
+	{
+		case mirror_horizontal:  table >>= 1; break;
+		case mirror_vertical:    table &= 1; break;
+		case mirror_single_low:  table = 0; break;
+		case mirror_single_high: table = 1; break;
+	}
+	return ppu->state.vram + table * 0x400;
+}
+
+static int palette_index(uint16_t addr)
+{
+	addr &= 0x1F;
+	if ((addr & 0x13) == 0x10) // Sprite backdrops mirror the background ones
+		addr &= ~0x10;
+	return addr;
+}
+
+static uint8_t read_vram(Ppu *ppu, uint16_t addr)
+{
+	addr &= 0x3FFF;
+	if (addr < 0x2000)
+		return ppu->mapper->chr_banks[addr >> 10][addr & 0x3FF];
+	if (addr < 0x3F00)
+		return nametable(ppu, (addr >> 10) & 3)[addr & 0x3FF];
+	return ppu->state.palette[palette_index(addr)];
+}
+
+static void write_vram(Ppu *ppu, uint16_t addr, uint8_t byte)
+{
+	addr &= 0x3FFF;
+	if (addr < 0x2000)
+	{
+		if (!ppu->mapper->has_chr_ram)
+			return;
+
+		uint8_t *chr = &ppu->mapper->chr_banks[addr >> 10][addr & 0x3FF];
+		*chr = byte;
+		decode_row(ppu, chr - ppu->mapper->chr);
+	}
+	else if (addr < 0x3F00)
+	{
+		nametable(ppu, (addr >> 10) & 3)[addr & 0x3FF] = byte;
+	}
+	else
+	{
+		ppu->state.palette[palette_index(addr)] = byte & 0x3F;
+	}
+}
+
+static uint16_t increment_coarse_x(uint16_t v)
+{
+	if ((v & 0x001F) == 31)
+		return (v & ~0x001F) ^ 0x0400; // Into the next nametable over
+	return v + 1;
+}
+
+static uint16_t increment_y(uint16_t v)
+{
+	if ((v & 0x7000) != 0x7000)
+		return v + 0x1000;
+
+	v &= ~0x7000;
+	int coarse_y = (v & 0x03E0) >> 5;
+	if (coarse_y == 29)
+	{
+		coarse_y = 0;
+		v ^= 0x0800; // Into the nametable below
+	}
+	else if (coarse_y == 31)
+	{
+		coarse_y = 0; // Attribute rows wrap without switching tables
+	}
+	else
+	{
+		coarse_y ++;
+	}
+	return (v & ~0x03E0) | (coarse_y << 5);
+}
+
+/* Palette RAM indices, 0 where the background is transparent */
+static void render_background(Ppu *ppu, uint8_t *out)
+{
+	PpuState *state = &ppu->state;
+	uint8_t tiles[PPU_WIDTH + 8];
+	uint8_t *tables[4];
+	for (int i = 0; i < 4; i++)
+		tables[i] = nametable(ppu, i);
+
+	uint16_t v = state->v;
+	uint16_t pattern_table = (state->ctrl & CTRL_BG_TABLE) ? 0x1000 : 0x0000;
+	int fine_y = (v >> 12) & 0x07;
+
+	// 33 tiles cover the line at any fine X
+	for (int i = 0; i < 33; i++)
+	{
+		uint8_t *table = tables[(v >> 10) & 3];
+		uint8_t tile = table[v & 0x03FF];
+		uint8_t attribute = table[0x03C0 | ((v >> 4) & 0x38) | ((v >> 2) & 0x07)];
+		uint8_t palette = ((attribute >> (((v >> 4) & 0x04) | (v & 0x02))) & 0x03) << 2;
+
+		const uint8_t *pixels = tile_row(ppu, pattern_table | (tile << 4), fine_y);
+		for (int pixel = 0; pixel < 8; pixel++)
+			tiles[i * 8 + pixel] = pixels[pixel] ? (palette | pixels[pixel]) : 0;
+
+		v = increment_coarse_x(v);
+	}
+
+	memcpy(out, tiles + state->x, PPU_WIDTH);
+}
+
+/* Palette RAM indices with SPRITE_ flags, 0 where no sprite is */
+static void render_sprites(Ppu *ppu, int line, uint8_t *out)
+{
+	PpuState *state = &ppu->state;
+	int height = (state->ctrl & CTRL_SPRITE_8X16) ? 16 : 8;
+	uint16_t pattern_table = (state->ctrl & CTRL_SPRITE_TABLE) ? 0x1000 : 0x0000;
+	int found = 0;
+
+	memset(out, 0, PPU_WIDTH);
+	for (int i = 0; i < 64; i++)
+	{
+		uint8_t *sprite = &state->oam[i * 4];
+		int row = line - sprite[0] - 1; // Sprites show up a line below their Y
+		if (row < 0 || row >= height)
+			continue;
+		if (++found > 8)
+		{
+			state->status |= STATUS_OVERFLOW;
+			break;
+		}
+
+		uint8_t attributes = sprite[2];
+		if (attributes & 0x80)
+			row = height - 1 - row;
+
+		uint16_t addr;
+		if (height == 16)
+			addr = ((sprite[1] & 0x01) << 12) | ((sprite[1] & 0xFE) << 4) | ((row & 0x08) << 1);
+		else
+			addr = pattern_table | (sprite[1] << 4);
+
+		const uint8_t *pixels = tile_row(ppu, addr, row & 0x07);
+		uint8_t flags = 0x10 | ((attributes & 0x03) << 2);
+		if (attributes & 0x20) flags |= SPRITE_BEHIND;
+		if (i == 0) flags |= SPRITE_ZERO;
+
+		// Lower OAM entries win, so only fill pixels nobody has claimed
+		for (int pixel = 0; pixel < 8 && sprite[3] + pixel < PPU_WIDTH; pixel++)
+		{
+			uint8_t color = pixels[(attributes & 0x40) ? 7 - pixel : pixel];
+			uint8_t *dest = &out[sprite[3] + pixel];
+			if (color && !*dest)
+				*dest = flags | color;
+		}
+	}
+}
+
+/* What a hidden line still owes the game: the overflow flag, and
+   whether sprite 0 could hit here. Returns false when the pixels are
+   needed for the hit */
+static bool skip_scanline(Ppu *ppu, int line)
+{
+	PpuState *state = &ppu->state;
+	int height = (state->ctrl & CTRL_SPRITE_8X16) ? 16 : 8;
+	if (!(state->mask & MASK_SPRITES))
+		return true;
+
+	int found = 0;
+	for (int i = 0; i < 64 && found <= 8; i++)
+	{
+		int row = line - state->oam[i * 4] - 1;
+		if (row < 0 || row >= height)
+			continue;
+		if (i == 0 && (state->mask & MASK_BG) && state->sprite_0_time == EVENT_NEVER)
+			return false;
+		found ++;
+	}
+	if (found > 8)
+		state->status |= STATUS_OVERFLOW;
+	return true;
+}
+
+static void render_scanline(Ppu *ppu, int line)
+{
+	PpuState *state = &ppu->state;
+	uint8_t hidden[PPU_WIDTH]; // Lines only drawn for sprite 0 go nowhere
+	uint8_t *out = ppu->skip_rendering ? hidden : ppu->framebuffer[line];
+
+	if (!rendering(state))
+	{
+		if (!ppu->skip_rendering)
+			memset(out, state->palette[0], PPU_WIDTH);
+		return;
+	}
+
+	if (ppu->chr_generation != ppu->mapper->chr_generation)
+		map_tile_banks(ppu);
+
+	// The pre-render line copies all of t, later lines only the horizontal part
+	if (line == 0)
+		state->v = state->t;
+	else
+		state->v = (state->v & ~0x041F) | (state->t & 0x041F);
+
+	if (ppu->skip_rendering && skip_scanline(ppu, line))
+	{
+		state->v = increment_y(state->v);
+		return;
+	}
+
+	uint8_t background[PPU_WIDTH];
+	uint8_t sprites[PPU_WIDTH];
+
+	if (state->mask & MASK_BG)
+		render_background(ppu, background);
+	else
+		memset(background, 0, PPU_WIDTH);
+	if (!(state->mask & MASK_BG_LEFT))
+		memset(background, 0, 8);
+
+	if (state->mask & MASK_SPRITES)
+		render_sprites(ppu, line, sprites);
+	else
+		memset(sprites, 0, PPU_WIDTH);
+	if (!(state->mask & MASK_SPRITES_LEFT))
+		memset(sprites, 0, 8);
+
+	// Local copies, stores to out could otherwise alias anything in state
+	uint8_t colors[32];
+	uint8_t gray = (state->mask & MASK_GRAYSCALE) ? 0x30 : 0x3F;
+	for (int i = 0; i < 32; i++)
+		colors[i] = state->palette[i] & gray;
+
+	int hit = -1;
+	for (int x = 0; x < PPU_WIDTH; x++)
+	{
+		uint8_t bg = background[x];
+		uint8_t sprite = sprites[x];
+
+		if ((sprite & SPRITE_ZERO) && bg && hit < 0 && x != 255)
+			hit = x;
+
+		uint8_t index = (sprite && (!bg || !(sprite & SPRITE_BEHIND))) ? (sprite & 0x1F) : bg;
+		out[x] = colors[index];
+	}
+
+	if (hit >= 0 && state->sprite_0_time == EVENT_NEVER)
+		state->sprite_0_time = line_time(state->frame, line) + (hit + 1) / 3;
+
+	state->v = increment_y(state->v);
+}
+
+void ppu_catch_up(Ppu *ppu, uint64_t time)
+{
+	PpuState *state = &ppu->state;
+	if (ppu->render_thread != NULL)
+		log_ppu_catch_up(ppu->render_thread, time);
+
+	while (line_time(state->frame, state->line) <= time)
+	{
+		if (state->line < VISIBLE_SCANLINES)
+		{
+			render_scanline(ppu, state->line);
+			state->line = (state->line + 1 < VISIBLE_SCANLINES) ? state->line + 1 : VBLANK_SCANLINE;
+		}
+		else if (state->line == VBLANK_SCANLINE)
+		{
+			state->status |= STATUS_VBLANK;
+			if ((state->ctrl & CTRL_NMI) && ppu->cpu != NULL)
+				trigger_nmi(ppu->cpu);
+			state->line = PRERENDER_SCANLINE;
+
+			if (ppu->render_thread != NULL)
+				render_thread_vblank(ppu->render_thread, line_time(state->frame, VBLANK_SCANLINE));
+			else if (!ppu->skip_rendering && ppu->picture != NULL)
+				memcpy(ppu->picture, ppu->framebuffer, PPU_HEIGHT * PPU_WIDTH);
+		}
+		else
+		{
+			state->status &= ~(STATUS_VBLANK | STATUS_SPRITE_0_HIT | STATUS_OVERFLOW);
+			state->sprite_0_time = EVENT_NEVER;
+			state->line = 0;
+			state->frame ++;
+		}
+	}
+}
+
+/* Vblank has to be on time for the NMI even if nobody reads $2002 */
+static void vblank_event(void *context, uint64_t time)
+{
+	Ppu *ppu = context;
+	ppu_catch_up(ppu, time);
+	schedule_event(&ppu->cpu->scheduler, ppu->vblank_event,
+		line_time(time / CPU_CYCLES_PER_FRAME + 1, VBLANK_SCANLINE));
+}
+
+uint8_t ppu_read_register(Ppu *ppu, uint16_t addr, uint64_t time)
+{
+	PpuState *state = &ppu->state;
+	ppu_catch_up(ppu, time);
+
+	switch (addr & 0x07)
+	{
+		case 2: // PPUSTATUS
+		{
+			if (time >= state->sprite_0_time)
+				state->status |= STATUS_SPRITE_0_HIT;
+
+			uint8_t value = state->status | (state->latch & 0x1F);
+			state->status &= ~STATUS_VBLANK;
+			state->w = 0;
+			return value;
+		}
+
+		case 4: // OAMDATA
+			return state->oam[state->oam_addr];
+
+		case 7: // PPUDATA
+		{
+			uint8_t value;
+			if ((state->v & 0x3FFF) >= 0x3F00)
+			{
+				// Palette reads are immediate, the buffer gets the nametable underneath
+				value = read_vram(ppu, state->v);
+				state->read_buffer = read_vram(ppu, state->v - 0x1000);
+			}
+			else
+			{
+				value = state->read_buffer;
+				state->read_buffer = read_vram(ppu, state->v);
+			}
+			state->v += (state->ctrl & CTRL_INCREMENT_32) ? 32 : 1;
+			return value;
+		}
+
+		default: // Write only
+			return state->latch;
+	}
+}
+
+static uint8_t read_registers(void *context, uint16_t addr)
+{
+	Ppu *ppu = context;
+	uint64_t now = cpu_time(ppu->cpu);
+	uint8_t value = ppu_read_register(ppu, addr, now);
+
+	// Other reads have no side effects to draw
+	if (ppu->render_thread != NULL && ((addr & 0x07) == 2 || (addr & 0x07) == 7))
+		log_ppu_access(ppu->render_thread, now, render_log_read, addr & 0x07, 0);
+	return value;
+}
+
+/* $2002 only changes when the next line is caught up or sprite 0 hits.
+   PPUDATA reads move v, everything else reads back as it was */
+static uint64_t registers_idle_until(void *context, uint16_t addr)
+{
+	Ppu *ppu = context;
+	PpuState *state = &ppu->state;
+
+	switch (addr & 0x07)
+	{
+		case 2:
+		{
+			uint64_t until = line_time(state->frame, state->line);
+			if (!(state->status & STATUS_SPRITE_0_HIT) && state->sprite_0_time < until)
+				until = state->sprite_0_time;
+			return until;
+		}
+
+		case 7:
+			return 0;
+
+		default:
+			return EVENT_NEVER;
+	}
+}
+
+void ppu_write_register(Ppu *ppu, uint16_t addr, uint8_t byte, uint64_t time)
+{
+	PpuState *state = &ppu->state;
+	ppu_catch_up(ppu, time);
+	state->latch = byte;
+
+	switch (addr & 0x07)
+	{
+		case 0: // PPUCTRL
+			// Turning NMIs on during vblank fires one right away
+			if ((byte & CTRL_NMI) && !(state->ctrl & CTRL_NMI) && (state->status & STATUS_VBLANK) && ppu->cpu != NULL)
+				trigger_nmi(ppu->cpu);
+			state->ctrl = byte;
+			state->t = (state->t & ~0x0C00) | ((byte & 0x03) << 10);
+			break;
+
+		case 1: // PPUMASK
+			state->mask = byte;
+			break;
+
+		case 3: // OAMADDR
+			state->oam_addr = byte;
+			break;
+
+		case 4: // OAMDATA
+			state->oam[state->oam_addr++] = byte;
+			break;
+
+		case 5: // PPUSCROLL
+			if (state->w == 0)
+			{
+				state->t = (state->t & ~0x001F) | (byte >> 3);
+				state->x = byte & 0x07;
+			}
+			else
+			{
+				state->t = (state->t & ~0x73E0) | ((byte & 0x07) << 12) | ((byte & 0xF8) << 2);
+			}
+			state->w ^= 1;
+			break;
+
+		case 6: // PPUADDR
+			if (state->w == 0)
+			{
+				state->t = (state->t & 0x00FF) | ((byte & 0x3F) << 8);
+			}
+			else
+			{
+				state->t = (state->t & 0xFF00) | byte;
+				state->v = state->t;
+			}
+			state->w ^= 1;
+			break;
+
+		case 7: // PPUDATA
+			write_vram(ppu, state->v, byte);
+			state->v += (state->ctrl & CTRL_INCREMENT_32) ? 32 : 1;
+			break;
+	}
+}
+
+static void write_registers(void *context, uint16_t addr, uint8_t byte)
+{
+	Ppu *ppu = context;
+	uint64_t now = cpu_time(ppu->cpu);
+	ppu_write_register(ppu, addr, byte, now);
+
+	if (ppu->render_thread != NULL)
+		log_ppu_access(ppu->render_thread, now, render_log_write, addr & 0x07, byte);
+}
+
+void ppu_oam_dma(Ppu *ppu, uint8_t page)
+{
+	PpuState *state = &ppu->state;
+	uint64_t now = cpu_time(ppu->cpu);
+	ppu_catch_up(ppu, now);
+
+	for (int i = 0; i < 256; i++)
+	{
+		uint8_t byte = read_cpu_memory(ppu->cpu->memspace, (page << 8) | i);
+		state->oam[(state->oam_addr + i) & 0xFF] = byte;
+		if (ppu->render_thread != NULL)
+			log_ppu_access(ppu->render_thread, now, render_log_write, 4, byte);
+	}
+
+	// A read and a write per byte, plus one cycle to line up on an even one
+	ppu->cpu->cycle_count += 513 + (cpu_time(ppu->cpu) & 1);
+}
+
+bool init_ppu(Ppu *ppu, Mapper *mapper, uint8_t *shared_tiles, Cpu *cpu, SharedMemory *mem)
+{
+	memset(ppu, 0, sizeof(Ppu));
+	ppu->mapper = mapper;
+	ppu->cpu = cpu;
+
+	// Pages nobody draws into, like when rendering is skipped, never get backed
+	ppu->framebuffer = calloc(PPU_HEIGHT, PPU_WIDTH);
+	ppu->picture = calloc(PPU_HEIGHT, PPU_WIDTH);
+	ppu->shared_tiles = shared_tiles != NULL;
+	ppu->tiles = ppu->shared_tiles ? shared_tiles : malloc((size_t) mapper->chr_size * 4);
+	if (ppu->framebuffer == NULL || ppu->picture == NULL || ppu->tiles == NULL)
+	{
+		printf("Unable to allocate the CHR tile cache or framebuffer\n");
+		cleanup_ppu(ppu);
+		return false;
+	}
+	refresh_ppu_tiles(ppu);
+
+	ppu->state.frame = cpu->frame_count;
+	ppu->state.sprite_0_time = EVENT_NEVER;
+
+	ppu->registers.read = &read_registers;
+	ppu->registers.write = &write_registers;
+	ppu->registers.idle_until = &registers_idle_until;
+	ppu->registers.context = ppu;
+	map_io(mem, 0x2000, 0x3FFF, &ppu->registers);
+
+	ppu->vblank_event = add_event(&cpu->scheduler, &vblank_event, ppu);
+	schedule_event(&cpu->scheduler, ppu->vblank_event, line_time(cpu->frame_count, VBLANK_SCANLINE));
+	return true;
+}
+
+void cleanup_ppu(Ppu *ppu)
+{
+	if (!ppu->shared_tiles)
+		free(ppu->tiles);
+	free(ppu->framebuffer);
+	free(ppu->picture);
+	ppu->tiles = NULL;
+	ppu->framebuffer = NULL;
+	ppu->picture = NULL;
+}
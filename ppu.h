@@ -0,0 +1,125 @@
+/*
+
+2C02 picture processing unit
+
+- Renders a whole scanline at a time into an indexed framebuffer
+  (NES palette entries, 0-63)
+- The framebuffer is copied to the picture at vblank. A frame's last
+  instruction can run past the frame and draw the next one's line 0
+  before anyone looks, the picture stays whole
+- Catches up lazily: rendering only happens when the CPU touches a PPU
+  register, or when the vblank event comes around
+- CHR is decoded once from 2bpp planes into one byte per pixel. Bank
+  switches only re-point tile_banks, CHR-RAM writes re-decode the row
+  that changed
+- Nametables with all mirroring modes, attributes, scrolling (loopy
+  v/t/x/w), 8x8 and 8x16 sprites, sprite 0 hit and overflow
+
+Not emulated: mid-scanline register changes (a line sees the registers
+as they were when it started), the odd frame skipped dot, sprite
+overflow hardware bug, color emphasis.
+
+*/
+#ifndef PPU_H_
+#define PPU_H_
+
+#include "cpu.h"
+#include "mapper.h"
+#include "shared_mem.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PPU_WIDTH  256
+#define PPU_HEIGHT 240
+
+/* NTSC raster timing, the PPU runs 3 dots per CPU cycle */
+#define DOTS_PER_SCANLINE   341
+#define SCANLINES_PER_FRAME 262
+#define VISIBLE_SCANLINES   240
+#define VBLANK_SCANLINE     241
+#define PRERENDER_SCANLINE  261
+
+#define PPU_VRAM_SIZE 0x1000 // Four screen carts use all of it, the rest only 2 KB
+
+/* $2000 PPUCTRL */
+#define CTRL_INCREMENT_32   0x04
+#define CTRL_SPRITE_TABLE   0x08
+#define CTRL_BG_TABLE       0x10
+#define CTRL_SPRITE_8X16    0x20
+#define CTRL_NMI            0x80
+
+/* $2001 PPUMASK */
+#define MASK_GRAYSCALE      0x01
+#define MASK_BG_LEFT        0x02
+#define MASK_SPRITES_LEFT   0x04
+#define MASK_BG             0x08
+#define MASK_SPRITES        0x10
+
+/* $2002 PPUSTATUS */
+#define STATUS_OVERFLOW     0x20
+#define STATUS_SPRITE_0_HIT 0x40
+#define STATUS_VBLANK       0x80
+
+// Everything the picture depends on, saved and restored as one block
+typedef struct ppu_state {
+	uint8_t ctrl;
+	uint8_t mask;
+	uint8_t status;
+	uint8_t oam_addr;
+	uint8_t read_buffer; // $2007 reads are a byte behind
+	uint8_t latch;       // Last value written, read back from write only ports
+
+	/* Scrolling, as in the real chip */
+	uint16_t v; // Current VRAM address
+	uint16_t t; // Temporary address, the top left of the screen
+	uint8_t x;  // Fine X scroll
+	uint8_t w;  // First or second $2005/$2006 write
+
+	/* Raster position: the next scanline to process and its frame */
+	uint64_t frame;
+	int32_t line;
+	uint64_t sprite_0_time; // CPU cycle the hit becomes visible, EVENT_NEVER for none
+
+	uint8_t oam[256];
+	uint8_t palette[32];
+	uint8_t vram[PPU_VRAM_SIZE];
+} PpuState;
+
+typedef struct ppu {
+	PpuState state;
+	Mapper *mapper;
+	Cpu *cpu;
+	IoHandler registers; // $2000-$3FFF
+
+	uint8_t *tiles; // 64 bytes per 16 byte CHR tile
+	bool shared_tiles; // The cartridge's, never written
+	const uint8_t *tile_banks[CHR_BANK_COUNT]; // Decoded chr_banks
+	uint32_t chr_generation;
+
+	int vblank_event; // Scheduler id
+	uint8_t (*framebuffer)[PPU_WIDTH]; // PPU_HEIGHT lines, away from the state
+	uint8_t (*picture)[PPU_WIDTH]; // Last finished frame, what gets shown or captured
+	bool skip_rendering; // Leave the framebuffer alone, only keep flags right (run-ahead)
+	struct render_thread *render_thread; // NULL unless drawing is pipelined
+} Ppu;
+
+// Registers itself on the CPU bus and scheduler. shared_tiles is CHR ROM
+// already decoded (Cartridge.tiles), NULL decodes a private copy. Returns
+// false when the tiles or the framebuffer don't fit in memory
+bool init_ppu(Ppu *ppu, Mapper *mapper, uint8_t *shared_tiles, Cpu *cpu, SharedMemory *mem);
+void cleanup_ppu(Ppu *ppu);
+
+// Render and update flags up to the given CPU cycle
+void ppu_catch_up(Ppu *ppu, uint64_t time);
+
+// The register side effects at the given time, for PPUs without a CPU
+uint8_t ppu_read_register(Ppu *ppu, uint16_t addr, uint64_t time);
+void ppu_write_register(Ppu *ppu, uint16_t addr, uint8_t byte, uint64_t time);
+
+// $4014, copies a page of CPU memory into OAM and stalls the CPU
+void ppu_oam_dma(Ppu *ppu, uint8_t page);
+
+// After chr_ram was overwritten directly (savestates)
+void refresh_ppu_tiles(Ppu *ppu);
+
+#endif
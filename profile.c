@@ -0,0 +1,248 @@
+#include "profile.h"
+#include <string.h>
+
+static const char *const mode_names[13] = {
+	"implied", "accumulator", "immediate", "zero_page", "zero_page_x",
+	"zero_page_y", "relative", "absolute", "absolute_x", "absolute_y",
+	"indirect", "indirect_x", "indirect_y",
+};
+
+Profile *create_profile()
+{
+	Profile *profile = calloc(1, sizeof(Profile));
+	if (profile == NULL)
+	{
+		printf("Unable to allocate the profiler\n");
+		return NULL;
+	}
+
+	profile->node_count = 1;
+	profile->nodes[0].parent = -1;
+	return profile;
+}
+
+void destroy_profile(Profile *profile)
+{
+	free(profile);
+}
+
+static void sample_event(void *context, uint64_t time)
+{
+	Profile *profile = context;
+	Cpu *cpu = profile->sampled;
+	uint8_t opcode = peek_cpu_memory(cpu->memspace, cpu->PC);
+
+	profile->clock += profile->sample_period;
+	profile_count(profile, cpu->PC, opcode, profile->sample_period);
+
+	// xorshift32, uniform over 1 to 2 * period - 1
+	uint32_t seed = profile->sample_seed;
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	profile->sample_seed = seed;
+	schedule_event(&cpu->scheduler, profile->sample_event, time + 1 + seed % (2 * profile->sample_period - 1));
+}
+
+bool start_profile_sampling(Profile *profile, Cpu *cpu, int period)
+{
+	profile->sample_event = period > 0 ? add_event(&cpu->scheduler, &sample_event, profile) : -1;
+	if (profile->sample_event < 0)
+	{
+		printf("Unable to start sampling\n");
+		return false;
+	}
+
+	profile->sampled = cpu;
+	profile->sample_period = period;
+	profile->sample_seed = 1;
+	schedule_event(&cpu->scheduler, profile->sample_event, cpu_time(cpu) + period);
+	return true;
+}
+
+/* A PC runs a different opcode than before: what it counted since the
+   last change belongs to the old one */
+void profile_opcode_changed(Profile *profile, uint16_t pc, uint8_t opcode)
+{
+	ProfileCounter *moved = &profile->moved[profile->pc_opcodes[pc]];
+	moved->count += profile->pcs[pc].count - profile->moved_pcs[pc].count;
+	moved->cycles += profile->pcs[pc].cycles - profile->moved_pcs[pc].cycles;
+	profile->moved_pcs[pc] = profile->pcs[pc];
+	profile->pc_opcodes[pc] = opcode;
+}
+
+static int child_node(Profile *profile, int parent, uint16_t target)
+{
+	uint32_t slot = ((uint32_t) parent * 0x9E3779B1u ^ target) % PROFILE_HASH_SIZE;
+
+	for (;;)
+	{
+		int node = profile->hash[slot] - 1;
+		if (node < 0)
+			break;
+		if (profile->nodes[node].parent == parent && profile->nodes[node].target == target)
+			return node;
+		slot = (slot + 1) % PROFILE_HASH_SIZE;
+	}
+
+	if (profile->node_count == PROFILE_MAX_NODES)
+		return -1;
+
+	int node = profile->node_count++;
+	profile->nodes[node].parent = parent;
+	profile->nodes[node].target = target;
+	profile->hash[slot] = node + 1;
+	return node;
+}
+
+void profile_call(Profile *profile, uint16_t target)
+{
+	int node = profile->depth < PROFILE_MAX_DEPTH ? child_node(profile, profile->current, target) : -1;
+	if (node < 0)
+	{
+		profile->overflow ++;
+		return;
+	}
+
+	profile->stack[profile->depth].node = profile->current;
+	profile->stack[profile->depth].start = profile->clock;
+	profile->depth ++;
+	profile->current = node;
+}
+
+/* Programs that juggle the stack can return more than they called */
+void profile_return(Profile *profile)
+{
+	if (profile->overflow > 0)
+	{
+		profile->overflow --;
+		return;
+	}
+	if (profile->depth == 0)
+		return;
+
+	ProfileFrame *frame = &profile->stack[--profile->depth];
+	uint64_t cycles = profile->clock - frame->start;
+	profile->nodes[profile->current].cycles += cycles;
+	profile->nodes[frame->node].children += cycles;
+	profile->current = frame->node;
+}
+
+static void close_open_calls(Profile *profile)
+{
+	profile->overflow = 0;
+	while (profile->depth > 0)
+		profile_return(profile);
+	profile->nodes[0].cycles = profile->clock;
+}
+
+/* Indices of the `rows` counters with the most cycles, largest first */
+static int top_entries(ProfileCounter *counters, int count, int *out, int rows)
+{
+	int found = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (counters[i].cycles == 0)
+			continue;
+
+		int position = found < rows ? found++ : rows;
+		while (position > 0 && counters[out[position - 1]].cycles < counters[i].cycles)
+		{
+			if (position < rows)
+				out[position] = out[position - 1];
+			position --;
+		}
+		if (position < rows)
+			out[position] = i;
+	}
+	return found;
+}
+
+void print_profile(Profile *profile, FILE *stream)
+{
+	close_open_calls(profile);
+
+	uint64_t total_cycles = 0, total_count = 0;
+	uint64_t mode_count[13] = {0}, mode_cycles[13] = {0};
+
+	ProfileCounter opcodes[256];
+	memcpy(opcodes, profile->moved, sizeof(opcodes));
+	for (int pc = 0; pc < 0x10000; pc++)
+	{
+		ProfileCounter *counter = &opcodes[profile->pc_opcodes[pc]];
+		counter->count += profile->pcs[pc].count - profile->moved_pcs[pc].count;
+		counter->cycles += profile->pcs[pc].cycles - profile->moved_pcs[pc].cycles;
+	}
+
+	for (int i = 0; i < 256; i++)
+	{
+		total_cycles += opcodes[i].cycles;
+		total_count += opcodes[i].count;
+		mode_count[addressing_modes[i]] += opcodes[i].count;
+		mode_cycles[addressing_modes[i]] += opcodes[i].cycles;
+	}
+	if (total_cycles == 0)
+		total_cycles = 1;
+
+	int rows[PROFILE_REPORT_ROWS];
+	int found = top_entries(opcodes, 256, rows, PROFILE_REPORT_ROWS);
+
+	fprintf(stream, "%llu %s, %s%llu cycles", (unsigned long long) total_count,
+		profile->sample_period ? "samples" : "instructions", profile->sample_period ? "about " : "",
+		(unsigned long long) total_cycles);
+	if (profile->clock > total_cycles)
+		fprintf(stream, ", %llu more entering interrupts", (unsigned long long) (profile->clock - total_cycles));
+	fprintf(stream, "\n\n");
+	fprintf(stream, "opcode                     count       cycles      %%\n");
+	for (int i = 0; i < found; i++)
+	{
+		int op = rows[i];
+		fprintf(stream, "%02X %-3s %-12s %12llu %12llu %6.2f\n", op, opcode_names[op],
+			mode_names[addressing_modes[op]], (unsigned long long) opcodes[op].count,
+			(unsigned long long) opcodes[op].cycles,
+			100.0 * opcodes[op].cycles / total_cycles);
+	}
+
+	fprintf(stream, "\naddressing mode            count       cycles      %%\n");
+	for (int i = 0; i < 13; i++)
+	{
+		if (mode_count[i] == 0)
+			continue;
+		fprintf(stream, "%-19s %12llu %12llu %6.2f\n", mode_names[i],
+			(unsigned long long) mode_count[i], (unsigned long long) mode_cycles[i],
+			100.0 * mode_cycles[i] / total_cycles);
+	}
+
+	found = top_entries(profile->pcs, 0x10000, rows, PROFILE_REPORT_ROWS);
+	fprintf(stream, "\nPC                         count       cycles      %%\n");
+	for (int i = 0; i < found; i++)
+	{
+		int pc = rows[i];
+		fprintf(stream, "%04X                %12llu %12llu %6.2f\n", pc,
+			(unsigned long long) profile->pcs[pc].count, (unsigned long long) profile->pcs[pc].cycles,
+			100.0 * profile->pcs[pc].cycles / total_cycles);
+	}
+}
+
+/* One line per call chain: root;$C5F5;$C72D <cycles> */
+void write_folded_stacks(Profile *profile, FILE *stream)
+{
+	int chain[PROFILE_MAX_DEPTH + 1];
+	close_open_calls(profile);
+
+	for (int node = 0; node < profile->node_count; node++)
+	{
+		uint64_t self = profile->nodes[node].cycles - profile->nodes[node].children;
+		if (self == 0)
+			continue;
+
+		int length = 0;
+		for (int n = node; n > 0 && length < PROFILE_MAX_DEPTH; n = profile->nodes[n].parent)
+			chain[length++] = n;
+
+		fputs("root", stream);
+		while (length > 0)
+			fprintf(stream, ";$%04X", profile->nodes[chain[--length]].target);
+		fprintf(stream, " %llu\n", (unsigned long long) self);
+	}
+}
@@ -0,0 +1,161 @@
+/*
+
+6502 execution profiler
+
+- Only compiled in with -DCPU_PROFILE (make profile), the normal build
+  has no hooks at all
+- While a Cpu has a profile attached, execute_cpu_instructions() uses
+  the interpreter and accounts every instruction to its PC, with the
+  opcode the dispatcher already fetched
+- JSR, BRK, NMIs and IRQs push and RTS/RTI pop a call tree, so cycles
+  can be written out as folded stacks for flamegraph.pl. Calls are
+  timed when they return, nothing per instruction
+- Opcode and addressing mode totals are summed from the PC counts at
+  report time. Each PC remembers the opcode it ran, when that changes
+  (bank switches, code in RAM) its counts so far move to the old opcode
+- Sampling is the cheap alternative, in every build: a scheduler event
+  records the PC and opcode about every sample_period cycles, the CPU
+  runs untouched (JIT included). Counts are samples, cycles estimates,
+  and there is no call tree
+
+*/
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PROFILE_MAX_NODES 65536
+#define PROFILE_HASH_SIZE (PROFILE_MAX_NODES * 2)
+#define PROFILE_MAX_DEPTH 256
+#define PROFILE_REPORT_ROWS 20
+#define PROFILE_DEFAULT_SAMPLE_PERIOD 1000 // Cycles between PC samples, on average
+
+typedef struct profile_node {
+	int parent;
+	uint16_t target;   // Address the call went to
+	uint64_t cycles;   // Inclusive, summed over returned calls
+	uint64_t children; // Part of cycles spent in callees
+} ProfileNode;
+
+typedef struct profile_frame {
+	int node;
+	uint64_t start; // Profile clock at the call
+} ProfileFrame;
+
+// Count and cycles side by side, so an update touches one cache line
+typedef struct profile_counter {
+	uint64_t count;
+	uint64_t cycles;
+} ProfileCounter;
+
+typedef struct profile {
+	ProfileCounter pcs[0x10000];
+	uint8_t pc_opcodes[0x10000]; // What each PC ran last
+
+	/* Counts from before a PC's opcode changed, see profile_opcode_changed() */
+	ProfileCounter moved[256];   // Per opcode
+	ProfileCounter moved_pcs[0x10000]; // PC counts already in moved
+
+	/* Instruction being timed */
+	uint64_t clock; // Cycles accounted so far
+	bool running;
+	uint16_t last_PC;
+	uint8_t last_opcode;
+	int last_cycle;
+	bool entering; // Timing an interrupt entry, not an instruction
+
+	/* Call tree, node 0 is the root */
+	ProfileNode nodes[PROFILE_MAX_NODES];
+	int node_count;
+	int hash[PROFILE_HASH_SIZE]; // (parent, target) -> node + 1
+	ProfileFrame stack[PROFILE_MAX_DEPTH];
+	int depth;
+	int overflow; // Calls past PROFILE_MAX_DEPTH, or past the node limit
+	int current;
+
+	/* Sampling, sample_period is 0 otherwise */
+	Cpu *sampled;
+	int sample_event;
+	int sample_period;
+	uint32_t sample_seed; // Jitters the period, so loops don't alias with it
+} Profile;
+
+Profile *create_profile();
+void destroy_profile(Profile *profile);
+
+// Instead of attaching to cpu->profile. Stays scheduled for the Cpu's life
+bool start_profile_sampling(Profile *profile, Cpu *cpu, int period);
+
+void profile_call(Profile *profile, uint16_t target);
+void profile_return(Profile *profile);
+void profile_opcode_changed(Profile *profile, uint16_t pc, uint8_t opcode);
+
+// Reporting closes every call still open, so do it once at the end
+void print_profile(Profile *profile, FILE *stream);
+void write_folded_stacks(Profile *profile, FILE *stream);
+
+static inline void profile_count(Profile *profile, uint16_t pc, uint8_t opcode, uint64_t cycles)
+{
+	if (profile->pc_opcodes[pc] != opcode)
+		profile_opcode_changed(profile, pc, opcode);
+	profile->pcs[pc].count ++;
+	profile->pcs[pc].cycles += cycles;
+}
+
+/* Account whatever was being timed up to cycle, PC is where the CPU
+   goes next */
+static inline void profile_retire(Profile *profile, int cycle, uint16_t PC)
+{
+	if (!profile->running)
+		return;
+
+	int cycles = cycle - profile->last_cycle;
+	profile->clock += cycles;
+	profile->running = false;
+	if (profile->entering)
+	{
+		profile->entering = false;
+		return;
+	}
+
+	profile_count(profile, profile->last_PC, profile->last_opcode, cycles);
+
+	switch (profile->last_opcode)
+	{
+		case 0x00: // BRK
+		case 0x20: // JSR
+			profile_call(profile, PC);
+			break;
+		case 0x40: // RTI
+		case 0x60: // RTS
+			profile_return(profile);
+			break;
+	}
+}
+
+/* Close out the previous instruction and start timing opcode, fetched
+   from PC at cycle */
+static inline void profile_instruction(Profile *profile, uint16_t PC, int cycle, uint8_t opcode)
+{
+	profile_retire(profile, cycle, PC);
+	profile->running = true;
+	profile->last_PC = PC;
+	profile->last_opcode = opcode;
+	profile->last_cycle = cycle;
+}
+
+/* NMI or IRQ about to be taken: the handler is a call, so its RTI has
+   something to pop. Its entry cycles go to the call, not to any PC */
+static inline void profile_interrupt(Profile *profile, Cpu *cpu, uint16_t target)
+{
+	profile_retire(profile, cpu->cycle_count, cpu->PC);
+	profile_call(profile, target);
+	profile->running = true;
+	profile->entering = true;
+	profile->last_cycle = cpu->cycle_count;
+}
+
+#endif
@@ -0,0 +1,264 @@
+#include "render_thread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RENDER_LOG_INITIAL_SIZE 4096
+
+static bool append(RenderFrame *frame, uint64_t time, int kind, uint16_t addr, uint32_t value)
+{
+	if (frame->overflowed)
+		return false;
+
+	if (frame->count == frame->capacity)
+	{
+		int capacity = frame->capacity ? frame->capacity * 2 : RENDER_LOG_INITIAL_SIZE;
+		RenderLogEntry *entries = realloc(frame->entries, capacity * sizeof(RenderLogEntry));
+		if (entries == NULL)
+		{
+			frame->overflowed = true;
+			return false;
+		}
+		frame->entries = entries;
+		frame->capacity = capacity;
+	}
+
+	RenderLogEntry *entry = &frame->entries[frame->count++];
+	entry->time = time;
+	entry->kind = kind;
+	entry->addr = addr;
+	entry->value = value;
+	return true;
+}
+
+/* Copies the CPU side into the frame the log goes into next */
+static void start_frame(RenderThread *render)
+{
+	RenderFrame *frame = &render->frames[render->filling];
+	Mapper *mapper = render->ppu->mapper;
+
+	frame->state = render->ppu->state;
+	for (int i = 0; i < CHR_BANK_COUNT; i++)
+	{
+		frame->chr_banks[i] = mapper->chr_banks[i] - mapper->chr;
+		render->chr_banks[i] = frame->chr_banks[i];
+	}
+	frame->mirroring = mapper->state.mirroring;
+	render->mirroring = frame->mirroring;
+	if (mapper->has_chr_ram)
+		memcpy(frame->chr_ram, mapper->chr_ram, CHR_RAM_SIZE);
+
+	frame->count = 0;
+	frame->overflowed = false;
+}
+
+static void replay_frame(RenderThread *render, RenderFrame *frame)
+{
+	Ppu *shadow = &render->shadow;
+	Mapper *mapper = &render->mapper;
+
+	shadow->state = frame->state;
+	for (int i = 0; i < CHR_BANK_COUNT; i++)
+		mapper->chr_banks[i] = mapper->chr + frame->chr_banks[i];
+	mapper->chr_generation ++;
+	mapper->state.mirroring = frame->mirroring;
+
+	// Replayed $2007 writes keep it in step, this only catches savestates
+	if (mapper->has_chr_ram && memcmp(mapper->chr_ram, frame->chr_ram, CHR_RAM_SIZE) != 0)
+	{
+		memcpy(mapper->chr_ram, frame->chr_ram, CHR_RAM_SIZE);
+		refresh_ppu_tiles(shadow);
+	}
+
+	for (int i = 0; i < frame->count; i++)
+	{
+		RenderLogEntry *entry = &frame->entries[i];
+		switch (entry->kind)
+		{
+			case render_log_read:
+				ppu_read_register(shadow, entry->addr, entry->time);
+				break;
+
+			case render_log_write:
+				ppu_write_register(shadow, entry->addr, entry->value, entry->time);
+				break;
+
+			case render_log_chr_bank:
+				ppu_catch_up(shadow, entry->time);
+				mapper->chr_banks[entry->addr] = mapper->chr + entry->value;
+				mapper->chr_generation ++;
+				break;
+
+			case render_log_mirror:
+				ppu_catch_up(shadow, entry->time);
+				mapper->state.mirroring = entry->value;
+				break;
+		}
+	}
+	ppu_catch_up(shadow, frame->end);
+}
+
+static void *render_thread(void *arg)
+{
+	RenderThread *render = arg;
+
+	pthread_mutex_lock(&render->lock);
+	while (true)
+	{
+		while (!render->queued && !render->stopping)
+			pthread_cond_wait(&render->queued_frame, &render->lock);
+		if (!render->queued)
+			break;
+
+		// The CPU side logs into the other frame and leaves this one alone
+		RenderFrame *frame = &render->frames[render->filling ^ 1];
+		pthread_mutex_unlock(&render->lock);
+		if (!frame->overflowed)
+			replay_frame(render, frame);
+		pthread_mutex_lock(&render->lock);
+
+		if (frame->overflowed)
+		{
+			render->dropped++;
+		}
+		else
+		{
+			render->rendered++;
+			render->drawn = true;
+		}
+		render->queued = false;
+		pthread_cond_signal(&render->rendered_frame);
+	}
+	pthread_mutex_unlock(&render->lock);
+
+	return NULL;
+}
+
+bool start_render_thread(RenderThread *render, Ppu *ppu)
+{
+	memset(render, 0, sizeof(RenderThread));
+	render->ppu = ppu;
+
+	// Same banks and CHR, but CHR-RAM lives in the copy
+	Mapper *mapper = &render->mapper;
+	memcpy(mapper, ppu->mapper, sizeof(Mapper));
+	if (mapper->has_chr_ram)
+	{
+		memcpy(render->chr_ram, ppu->mapper->chr_ram, CHR_RAM_SIZE);
+		mapper->chr_ram = render->chr_ram;
+		mapper->chr = render->chr_ram;
+	}
+	for (int i = 0; i < CHR_BANK_COUNT; i++)
+		mapper->chr_banks[i] = mapper->chr + (ppu->mapper->chr_banks[i] - ppu->mapper->chr);
+
+	// Not on the bus or the scheduler, and NMIs have nowhere to go. CHR
+	// ROM tiles never change, so they're shared with the CPU side
+	Ppu *shadow = &render->shadow;
+	shadow->mapper = mapper;
+	shadow->shared_tiles = !mapper->has_chr_ram;
+	shadow->tiles = shadow->shared_tiles ? ppu->tiles : malloc((size_t) mapper->chr_size * 4);
+	shadow->framebuffer = calloc(PPU_HEIGHT, PPU_WIDTH);
+	if (shadow->tiles == NULL || shadow->framebuffer == NULL)
+	{
+		printf("Unable to allocate the render thread's tile cache\n");
+		cleanup_ppu(shadow);
+		return false;
+	}
+	refresh_ppu_tiles(shadow);
+
+	pthread_mutex_init(&render->lock, NULL);
+	pthread_cond_init(&render->queued_frame, NULL);
+	pthread_cond_init(&render->rendered_frame, NULL);
+	if (pthread_create(&render->thread, NULL, &render_thread, render) != 0)
+	{
+		printf("Couldn't start the render thread\n");
+		pthread_mutex_destroy(&render->lock);
+		pthread_cond_destroy(&render->queued_frame);
+		pthread_cond_destroy(&render->rendered_frame);
+		cleanup_ppu(shadow);
+		return false;
+	}
+
+	start_frame(render);
+	ppu->render_thread = render;
+	ppu->skip_rendering = true;
+	return true;
+}
+
+void stop_render_thread(RenderThread *render)
+{
+	pthread_mutex_lock(&render->lock);
+	render->stopping = true;
+	pthread_cond_signal(&render->queued_frame);
+	pthread_mutex_unlock(&render->lock);
+	pthread_join(render->thread, NULL);
+
+	pthread_mutex_destroy(&render->lock);
+	pthread_cond_destroy(&render->queued_frame);
+	pthread_cond_destroy(&render->rendered_frame);
+
+	render->ppu->render_thread = NULL;
+	render->ppu->skip_rendering = false;
+	cleanup_ppu(&render->shadow);
+	free(render->frames[0].entries);
+	free(render->frames[1].entries);
+	render->frames[0].entries = NULL;
+	render->frames[1].entries = NULL;
+}
+
+void restart_render_log(RenderThread *render)
+{
+	start_frame(render);
+	render->caught_up = 0;
+}
+
+/* Bank switches only matter to lines drawn after them, so they go in
+   at the last catch up before this one, in front of whatever the access
+   that caused this one logs */
+void log_ppu_catch_up(RenderThread *render, uint64_t time)
+{
+	RenderFrame *frame = &render->frames[render->filling];
+	Mapper *mapper = render->ppu->mapper;
+
+	for (int i = 0; i < CHR_BANK_COUNT; i++)
+	{
+		uint32_t offset = mapper->chr_banks[i] - mapper->chr;
+		if (offset != render->chr_banks[i])
+		{
+			append(frame, render->caught_up, render_log_chr_bank, i, offset);
+			render->chr_banks[i] = offset;
+		}
+	}
+	if (mapper->state.mirroring != render->mirroring)
+	{
+		append(frame, render->caught_up, render_log_mirror, 0, mapper->state.mirroring);
+		render->mirroring = mapper->state.mirroring;
+	}
+	render->caught_up = time;
+}
+
+void log_ppu_access(RenderThread *render, uint64_t time, int kind, uint16_t addr, uint8_t value)
+{
+	append(&render->frames[render->filling], time, kind, addr, value);
+}
+
+void render_thread_vblank(RenderThread *render, uint64_t time)
+{
+	render->frames[render->filling].end = time;
+
+	pthread_mutex_lock(&render->lock);
+	while (render->queued)
+		pthread_cond_wait(&render->rendered_frame, &render->lock);
+
+	// The render thread is idle until the next frame is queued
+	if (render->drawn)
+		memcpy(render->ppu->picture, render->shadow.framebuffer, PPU_HEIGHT * PPU_WIDTH);
+	render->drawn = false;
+
+	render->queued = true;
+	render->filling ^= 1;
+	pthread_cond_signal(&render->queued_frame);
+	pthread_mutex_unlock(&render->lock);
+
+	start_frame(render);
+}
@@ -0,0 +1,102 @@
+/*
+
+Pipelined rendering
+
+- The CPU side PPU only keeps the flags the game can read
+  (Ppu.skip_rendering). Lines sprite 0 could hit on are still drawn
+  there, right when the CPU gets to them, so $2002 never waits on the
+  render thread
+- Every PPU access that changes what gets drawn goes into a log with its
+  CPU cycle: register writes, $2002 and $2007 reads, OAM DMA (as 256
+  OAMDATA writes, which leave OAMADDR where it was, like the DMA does)
+  and CHR bank or mirroring changes seen when the PPU catches up
+- At vblank the log is handed to a second thread, which replays it on a
+  shadow PPU with its own CHR-RAM and tile cache, while the CPU runs
+  the next frame. The picture comes out a frame behind: after frame n
+  ran, Ppu.picture holds frame n - 1
+- Each log starts from a copy of the CPU side at the vblank before, so
+  the shadow can't drift. load_state() starts the log over from the
+  loaded state
+
+Not with run-ahead, which turns skip_rendering off after each frame.
+
+*/
+#ifndef RENDER_THREAD_H_
+#define RENDER_THREAD_H_
+
+#include "mapper.h"
+#include "ppu.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+enum render_log_kind {
+	render_log_read     = 0, // addr is the register
+	render_log_write    = 1, // addr is the register, value the byte
+	render_log_chr_bank = 2, // addr is the 1 KB window, value its offset into CHR
+	render_log_mirror   = 3, // value is the mirroring mode
+};
+
+typedef struct render_log_entry {
+	uint64_t time;
+	uint32_t value;
+	uint16_t addr;
+	uint8_t kind;
+} RenderLogEntry;
+
+// One frame worth of log, and the state it starts from
+typedef struct render_frame {
+	PpuState state;
+	uint32_t chr_banks[CHR_BANK_COUNT]; // Offsets into chr
+	int mirroring;
+	uint8_t chr_ram[CHR_RAM_SIZE];
+
+	RenderLogEntry *entries;
+	int count;
+	int capacity;
+	bool overflowed; // Couldn't grow the log, the frame isn't drawn
+	uint64_t end;    // Vblank of the frame the log draws
+} RenderFrame;
+
+typedef struct render_thread {
+	Ppu *ppu;      // CPU side
+	Ppu shadow;    // Only touched by the render thread once it runs
+	Mapper mapper; // The shadow's CHR banks and mirroring
+	uint8_t chr_ram[CHR_RAM_SIZE];
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t queued_frame;   // Render thread waits on this
+	pthread_cond_t rendered_frame; // CPU side waits on this at vblank
+
+	RenderFrame frames[2];
+	int filling;       // Frame the CPU side is logging into
+	bool queued;       // The other one is waiting or being drawn
+	bool drawn;        // The shadow framebuffer has a frame nobody took yet
+	bool stopping;
+
+	/* What the log has last been told about the banks */
+	uint32_t chr_banks[CHR_BANK_COUNT];
+	int mirroring;
+	uint64_t caught_up; // Last time the CPU side caught up
+
+	/* Counters */
+	uint64_t rendered;
+	uint64_t dropped;
+} RenderThread;
+
+// Moves the ppu's drawing onto a new thread
+bool start_render_thread(RenderThread *render, Ppu *ppu);
+
+// Finishes the frame being drawn and goes back to drawing synchronously
+void stop_render_thread(RenderThread *render);
+
+// After the CPU side's state was overwritten (savestates)
+void restart_render_log(RenderThread *render);
+
+/* Called by the CPU side PPU */
+void log_ppu_catch_up(RenderThread *render, uint64_t time);
+void log_ppu_access(RenderThread *render, uint64_t time, int kind, uint16_t addr, uint8_t value);
+void render_thread_vblank(RenderThread *render, uint64_t time);
+
+#endif
@@ -0,0 +1,354 @@
+#include "rewind.h"
+#include "render_thread.h"
+#include <string.h>
+
+/* Track host memory as pages, indexed in the order they're added */
+static void add_pages(Rewind *rewind, uint8_t *host, size_t size)
+{
+	for (size_t offset = 0; offset < size; offset += CPU_PAGE_SIZE)
+	{
+		rewind->pages[rewind->page_count] = host + offset;
+		rewind->page_sizes[rewind->page_count] = size - offset < CPU_PAGE_SIZE ? size - offset : CPU_PAGE_SIZE;
+		rewind->page_count ++;
+	}
+}
+
+/* Which state page a written CPU page landed in, -1 for none */
+static int state_page_index(SharedMemory *mem, int cpu_page)
+{
+	uint8_t *host = mem->write_pages[cpu_page];
+	if (host >= mem->ram && host < mem->ram + INTERNAL_RAM_SIZE)
+		return (host - mem->ram) / CPU_PAGE_SIZE;
+	if (mem->prg_ram != NULL && host >= mem->prg_ram && host < mem->prg_ram + PRG_RAM_SIZE)
+		return (INTERNAL_RAM_SIZE + (host - mem->prg_ram)) / CPU_PAGE_SIZE;
+	return -1;
+}
+
+static void sync_shadow(Rewind *rewind)
+{
+	SharedMemory *mem = &rewind->nes->mem;
+	for (int index = 0; index < rewind->page_count; index++)
+		memcpy(rewind->shadow + index * CPU_PAGE_SIZE, rewind->pages[index], rewind->page_sizes[index]);
+	memset(mem->dirty_pages, 0, sizeof(mem->dirty_pages));
+}
+
+/* Room for size bytes. Slots are reused around the ring, so one that
+   held something much bigger gives the rest back */
+static bool reserve(RewindFrame *frame, size_t size)
+{
+	if (frame->capacity >= size && frame->capacity <= 2 * size)
+		return true;
+	if (size == 0)
+	{
+		free(frame->data);
+		frame->data = NULL;
+		frame->capacity = 0;
+		return true;
+	}
+
+	uint8_t *data = realloc(frame->data, size);
+	if (data == NULL)
+		return false;
+	frame->data = data;
+	frame->capacity = size;
+	return true;
+}
+
+/* Page index, length, then runs of (skip, count, bytes) against the shadow */
+static size_t encode_page(uint8_t *out, int index, const uint8_t *page, uint8_t *shadow, int size)
+{
+	size_t length = 3;
+	int position = 0;
+
+	while (position < size)
+	{
+		int start = position;
+		while (start < size && page[start] == shadow[start])
+			start++;
+		if (start == size)
+			break;
+
+		int end = start;
+		while (end < size && end - start < 255 && page[end] != shadow[end])
+			end++;
+
+		out[length++] = start - position;
+		out[length++] = end - start;
+		memcpy(out + length, page + start, end - start);
+		memcpy(shadow + start, page + start, end - start);
+		length += end - start;
+		position = end;
+	}
+
+	if (length == 3)
+		return 0; // Written with the same values
+	out[0] = index;
+	out[1] = (length - 3) & 0xFF;
+	out[2] = (length - 3) >> 8;
+	return length;
+}
+
+static void decode_pages(Rewind *rewind, const uint8_t *data, size_t size)
+{
+	size_t offset = 0;
+	while (offset < size)
+	{
+		uint8_t *page = rewind->pages[data[offset]];
+		size_t end = offset + 3 + (data[offset + 1] | (data[offset + 2] << 8));
+		int position = 0;
+
+		for (offset += 3; offset < end; )
+		{
+			position += data[offset];
+			int count = data[offset + 1];
+			memcpy(page + position, data + offset + 2, count);
+			position += count;
+			offset += 2 + count;
+		}
+	}
+}
+
+/* Runs of (zeros, count, bytes), most of a savestate is zeros */
+static size_t pack_zeros(uint8_t *out, const uint8_t *in, size_t size)
+{
+	size_t length = 0, position = 0;
+	while (position < size)
+	{
+		int zeros = 0;
+		while (position < size && zeros < 255 && in[position] == 0)
+		{
+			position++;
+			zeros++;
+		}
+
+		int count = 0;
+		while (position + count < size && count < 255 && in[position + count] != 0)
+			count++;
+
+		out[length++] = zeros;
+		out[length++] = count;
+		memcpy(out + length, in + position, count);
+		length += count;
+		position += count;
+	}
+	return length;
+}
+
+static size_t unpack_zeros(uint8_t *out, const uint8_t *in, size_t size)
+{
+	size_t position = 0;
+	for (size_t offset = 0; offset < size; )
+	{
+		memset(out + position, 0, in[offset]);
+		position += in[offset];
+		int count = in[offset + 1];
+		memcpy(out + position, in + offset + 2, count);
+		position += count;
+		offset += 2 + count;
+	}
+	return position;
+}
+
+static bool capture_keyframe(Rewind *rewind, RewindFrame *frame)
+{
+	if (save_state(rewind->nes, rewind->state, rewind->state_size) != rewind->state_size)
+		return false;
+
+	size_t size = pack_zeros(rewind->packed_state, rewind->state, rewind->state_size);
+	if (!reserve(frame, size))
+		return false;
+	memcpy(frame->data, rewind->packed_state, size);
+
+	frame->keyframe = true;
+	frame->size = size;
+	sync_shadow(rewind);
+	return true;
+}
+
+static void capture_delta(Rewind *rewind, RewindFrame *frame)
+{
+	SharedMemory *mem = &rewind->nes->mem;
+	bool changed[REWIND_STATE_PAGES] = { false };
+
+	for (int cpu_page = 0; cpu_page < CPU_PAGE_COUNT; cpu_page++)
+	{
+		if (mem->dirty_pages[cpu_page >> 3] & (1 << (cpu_page & 7)))
+		{
+			int index = state_page_index(mem, cpu_page);
+			if (index >= 0)
+				changed[index] = true;
+		}
+	}
+	memset(mem->dirty_pages, 0, sizeof(mem->dirty_pages));
+
+	for (int index = rewind->compared_pages; index < rewind->page_count; index++)
+		if (memcmp(rewind->pages[index], rewind->shadow + index * CPU_PAGE_SIZE, rewind->page_sizes[index]) != 0)
+			changed[index] = true;
+
+	// Encoded in scratch first, so the frame only keeps what it needs
+	size_t size = 0;
+	for (int index = 0; index < rewind->page_count; index++)
+	{
+		if (changed[index])
+		{
+			size += encode_page(rewind->scratch + size, index, rewind->pages[index],
+				rewind->shadow + index * CPU_PAGE_SIZE, rewind->page_sizes[index]);
+		}
+	}
+
+	frame->keyframe = false;
+	frame->size = 0;
+	if (!reserve(frame, size))
+		return;
+	memcpy(frame->data, rewind->scratch, size);
+	frame->size = size;
+}
+
+bool init_rewind(Rewind *rewind, Nes *nes, int frames, int keyframe_interval)
+{
+	memset(rewind, 0, sizeof(Rewind));
+	rewind->state_size = savestate_size(nes);
+	rewind->state = malloc(rewind->state_size);
+	rewind->packed_state = malloc(rewind->state_size + rewind->state_size / 2 + 2); // "x 0 x 0 ..." packs to 3 bytes per 2
+	rewind->frames = calloc(frames, sizeof(RewindFrame));
+	if (rewind->state == NULL || rewind->packed_state == NULL || rewind->frames == NULL ||
+	    frames < 1 || keyframe_interval < 1)
+	{
+		free(rewind->state);
+		free(rewind->packed_state);
+		free(rewind->frames);
+		printf("Unable to allocate the rewind buffer\n");
+		return false;
+	}
+
+	// Pages are tracked by address, PRG-RAM can't show up later
+	if (!back_prg_ram(&nes->mem))
+	{
+		cleanup_rewind(rewind);
+		return false;
+	}
+
+	rewind->nes = nes;
+	add_pages(rewind, nes->mem.ram, INTERNAL_RAM_SIZE);
+	if (nes->mem.prg_ram != NULL)
+		add_pages(rewind, nes->mem.prg_ram, PRG_RAM_SIZE);
+	rewind->compared_pages = rewind->page_count;
+	add_pages(rewind, (uint8_t *) &nes->ppu.state, sizeof(PpuState));
+	add_pages(rewind, (uint8_t *) &nes->apu.state, sizeof(ApuState));
+	if (nes->mapper.has_chr_ram)
+		add_pages(rewind, nes->mapper.chr_ram, CHR_RAM_SIZE);
+
+	rewind->capacity = frames;
+	rewind->keyframe_interval = keyframe_interval;
+	reset_rewind(rewind);
+	return true;
+}
+
+void cleanup_rewind(Rewind *rewind)
+{
+	for (int i = 0; i < rewind->capacity; i++)
+		free(rewind->frames[i].data);
+	free(rewind->frames);
+	free(rewind->state);
+	free(rewind->packed_state);
+	memset(rewind, 0, sizeof(Rewind));
+}
+
+void reset_rewind(Rewind *rewind)
+{
+	rewind->newest = rewind->capacity - 1;
+	rewind->count = 0;
+	rewind->since_keyframe = 0;
+}
+
+void rewind_capture(Rewind *rewind)
+{
+	rewind->newest = (rewind->newest + 1) % rewind->capacity;
+	if (rewind->count < rewind->capacity)
+		rewind->count ++;
+
+	// A keyframe that fails to allocate falls back to a delta, and the
+	// next frame tries again
+	RewindFrame *frame = &rewind->frames[rewind->newest];
+	if (rewind->since_keyframe == 0 && capture_keyframe(rewind, frame))
+	{
+		rewind->since_keyframe = 1 % rewind->keyframe_interval;
+	}
+	else
+	{
+		capture_delta(rewind, frame);
+		if (rewind->since_keyframe > 0)
+			rewind->since_keyframe = (rewind->since_keyframe + 1) % rewind->keyframe_interval;
+	}
+
+	capture_cpu_state(&rewind->nes->cpu, &frame->cpu);
+	frame->mapper = rewind->nes->mapper.state;
+	frame->input = rewind->nes->input;
+}
+
+static RewindFrame *frame_at(Rewind *rewind, int back)
+{
+	int index = (rewind->newest - back) % rewind->capacity;
+	return &rewind->frames[index < 0 ? index + rewind->capacity : index];
+}
+
+/* How far back the oldest keyframe still in the ring is */
+static int oldest_keyframe(Rewind *rewind)
+{
+	for (int back = rewind->count - 1; back >= 0; back--)
+		if (frame_at(rewind, back)->keyframe)
+			return back;
+	return -1;
+}
+
+int rewind_frames_available(Rewind *rewind)
+{
+	return oldest_keyframe(rewind) + 1;
+}
+
+bool rewind_step_back(Rewind *rewind, int frames)
+{
+	if (frames < 0 || frames > oldest_keyframe(rewind))
+		return false;
+
+	int keyframe = frames;
+	while (!frame_at(rewind, keyframe)->keyframe)
+		keyframe ++;
+
+	Nes *nes = rewind->nes;
+	RewindFrame *base = frame_at(rewind, keyframe);
+	size_t size = unpack_zeros(rewind->state, base->data, base->size);
+	if (!load_state(nes, rewind->state, size))
+		return false;
+
+	for (int back = keyframe - 1; back >= frames; back--)
+	{
+		RewindFrame *frame = frame_at(rewind, back);
+		decode_pages(rewind, frame->data, frame->size);
+	}
+	if (nes->mapper.has_chr_ram)
+		refresh_ppu_tiles(&nes->ppu);
+
+	RewindFrame *target = frame_at(rewind, frames);
+	restore_cpu_state(&nes->cpu, &target->cpu);
+	refresh_apu(&nes->apu);
+	restore_mapper_state(&nes->mapper, &target->mapper);
+	nes->input = target->input;
+	if (nes->ppu.render_thread != NULL)
+		restart_render_log(nes->ppu.render_thread);
+
+	// The target becomes the newest capture
+	rewind->newest = (rewind->newest - frames + rewind->capacity) % rewind->capacity;
+	rewind->count -= frames;
+	rewind->since_keyframe = (keyframe - frames + 1) % rewind->keyframe_interval;
+	sync_shadow(rewind);
+	return true;
+}
+
+size_t rewind_memory_usage(Rewind *rewind)
+{
+	size_t usage = rewind->capacity * sizeof(RewindFrame) + rewind->state_size * 5 / 2;
+	for (int i = 0; i < rewind->capacity; i++)
+		usage += rewind->frames[i].capacity;
+	return usage;
+}
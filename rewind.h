@@ -0,0 +1,83 @@
+/*
+
+Rewind
+
+- One snapshot per frame in a ring covering the last few seconds
+- Every keyframe_interval frames the snapshot is a full savestate with
+  its runs of zeros packed, in between it only holds the bytes that
+  changed since the previous one
+- RAM and PRG-RAM pages are only looked at when SharedMemory's dirty
+  bitmap says they were written, the PPU and APU state and CHR-RAM are
+  small enough to compare every frame
+- Stepping back loads the nearest older keyframe and replays the deltas
+  up to the wanted frame
+
+Memory changed behind write_cpu_memory's back (load_state, a debugger
+poking RAM) isn't seen by the dirty bitmap, call reset_rewind() after.
+
+*/
+#ifndef REWIND_H_
+#define REWIND_H_
+
+#include "nes.h"
+#include "savestate.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define REWIND_DEFAULT_KEYFRAME_INTERVAL 60
+
+#define REWIND_PAGES(size) (((size) + CPU_PAGE_SIZE - 1) / CPU_PAGE_SIZE)
+#define REWIND_STATE_PAGES (REWIND_PAGES(INTERNAL_RAM_SIZE) + REWIND_PAGES(PRG_RAM_SIZE) + \
+	REWIND_PAGES(sizeof(PpuState)) + REWIND_PAGES(sizeof(ApuState)) + REWIND_PAGES(CHR_RAM_SIZE))
+
+// A page where every other byte changed: 128 runs of skip, count, byte
+#define REWIND_MAX_ENCODED_PAGE (3 + 128 * 3)
+
+typedef struct rewind_frame {
+	bool keyframe;
+	uint8_t *data; // Savestate with its zeros packed for keyframes, changed bytes otherwise
+	size_t size;
+	size_t capacity;
+
+	CpuState cpu;
+	MapperState mapper;
+	InputState input; // Controller shift registers and strobe
+} RewindFrame;
+
+typedef struct rewind {
+	Nes *nes;
+	RewindFrame *frames;
+	int capacity;
+	int keyframe_interval;
+
+	int newest; // Ring index of the last capture
+	int count;  // Frames held, newest included
+	int since_keyframe;
+
+	/* Tracked state in 256 byte pages: RAM, PRG-RAM, PPU, APU, CHR-RAM */
+	uint8_t *pages[REWIND_STATE_PAGES];
+	int page_sizes[REWIND_STATE_PAGES]; // The PPU's and APU's last pages are short
+	int page_count;
+	int compared_pages; // First page found by comparing, not the dirty bitmap
+
+	uint8_t shadow[REWIND_STATE_PAGES * CPU_PAGE_SIZE]; // Pages as of the newest frame
+	uint8_t scratch[REWIND_STATE_PAGES * REWIND_MAX_ENCODED_PAGE]; // Delta being encoded
+	uint8_t *state; // A keyframe's savestate, unpacked
+	uint8_t *packed_state;
+	size_t state_size;
+} Rewind;
+
+bool init_rewind(Rewind *rewind, Nes *nes, int frames, int keyframe_interval);
+void cleanup_rewind(Rewind *rewind);
+void reset_rewind(Rewind *rewind); // Forget history, the next capture is a keyframe
+
+void rewind_capture(Rewind *rewind); // Call once per frame
+
+// Go back `frames` captures (0 is the newest) and drop everything after it
+bool rewind_step_back(Rewind *rewind, int frames);
+
+int rewind_frames_available(Rewind *rewind);
+size_t rewind_memory_usage(Rewind *rewind);
+
+#endif
@@ -1,6 +1,12 @@
 #include "rom.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// TODO: free rom raw eventually
+#define HEADER_SIZE  16
+#define TRAINER_SIZE 512
 
 static void rom_test(Rom *rom)
 {
@@ -30,62 +36,152 @@ static void rom_test(Rom *rom)
 	printf("\n");
 }
 
-static Rom read_file_contents(char* filename)
+/* Map the whole file read only, pages are shared through the page cache */
+static bool map_file_contents(Rom *rom, char *filename)
 {
-	Rom rom;
-	FILE* fp = fopen(filename, "rb");
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		printf("Couldn't open %s\n", filename);
+		return false;
+	}
 
-	fseek(fp, 0L, SEEK_END);
-	int file_size = ftell(fp);
-	rewind(fp);
+	struct stat info;
+	if (fstat(fd, &info) < 0 || info.st_size < HEADER_SIZE)
+	{
+		printf("%s is too small to be a rom\n", filename);
+		close(fd);
+		return false;
+	}
 
-	rom.raw = malloc(file_size * sizeof(uint8_t));
-	rom.raw_size = file_size;
-	
-	fread(rom.raw, file_size, 1, fp);
+	void *raw = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // The mapping stays valid without the descriptor
+	if (raw == MAP_FAILED)
+	{
+		printf("Couldn't map %s\n", filename);
+		return false;
+	}
 
-	free(fp);
-	return rom;
+	rom->raw = raw;
+	rom->raw_size = info.st_size;
+	return true;
 }
 
-Rom parse_rom_flags(char* filename)
+/* NES 2.0 ROM sizes, an MSB nibble of 0xF selects exponent-multiplier form */
+static int rom_area_size(uint8_t lsb, uint8_t msb, int unit)
 {
-	Rom rom = read_file_contents(filename);
+	if (msb != 0x0F)
+		return ((msb << 8) | lsb) * unit;
 
-	rom.pgr_rom_size = rom.raw[4] * 16384;
-	rom.chr_rom_size = rom.raw[5] * 8192;
+	int exponent = lsb >> 2;
+	int multiplier = (lsb & 0x03) * 2 + 1;
+	if (exponent > 24) return -1; // Larger than any file we can map
+	return (1 << exponent) * multiplier;
+}
 
-	rom.mapper = (rom.raw[7] & 0xF0) | ((rom.raw[6] & 0xF0) >> 4);
-	rom.is_vertical_mirroring = (rom.raw[6] & 0x01) != 0;
+/* NES 2.0 RAM sizes are stored as shift counts, 0 means none */
+static int ram_area_size(uint8_t shift)
+{
+	return shift == 0 ? 0 : 64 << shift;
+}
 
-	rom.has_pgr_ram = (rom.raw[6] & 0x02) != 0;
-	rom.pgr_ram_size = (rom.raw[8]);
-	
-	rom.has_trainer = (rom.raw[6] & 0x03) != 0;
-	if (rom.has_trainer) rom.trainer = malloc(512 * sizeof(uint8_t));
+static bool parse_rom_flags(Rom *rom)
+{
+	uint8_t *header = rom->raw;
+	if (memcmp(header, "NES\x1A", 4) != 0)
+	{
+		printf("Missing iNES header\n");
+		return false;
+	}
+
+	rom->mapper = (header[7] & 0xF0) | ((header[6] & 0xF0) >> 4);
+	rom->is_vertical_mirroring = (header[6] & 0x01) != 0;
+	rom->has_pgr_ram = (header[6] & 0x02) != 0;
+	rom->has_trainer = (header[6] & 0x04) != 0;
+	rom->has_vram = (header[6] & 0x08) != 0;
+	rom->is_nes2 = ((header[7] & 0b00001100) >> 2) == 2;
 
-	rom.has_vram = (rom.raw[6] & 0x04) != 0;
+	if (rom->is_nes2)
+	{
+		rom->mapper |= (header[8] & 0x0F) << 8;
+		rom->submapper = header[8] >> 4;
+
+		rom->pgr_rom_size = rom_area_size(header[4], header[9] & 0x0F, 16384);
+		rom->chr_rom_size = rom_area_size(header[5], header[9] >> 4, 8192);
 
-	if (((rom.raw[7] & 0b00001100) >> 2) == 2)
-		printf("Nes 2.0 format not supported.\n");
-	
-	return rom;
+		rom->pgr_ram_size = ram_area_size(header[10] & 0x0F);
+		rom->pgr_nvram_size = ram_area_size(header[10] >> 4);
+		rom->chr_ram_size = ram_area_size(header[11] & 0x0F);
+		rom->chr_nvram_size = ram_area_size(header[11] >> 4);
+
+		rom->timing = header[12] & 0x03;
+	}
+	else
+	{
+		rom->pgr_rom_size = header[4] * 16384;
+		rom->chr_rom_size = header[5] * 8192;
+
+		// Byte 8 counts 8 KB units, with 0 meaning one for compatibility
+		int pgr_ram_size = (header[8] == 0 ? 1 : header[8]) * 8192;
+		if (rom->has_pgr_ram)
+			rom->pgr_nvram_size = pgr_ram_size;
+		else
+			rom->pgr_ram_size = pgr_ram_size;
+
+		rom->chr_ram_size = rom->chr_rom_size == 0 ? 8192 : 0;
+		rom->timing = (header[9] & 0x01) ? timing_pal : timing_ntsc;
+	}
+
+	if (rom->pgr_rom_size < 0 || rom->chr_rom_size < 0)
+	{
+		printf("ROM sizes in the header are out of range\n");
+		return false;
+	}
+
+	// Mappers switch PRG in 8 KB banks and CHR in 1 KB windows
+	if (rom->pgr_rom_size % 8192 != 0 || rom->chr_rom_size % 1024 != 0)
+	{
+		printf("ROM sizes in the header aren't whole banks: %d bytes PRG, %d bytes CHR\n",
+			rom->pgr_rom_size, rom->chr_rom_size);
+		return false;
+	}
+
+	return true;
 }
 
-Rom load_rom(char *filename)
+bool load_rom(Rom *rom, char *filename)
 {
-	Rom rom = parse_rom_flags(filename);
+	memset(rom, 0, sizeof(Rom));
+	if (!map_file_contents(rom, filename))
+		return false;
 
-	rom.pgr_rom = malloc(rom.pgr_rom_size * sizeof(uint8_t));
-	rom.chr_rom = malloc(rom.chr_rom_size * sizeof(uint8_t));
+	if (!parse_rom_flags(rom))
+	{
+		free_rom(rom);
+		return false;
+	}
 
-	int read_offset = (rom.has_trainer ? 512 : 0) + 16;
-	for (int i = 0; i < rom.pgr_rom_size; i++)
-		rom.pgr_rom[i] = rom.raw[read_offset + i];
+	int trainer_size = rom->has_trainer ? TRAINER_SIZE : 0;
+	int expected_size = HEADER_SIZE + trainer_size + rom->pgr_rom_size + rom->chr_rom_size;
+	if (rom->pgr_rom_size == 0 || rom->raw_size < expected_size)
+	{
+		printf("%s: header wants %d bytes but the file has %d\n",
+			filename, expected_size, rom->raw_size);
+		free_rom(rom);
+		return false;
+	}
 
-	read_offset += rom.pgr_rom_size;
-	for (int i = 0; i < rom.chr_rom_size; i++)
-		rom.chr_rom[i] = rom.raw[read_offset + i];
+	// Views into the mapping, nothing is copied
+	uint8_t *data = rom->raw + HEADER_SIZE;
+	rom->trainer = rom->has_trainer ? data : NULL;
+	rom->pgr_rom = data + trainer_size;
+	rom->chr_rom = rom->chr_rom_size > 0 ? rom->pgr_rom + rom->pgr_rom_size : NULL;
+	return true;
+}
 
-	return rom;
-}
\ No newline at end of file
+void free_rom(Rom *rom)
+{
+	if (rom->raw != NULL)
+		munmap(rom->raw, rom->raw_size);
+	memset(rom, 0, sizeof(Rom));
+}
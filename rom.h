@@ -1,5 +1,5 @@
-/* Parsing the INES file format */
-/* Ines 2.0 is not supported. */
+/* Parsing the INES and NES 2.0 file formats */
+/* The file is mapped read only, pgr_rom, chr_rom and trainer point into it. */
 #ifndef ROM_H_
 #define ROM_H_
 
@@ -8,6 +8,13 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+enum timing {
+	timing_ntsc  = 0,
+	timing_pal   = 1,
+	timing_multi = 2,
+	timing_dendy = 3,
+};
+
 typedef struct parser {
 	uint8_t* raw;
 	uint8_t* pgr_rom;
@@ -18,16 +25,23 @@ typedef struct parser {
 	int chr_rom_size;
 	int pgr_rom_size;
 	int pgr_ram_size;
+	int pgr_nvram_size; // Battery backed
+	int chr_ram_size;
+	int chr_nvram_size;
 
 	bool has_pgr_ram;
 	bool has_trainer;
 	bool has_vram; /* 4 screen vram */
 	bool is_vertical_mirroring;
+	bool is_nes2;
 
 	int mapper;
+	int submapper;
+	int timing;
 } Rom;
 
-Rom parse_rom_flags(char *filename);
-Rom load_rom(char *filename);
+// Returns false if the file can't be mapped or its sizes don't add up
+bool load_rom(Rom *rom, char *filename);
+void free_rom(Rom *rom);
 
 #endif
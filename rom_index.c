@@ -0,0 +1,303 @@
+#include "rom_index.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_table()
+{
+	for (int i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		crc_table[0][i] = crc;
+	}
+
+	for (int i = 0; i < 256; i++)
+		for (int slice = 1; slice < 8; slice++)
+			crc_table[slice][i] = (crc_table[slice - 1][i] >> 8) ^ crc_table[0][crc_table[slice - 1][i] & 0xFF];
+}
+
+/* zlib compatible CRC32, eight bytes per step */
+uint32_t rom_crc32(uint32_t crc, const uint8_t *data, size_t size)
+{
+	pthread_once(&crc_table_once, &init_crc_table);
+	crc = ~crc;
+
+	for (; size >= 8; size -= 8, data += 8)
+	{
+		uint32_t low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+		uint32_t high = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t)data[7] << 24;
+		crc = crc_table[7][low & 0xFF] ^ crc_table[6][(low >> 8) & 0xFF] ^
+		      crc_table[5][(low >> 16) & 0xFF] ^ crc_table[4][low >> 24] ^
+		      crc_table[3][high & 0xFF] ^ crc_table[2][(high >> 8) & 0xFF] ^
+		      crc_table[1][(high >> 16) & 0xFF] ^ crc_table[0][high >> 24];
+	}
+
+	while (size--)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xFF];
+
+	return ~crc;
+}
+
+typedef struct path_list {
+	char **paths;
+	int count;
+	int capacity;
+} PathList;
+
+static bool has_rom_extension(const char *name)
+{
+	size_t length = strlen(name);
+	return length > 4 && strcasecmp(name + length - 4, ".nes") == 0;
+}
+
+static void add_path(PathList *list, char *path)
+{
+	if (list->count == list->capacity)
+	{
+		list->capacity = list->capacity ? list->capacity * 2 : 256;
+		list->paths = realloc(list->paths, list->capacity * sizeof(char *));
+	}
+	list->paths[list->count++] = path;
+}
+
+static void collect_rom_paths(PathList *list, const char *directory)
+{
+	DIR *dir = opendir(directory);
+	if (dir == NULL)
+	{
+		printf("Couldn't open directory %s\n", directory);
+		return;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		size_t length = strlen(directory) + strlen(entry->d_name) + 2;
+		char *path = malloc(length);
+		snprintf(path, length, "%s/%s", directory, entry->d_name);
+
+		// lstat, so symlinked directories aren't followed
+		struct stat info;
+		if (lstat(path, &info) == 0 && S_ISDIR(info.st_mode))
+		{
+			collect_rom_paths(list, path);
+			free(path);
+		}
+		else if (has_rom_extension(entry->d_name))
+		{
+			add_path(list, path);
+		}
+		else
+		{
+			free(path);
+		}
+	}
+
+	closedir(dir);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+typedef struct scan_job {
+	PathList *list;
+	RomIndexEntry *entries;
+	bool *valid;
+	int next; // Next path to claim, shared by all workers
+} ScanJob;
+
+static void index_rom(Rom *rom, RomIndexEntry *entry)
+{
+	memset(entry, 0, sizeof(RomIndexEntry));
+	entry->pgr_crc = rom_crc32(0, rom->pgr_rom, rom->pgr_rom_size);
+	entry->chr_crc = rom_crc32(0, rom->chr_rom, rom->chr_rom_size);
+	entry->file_crc = rom_crc32(entry->pgr_crc, rom->chr_rom, rom->chr_rom_size);
+
+	entry->pgr_rom_size = rom->pgr_rom_size;
+	entry->chr_rom_size = rom->chr_rom_size;
+	entry->pgr_ram_size = rom->pgr_ram_size;
+	entry->pgr_nvram_size = rom->pgr_nvram_size;
+	entry->chr_ram_size = rom->chr_ram_size;
+	entry->chr_nvram_size = rom->chr_nvram_size;
+
+	entry->mapper = rom->mapper;
+	entry->submapper = rom->submapper;
+	entry->timing = rom->timing;
+	entry->flags = (rom->is_nes2 ? ROM_INDEX_NES2 : 0) |
+	               (rom->is_vertical_mirroring ? ROM_INDEX_VERTICAL : 0) |
+	               (rom->has_pgr_ram ? ROM_INDEX_BATTERY : 0) |
+	               (rom->has_trainer ? ROM_INDEX_TRAINER : 0) |
+	               (rom->has_vram ? ROM_INDEX_VRAM : 0);
+}
+
+static void *scan_worker(void *arg)
+{
+	ScanJob *job = arg;
+
+	for (;;)
+	{
+		int i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->list->count)
+			break;
+
+		Rom rom;
+		if (!load_rom(&rom, job->list->paths[i]))
+			continue;
+
+		index_rom(&rom, &job->entries[i]);
+		job->valid[i] = true;
+		free_rom(&rom);
+	}
+
+	return NULL;
+}
+
+bool build_rom_index(RomIndex *index, char *directory, int threads)
+{
+	memset(index, 0, sizeof(RomIndex));
+
+	PathList list = {0};
+	collect_rom_paths(&list, directory);
+	qsort(list.paths, list.count, sizeof(char *), &compare_paths);
+
+	ScanJob job = {0};
+	job.list = &list;
+	job.entries = malloc((list.count + 1) * sizeof(RomIndexEntry));
+	job.valid = calloc(list.count + 1, sizeof(bool));
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > list.count)
+		threads = list.count > 0 ? list.count : 1;
+
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	for (int i = 0; i < threads; i++)
+		pthread_create(&workers[i], NULL, &scan_worker, &job);
+	for (int i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	// Keep the good entries in path order and pack their paths
+	size_t paths_size = 0;
+	for (int i = 0; i < list.count; i++)
+		if (job.valid[i]) paths_size += strlen(list.paths[i]) + 1;
+
+	index->entries = job.entries;
+	index->paths = malloc(paths_size + 1);
+	for (int i = 0; i < list.count; i++)
+	{
+		if (job.valid[i])
+		{
+			RomIndexEntry *entry = &index->entries[index->count++];
+			*entry = job.entries[i];
+			entry->path_offset = index->paths_size;
+
+			strcpy(index->paths + index->paths_size, list.paths[i]);
+			index->paths_size += strlen(list.paths[i]) + 1;
+		}
+		free(list.paths[i]);
+	}
+
+	free(list.paths);
+	free(job.valid);
+	return true;
+}
+
+bool write_rom_index(RomIndex *index, char *filename)
+{
+	FILE *fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		printf("Couldn't write %s\n", filename);
+		return false;
+	}
+
+	RomIndexHeader header = {
+		ROM_INDEX_MAGIC, ROM_INDEX_VERSION, index->count, index->paths_size
+	};
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+	          fwrite(index->entries, sizeof(RomIndexEntry), index->count, fp) == (size_t)index->count &&
+	          fwrite(index->paths, 1, index->paths_size, fp) == (size_t)index->paths_size;
+
+	fclose(fp);
+	return ok;
+}
+
+bool read_rom_index(RomIndex *index, char *filename)
+{
+	memset(index, 0, sizeof(RomIndex));
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL)
+	{
+		printf("Couldn't open %s\n", filename);
+		return false;
+	}
+
+	RomIndexHeader header;
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+	    header.magic != ROM_INDEX_MAGIC || header.version != ROM_INDEX_VERSION)
+	{
+		printf("%s is not a rom index\n", filename);
+		fclose(fp);
+		return false;
+	}
+
+	index->count = header.count;
+	index->paths_size = header.paths_size;
+	index->entries = malloc((header.count + 1) * sizeof(RomIndexEntry));
+	index->paths = malloc(header.paths_size + 1);
+
+	bool ok = fread(index->entries, sizeof(RomIndexEntry), header.count, fp) == header.count &&
+	          fread(index->paths, 1, header.paths_size, fp) == header.paths_size;
+	fclose(fp);
+
+	for (int i = 0; ok && i < index->count; i++)
+		ok = index->entries[i].path_offset < header.paths_size;
+	if (ok && header.paths_size > 0)
+		ok = index->paths[header.paths_size - 1] == '\0';
+
+	if (!ok)
+	{
+		printf("%s is truncated\n", filename);
+		free_rom_index(index);
+	}
+	return ok;
+}
+
+char *find_indexed_rom(RomIndex *index, const char *key)
+{
+	char *end;
+	unsigned long crc = strtoul(key, &end, 16);
+	bool is_crc = strlen(key) == 8 && *end == '\0';
+
+	for (int i = 0; i < index->count; i++)
+	{
+		char *path = index->paths + index->entries[i].path_offset;
+		const char *name = strrchr(path, '/');
+		name = name != NULL ? name + 1 : path;
+
+		if ((is_crc && index->entries[i].file_crc == crc) || strcmp(name, key) == 0)
+			return path;
+	}
+	return NULL;
+}
+
+void free_rom_index(RomIndex *index)
+{
+	free(index->entries);
+	free(index->paths);
+	memset(index, 0, sizeof(RomIndex));
+}
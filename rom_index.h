@@ -0,0 +1,79 @@
+/*
+
+ROM library index
+
+- Walks a directory tree and parses every .nes file on all cores
+- Each entry keeps the header fields and CRC32s of PRG and CHR
+- The index is written as one binary file so later launches can load
+  it instead of opening every ROM again: with -i <index file>, run and
+  batch take a file CRC or a file name in place of a ROM path
+- Symlinked directories aren't followed, a link back up the tree would
+  never end
+
+File layout: RomIndexHeader, then `count` RomIndexEntry records, then
+`paths_size` bytes of NUL terminated paths.
+
+*/
+#ifndef ROM_INDEX_H_
+#define ROM_INDEX_H_
+
+#include "rom.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ROM_INDEX_MAGIC   0x58444E49 // "INDX"
+#define ROM_INDEX_VERSION 1
+
+typedef struct rom_index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t paths_size;
+} RomIndexHeader;
+
+typedef struct rom_index_entry {
+	uint32_t path_offset; // Into the path table
+	uint32_t pgr_crc;
+	uint32_t chr_crc;
+	uint32_t file_crc;    // PRG followed by CHR, the usual database key
+
+	uint32_t pgr_rom_size;
+	uint32_t chr_rom_size;
+	uint32_t pgr_ram_size;
+	uint32_t pgr_nvram_size;
+	uint32_t chr_ram_size;
+	uint32_t chr_nvram_size;
+
+	uint16_t mapper;
+	uint8_t submapper;
+	uint8_t timing;
+	uint8_t flags; // ROM_INDEX_*
+	uint8_t padding[3];
+} RomIndexEntry;
+
+#define ROM_INDEX_NES2     0x01
+#define ROM_INDEX_VERTICAL 0x02
+#define ROM_INDEX_BATTERY  0x04
+#define ROM_INDEX_TRAINER  0x08
+#define ROM_INDEX_VRAM     0x10
+
+typedef struct rom_index {
+	RomIndexEntry *entries;
+	char *paths;
+	int count;
+	int paths_size;
+} RomIndex;
+
+uint32_t rom_crc32(uint32_t crc, const uint8_t *data, size_t size);
+
+// threads <= 0 uses every online core
+bool build_rom_index(RomIndex *index, char *directory, int threads);
+bool write_rom_index(RomIndex *index, char *filename);
+bool read_rom_index(RomIndex *index, char *filename);
+
+// Path of the ROM whose file CRC (8 hex digits) or file name without its
+// folders is key, NULL when nothing in the index matches
+char *find_indexed_rom(RomIndex *index, const char *key);
+void free_rom_index(RomIndex *index);
+
+#endif
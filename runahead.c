@@ -0,0 +1,66 @@
+#include "runahead.h"
+#include "savestate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool init_run_ahead(RunAhead *run_ahead, Nes *nes, int frames, bool skip_rendering)
+{
+	memset(run_ahead, 0, sizeof(RunAhead));
+	run_ahead->nes = nes;
+	run_ahead->frames = frames > 0 ? frames : 0;
+	run_ahead->skip_rendering = skip_rendering;
+
+	run_ahead->snapshot_size = savestate_size(nes);
+	run_ahead->snapshot = malloc(run_ahead->snapshot_size);
+	if (run_ahead->snapshot == NULL)
+	{
+		printf("Unable to allocate the run-ahead snapshot\n");
+		return false;
+	}
+	return true;
+}
+
+void cleanup_run_ahead(RunAhead *run_ahead)
+{
+	free(run_ahead->snapshot);
+	memset(run_ahead, 0, sizeof(RunAhead));
+}
+
+bool run_ahead_frame(RunAhead *run_ahead)
+{
+	Nes *nes = run_ahead->nes;
+	Capture *capture = nes->capture;
+	bool ok = true;
+
+	// Only the presented picture goes to the capture
+	nes->capture = NULL;
+
+	// The real frame, only its sound is kept
+	nes->ppu.skip_rendering = run_ahead->skip_rendering && run_ahead->frames > 0;
+	run_nes_frames(nes, 1);
+	run_ahead->sample_count = nes->apu.sample_count;
+	memcpy(run_ahead->samples, nes->apu.samples, nes->apu.sample_count * sizeof(int16_t));
+
+	if (run_ahead->frames > 0)
+	{
+		Blip blip = nes->apu.blip;
+		save_state(nes, run_ahead->snapshot, run_ahead->snapshot_size);
+
+		for (int i = 1; i <= run_ahead->frames; i++)
+		{
+			nes->ppu.skip_rendering = run_ahead->skip_rendering && i < run_ahead->frames;
+			run_nes_frames(nes, 1);
+		}
+
+		// The picture isn't part of the state, the last one drawn stays
+		ok = load_state(nes, run_ahead->snapshot, run_ahead->snapshot_size);
+		nes->apu.blip = blip;
+	}
+
+	nes->ppu.skip_rendering = false;
+	nes->capture = capture;
+	if (capture != NULL)
+		capture_frame(capture, nes->ppu.picture);
+	return ok;
+}
@@ -0,0 +1,48 @@
+/*
+
+Run-ahead
+
+- Every host frame runs the real frame, snapshots the machine, runs
+  `frames` more with the same input, keeps the last picture and loads
+  the snapshot back. What's on screen reacts to input that many frames
+  sooner than the game itself would let it
+- The snapshot is a savestate in a buffer allocated once, at init
+- Audio is the real frame's, the hidden frames' sound is thrown away
+  and the band-limited buffer put back as it was
+- With skip_rendering the frames nobody sees only keep sprite 0 hit and
+  overflow up to date, the last ahead frame is the only one drawn
+
+Only works if the game's reaction to input doesn't depend on anything
+outside the savestate. Rewind's dirty tracking doesn't see the loads,
+don't use both on one instance.
+
+*/
+#ifndef RUNAHEAD_H_
+#define RUNAHEAD_H_
+
+#include "nes.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct run_ahead {
+	Nes *nes;
+	int frames; // Ahead of the real frame, 0 runs the real frame only
+	bool skip_rendering;
+
+	uint8_t *snapshot;
+	size_t snapshot_size;
+
+	/* Sound of the last real frame */
+	int16_t samples[BLIP_MAX_SAMPLES];
+	int sample_count;
+} RunAhead;
+
+bool init_run_ahead(RunAhead *run_ahead, Nes *nes, int frames, bool skip_rendering);
+void cleanup_run_ahead(RunAhead *run_ahead);
+
+// One host frame with the buttons already in nes->input. The picture
+// is left in nes->ppu.picture, the sound in run_ahead->samples
+bool run_ahead_frame(RunAhead *run_ahead);
+
+#endif
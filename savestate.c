@@ -0,0 +1,211 @@
+#include "savestate.h"
+#include "render_thread.h"
+#include <string.h>
+
+static size_t section_sizes(Nes *nes, size_t *chr_ram_size)
+{
+	*chr_ram_size = nes->mapper.has_chr_ram ? CHR_RAM_SIZE : 0;
+
+	size_t size = sizeof(SavestateHeader);
+	size += sizeof(SavestateSection) + sizeof(CpuState);
+	size += sizeof(SavestateSection) + INTERNAL_RAM_SIZE;
+	size += sizeof(SavestateSection) + PRG_RAM_SIZE;
+	size += sizeof(SavestateSection) + sizeof(MapperState);
+	size += sizeof(SavestateSection) + sizeof(PpuState);
+	size += sizeof(SavestateSection) + sizeof(ApuState);
+	size += sizeof(SavestateSection) + sizeof(InputState);
+	if (*chr_ram_size)
+		size += sizeof(SavestateSection) + *chr_ram_size;
+	return size;
+}
+
+size_t savestate_size(Nes *nes)
+{
+	size_t chr_ram_size;
+	return section_sizes(nes, &chr_ram_size);
+}
+
+static uint8_t *write_section(uint8_t *out, uint32_t tag, const void *data, uint32_t size)
+{
+	SavestateSection section = { tag, size };
+	memcpy(out, &section, sizeof(section));
+	memcpy(out + sizeof(section), data, size);
+	return out + sizeof(section) + size;
+}
+
+size_t save_state(Nes *nes, uint8_t *buffer, size_t size)
+{
+	size_t chr_ram_size;
+	size_t total = section_sizes(nes, &chr_ram_size);
+	if (size < total)
+		return 0;
+
+	CpuState state;
+	capture_cpu_state(&nes->cpu, &state);
+	SavestateHeader header = { SAVESTATE_MAGIC, SAVESTATE_VERSION, total, nes->mapper.id };
+
+	memcpy(buffer, &header, sizeof(header));
+	uint8_t *out = buffer + sizeof(header);
+	out = write_section(out, SECTION_CPU, &state, sizeof(state));
+	out = write_section(out, SECTION_RAM, nes->mem.ram, INTERNAL_RAM_SIZE);
+	out = write_section(out, SECTION_PRG_RAM, prg_ram_contents(&nes->mem), PRG_RAM_SIZE);
+	out = write_section(out, SECTION_MAPPER, &nes->mapper.state, sizeof(MapperState));
+	out = write_section(out, SECTION_PPU, &nes->ppu.state, sizeof(PpuState));
+	out = write_section(out, SECTION_APU, &nes->apu.state, sizeof(ApuState));
+	out = write_section(out, SECTION_INPUT, &nes->input, sizeof(InputState));
+	if (chr_ram_size)
+		out = write_section(out, SECTION_CHR_RAM, nes->mapper.chr_ram, chr_ram_size);
+
+	return total;
+}
+
+void capture_cpu_state(Cpu *cpu, CpuState *state)
+{
+	memset(state, 0, sizeof(CpuState));
+	state->A = cpu->A;
+	state->X = cpu->X;
+	state->Y = cpu->Y;
+	state->SP = cpu->SP;
+	state->PC = cpu->PC;
+	state->P = cpu->P;
+	state->nz_result = cpu->nz_result;
+	state->cycle_count = cpu->cycle_count;
+	state->frame_count = cpu->frame_count;
+	state->instruction_count = cpu->instruction_count;
+	state->nmi_pending = cpu->nmi_pending;
+	state->irq_lines = cpu->irq_lines;
+	memcpy(state->event_times, cpu->scheduler.times, sizeof(state->event_times));
+}
+
+void restore_cpu_state(Cpu *cpu, const CpuState *state)
+{
+	cpu->A = state->A;
+	cpu->X = state->X;
+	cpu->Y = state->Y;
+	cpu->SP = state->SP;
+	cpu->PC = state->PC;
+	cpu->P = state->P;
+	cpu->nz_result = state->nz_result;
+	cpu->cycle_count = state->cycle_count;
+	cpu->frame_count = state->frame_count;
+	cpu->instruction_count = state->instruction_count;
+	cpu->nmi_pending = state->nmi_pending;
+	cpu->irq_lines = state->irq_lines;
+	cpu->idle.end = 0; // Whatever loop it was in, it has to be seen again
+	memcpy(cpu->scheduler.times, state->event_times, sizeof(state->event_times));
+	update_next_event(&cpu->scheduler);
+}
+
+void restore_mapper_state(Mapper *mapper, const void *data)
+{
+	// Remapping invalidates the decode cache and JIT blocks, so skip it
+	// when the banks are already where the state wants them
+	if (memcmp(&mapper->state, data, sizeof(MapperState)) == 0)
+		return;
+
+	memcpy(&mapper->state, data, sizeof(MapperState));
+	refresh_mapper_banks(mapper);
+}
+
+bool load_state(Nes *nes, const uint8_t *buffer, size_t size)
+{
+	SavestateHeader header;
+	if (size < sizeof(header))
+		return false;
+
+	memcpy(&header, buffer, sizeof(header));
+	if (header.magic != SAVESTATE_MAGIC || header.version != SAVESTATE_VERSION ||
+	    header.size > size || header.mapper != (uint32_t) nes->mapper.id)
+	{
+		printf("Savestate doesn't match this instance\n");
+		return false;
+	}
+
+	// Check every section fits before touching the instance
+	size_t offset = sizeof(header);
+	while (offset < header.size)
+	{
+		SavestateSection section;
+		if (header.size - offset < sizeof(section))
+			return false;
+		memcpy(&section, buffer + offset, sizeof(section));
+		offset += sizeof(section);
+		if (header.size - offset < section.size)
+			return false;
+		offset += section.size;
+	}
+
+	offset = sizeof(header);
+	while (offset < header.size)
+	{
+		SavestateSection section;
+		memcpy(&section, buffer + offset, sizeof(section));
+		const uint8_t *data = buffer + offset + sizeof(section);
+		offset += sizeof(section) + section.size;
+
+		switch (section.tag)
+		{
+			case SECTION_CPU:
+				if (section.size == sizeof(CpuState))
+				{
+					CpuState state;
+					memcpy(&state, data, sizeof(state));
+					restore_cpu_state(&nes->cpu, &state);
+				}
+				break;
+
+			case SECTION_RAM:
+				if (section.size == INTERNAL_RAM_SIZE)
+					memcpy(nes->mem.ram, data, INTERNAL_RAM_SIZE);
+				break;
+
+			case SECTION_PRG_RAM:
+				// Zeros are what PRG-RAM reads as before it's allocated
+				if (section.size == PRG_RAM_SIZE && nes->mem.prg_ram == NULL &&
+				    memcmp(data, prg_ram_contents(&nes->mem), PRG_RAM_SIZE) != 0)
+					back_prg_ram(&nes->mem);
+				if (section.size == PRG_RAM_SIZE && nes->mem.prg_ram != NULL)
+					memcpy(nes->mem.prg_ram, data, PRG_RAM_SIZE);
+				break;
+
+			case SECTION_MAPPER:
+				if (section.size == sizeof(MapperState))
+					restore_mapper_state(&nes->mapper, data);
+				break;
+
+			case SECTION_CHR_RAM:
+				if (nes->mapper.has_chr_ram && section.size == CHR_RAM_SIZE)
+				{
+					memcpy(nes->mapper.chr_ram, data, CHR_RAM_SIZE);
+					nes->mapper.chr_generation ++;
+					refresh_ppu_tiles(&nes->ppu);
+				}
+				break;
+
+			case SECTION_PPU:
+				if (section.size == sizeof(PpuState))
+					memcpy(&nes->ppu.state, data, sizeof(PpuState));
+				break;
+
+			case SECTION_APU:
+				if (section.size == sizeof(ApuState))
+				{
+					memcpy(&nes->apu.state, data, sizeof(ApuState));
+					refresh_apu(&nes->apu);
+				}
+				break;
+
+			case SECTION_INPUT:
+				if (section.size == sizeof(InputState))
+					memcpy(&nes->input, data, sizeof(InputState));
+				break;
+
+			default: // From a newer build, nothing here to restore it into
+				break;
+		}
+	}
+
+	if (nes->ppu.render_thread != NULL)
+		restart_render_log(nes->ppu.render_thread);
+	return true;
+}
@@ -0,0 +1,77 @@
+/*
+
+Savestates
+
+- The whole machine is written as a small header followed by tagged
+  sections (CPU, RAM, PRG-RAM, mapper, CHR-RAM, PPU, APU, input)
+- Each section is a straight memcpy of a fixed layout, so saving and
+  loading cost about as much as copying the ~15 KB of state
+- Loading skips sections it doesn't know, and leaves a component alone
+  when its section is missing, so newer components can add their own
+  tags without breaking older states
+
+*/
+#ifndef SAVESTATE_H_
+#define SAVESTATE_H_
+
+#include "nes.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SAVESTATE_MAGIC   0x5453534E // "NSST"
+#define SAVESTATE_VERSION 3
+
+#define SECTION_CPU     0x20555043 // "CPU "
+#define SECTION_RAM     0x204D4152 // "RAM "
+#define SECTION_PRG_RAM 0x4D415250 // "PRAM"
+#define SECTION_MAPPER  0x5250414D // "MAPR"
+#define SECTION_CHR_RAM 0x4D415243 // "CRAM"
+#define SECTION_PPU     0x20555050 // "PPU "
+#define SECTION_APU     0x20555041 // "APU "
+#define SECTION_INPUT   0x54504E49 // "INPT"
+
+typedef struct savestate_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;   // Including this header
+	uint32_t mapper; // States only load into the same mapper
+} SavestateHeader;
+
+typedef struct savestate_section {
+	uint32_t tag;
+	uint32_t size; // Payload bytes following this header
+} SavestateSection;
+
+typedef struct cpu_state {
+	uint8_t A;
+	uint8_t X;
+	uint8_t Y;
+	uint8_t SP;
+	uint16_t PC;
+	uint8_t P;
+	uint16_t nz_result;
+	int32_t cycle_count;
+	uint64_t frame_count;
+	uint64_t instruction_count;
+	uint8_t nmi_pending;
+	uint8_t irq_lines;
+	uint64_t event_times[SCHEDULER_MAX_EVENTS];
+} CpuState;
+
+// Bytes save_state() needs for this instance
+size_t savestate_size(Nes *nes);
+
+// Returns the bytes written, 0 if buffer is too small
+size_t save_state(Nes *nes, uint8_t *buffer, size_t size);
+
+// Restores into an existing instance. Nothing is allocated, except
+// PRG-RAM the instance never wrote and the state has something in
+bool load_state(Nes *nes, const uint8_t *buffer, size_t size);
+
+// Section helpers, also used by rewind.c
+void capture_cpu_state(Cpu *cpu, CpuState *state);
+void restore_cpu_state(Cpu *cpu, const CpuState *state);
+void restore_mapper_state(Mapper *mapper, const void *data); // Remaps only on change
+
+#endif
@@ -0,0 +1,62 @@
+#include "scheduler.h"
+#include <stdio.h>
+#include <string.h>
+
+void init_scheduler(Scheduler *scheduler)
+{
+	memset(scheduler, 0, sizeof(Scheduler));
+	for (int i = 0; i < SCHEDULER_MAX_EVENTS; i++)
+		scheduler->times[i] = EVENT_NEVER;
+	scheduler->next = EVENT_NEVER;
+}
+
+int add_event(Scheduler *scheduler, EventHandler handler, void *context)
+{
+	if (scheduler->count == SCHEDULER_MAX_EVENTS)
+	{
+		printf("Too many scheduler events\n");
+		return -1;
+	}
+
+	int id = scheduler->count++;
+	scheduler->events[id].handler = handler;
+	scheduler->events[id].context = context;
+	return id;
+}
+
+/* A handful of slots, a linear scan beats keeping a heap in order */
+void update_next_event(Scheduler *scheduler)
+{
+	uint64_t next = EVENT_NEVER;
+	for (int i = 0; i < scheduler->count; i++)
+		if (scheduler->times[i] < next)
+			next = scheduler->times[i];
+	scheduler->next = next;
+}
+
+void schedule_event(Scheduler *scheduler, int id, uint64_t time)
+{
+	scheduler->times[id] = time;
+	update_next_event(scheduler);
+}
+
+void cancel_event(Scheduler *scheduler, int id)
+{
+	scheduler->times[id] = EVENT_NEVER;
+	update_next_event(scheduler);
+}
+
+void run_due_events(Scheduler *scheduler, uint64_t now)
+{
+	while (scheduler->next <= now)
+	{
+		// Ties go to the event registered first
+		int id = 0;
+		while (scheduler->times[id] != scheduler->next)
+			id ++;
+
+		uint64_t time = scheduler->times[id];
+		cancel_event(scheduler, id);
+		scheduler->events[id].handler(scheduler->events[id].context, time);
+	}
+}
@@ -0,0 +1,57 @@
+/*
+
+Event scheduler
+
+- Anything that happens at a known CPU cycle (scanlines, vblank, the
+  APU frame counter, mapper IRQs, DMA) is an event with an absolute
+  timestamp, counted in CPU cycles since power on
+- The CPU runs uninterrupted until the earliest event is due, the
+  handlers run, and the CPU picks up where it stopped
+- Components touched between two events catch up to cpu_time() in
+  their register handlers, nothing is stepped cycle by cycle
+- Slots are handed out in registration order, so only the timestamps
+  need saving; the handlers are the same in every instance
+
+*/
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SCHEDULER_MAX_EVENTS 8
+#define EVENT_NEVER UINT64_MAX
+
+// time is when the event was scheduled for, which can be a little
+// before the CPU got there
+typedef void (*EventHandler)(void *context, uint64_t time);
+
+typedef struct event {
+	EventHandler handler;
+	void *context;
+} Event;
+
+typedef struct scheduler {
+	uint64_t times[SCHEDULER_MAX_EVENTS]; // EVENT_NEVER when not scheduled
+	Event events[SCHEDULER_MAX_EVENTS];
+	int count;
+	uint64_t next; // Earliest of times
+} Scheduler;
+
+void init_scheduler(Scheduler *scheduler);
+
+// Returns the event id, -1 when every slot is taken
+int add_event(Scheduler *scheduler, EventHandler handler, void *context);
+
+// Replaces any time the event already had
+void schedule_event(Scheduler *scheduler, int id, uint64_t time);
+void cancel_event(Scheduler *scheduler, int id);
+
+// Runs everything due at or before now, earliest first. Handlers are
+// free to schedule more events, including ones that are already due
+void run_due_events(Scheduler *scheduler, uint64_t now);
+
+// After the timestamps were overwritten directly (savestates)
+void update_next_event(Scheduler *scheduler);
+
+#endif
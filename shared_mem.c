@@ -1,30 +1,121 @@
 #include "shared_mem.h"
+#include <string.h>
 
-uint8_t read_cpu_memory(SharedMemory *mem, uint16_t addr)
+// Nothing drives the data bus, so the last value on it (the high byte
+// of the address for an absolute read) is what comes back
+static uint8_t open_bus(uint16_t addr)
 {
-	return mem->cpu_memory[addr];
+	return addr >> 8;
 }
 
-void write_cpu_memory(SharedMemory *mem, uint16_t addr, uint8_t byte)
+// What PRG-RAM reads as before anything is written there
+static const uint8_t unwritten_prg_ram[PRG_RAM_SIZE];
+
+uint8_t read_io_memory(SharedMemory *mem, uint16_t addr)
 {
-	mem->cpu_memory[addr] = byte;
+	IoHandler *handler = mem->io_handlers[mem->io_pages[addr >> 8]];
+	if (handler == NULL || handler->read == NULL)
+		return open_bus(addr);
+	return handler->read(handler->context, addr);
 }
 
-// load_chr_rom
-void load_pgr_banks(SharedMemory *mem, Rom *rom)
+void write_io_memory(SharedMemory *mem, uint16_t addr, uint8_t byte)
 {
-	int pgr_offset = 0;
+	IoHandler *handler = mem->io_handlers[mem->io_pages[addr >> 8]];
+	if (handler != NULL && handler->write != NULL)
+		handler->write(handler->context, addr, byte);
+}
+
+static void write_unbacked_prg_ram(void *context, uint16_t addr, uint8_t byte)
+{
+	SharedMemory *mem = context;
+	if (back_prg_ram(mem))
+		write_cpu_memory(mem, addr, byte);
+}
 
-	// If more than two 16 kb banks, use mapper
-	if (rom->pgr_rom_size <= (16384 * 2))
+void init_shared_memory(SharedMemory *mem)
+{
+	memset(mem, 0, sizeof(SharedMemory));
+	mem->prg_generation = 1;
+	mem->io_handler_count = 1;
+
+	map_memory(mem, 0x0000, 0x1FFF, mem->ram, INTERNAL_RAM_SIZE, true);
+
+	// Reads come from the zeros, writes go to the handler
+	mem->prg_ram_handler.write = &write_unbacked_prg_ram;
+	mem->prg_ram_handler.context = mem;
+	map_io(mem, 0x6000, 0x7FFF, &mem->prg_ram_handler);
+	map_memory(mem, 0x6000, 0x7FFF, (uint8_t *) unwritten_prg_ram, PRG_RAM_SIZE, false);
+}
+
+void cleanup_shared_memory(SharedMemory *mem)
+{
+	free(mem->prg_ram);
+	mem->prg_ram = NULL;
+}
+
+bool back_prg_ram(SharedMemory *mem)
+{
+	if (mem->prg_ram != NULL || mem->read_pages[0x60] != unwritten_prg_ram)
+		return true;
+
+	mem->prg_ram = calloc(1, PRG_RAM_SIZE);
+	if (mem->prg_ram == NULL)
 	{
-		for (int i = 0; i < 16384; i++)
-			mem->cpu_memory[0x8000 + i] = rom->pgr_rom[pgr_offset + i];
+		printf("Unable to allocate PRG-RAM\n");
+		return false;
+	}
+	map_memory(mem, 0x6000, 0x7FFF, mem->prg_ram, PRG_RAM_SIZE, true);
+	return true;
+}
 
-		pgr_offset = (rom->pgr_rom_size == 16384) ? 0 : 16384;
-		
-		for (int i = 0; i < 16384; i++)
-			mem->cpu_memory[0xC000 + i] = rom->pgr_rom[pgr_offset + i];
+const uint8_t *prg_ram_contents(SharedMemory *mem)
+{
+	return mem->prg_ram != NULL ? mem->prg_ram : unwritten_prg_ram;
+}
+
+void map_memory(SharedMemory *mem, uint16_t start, uint16_t end, uint8_t *host, size_t size, bool writable)
+{
+	int first_page = start >> 8;
+	int last_page = end >> 8;
+	bool moved = false;
+
+	for (int page = first_page; page <= last_page; page++)
+	{
+		uint8_t *pointer = host + ((size_t) (page - first_page) * CPU_PAGE_SIZE) % size;
+		moved |= mem->read_pages[page] != pointer;
+		mem->read_pages[page] = pointer;
+		mem->write_pages[page] = writable ? pointer : NULL;
+	}
+
+	// Mappers remap every window on any register write, code decoded
+	// from PRG only goes stale when it now reads from somewhere else
+	if (end >= 0x8000 && moved)
+		mem->prg_generation ++;
+}
+
+void map_io(SharedMemory *mem, uint16_t start, uint16_t end, IoHandler *handler)
+{
+	int index = 0;
+	while (index < mem->io_handler_count && mem->io_handlers[index] != handler)
+		index ++;
+	if (index == mem->io_handler_count)
+	{
+		if (index == MAX_IO_HANDLERS)
+		{
+			printf("More than %d I/O handlers\n", MAX_IO_HANDLERS - 1);
+			return;
+		}
+		mem->io_handlers[mem->io_handler_count++] = handler;
 	}
+
+	for (int page = start >> 8; page <= (end >> 8); page++)
+	{
+		mem->read_pages[page] = NULL;
+		mem->write_pages[page] = NULL;
+		mem->io_pages[page] = index;
+	}
+
+	if (end >= 0x8000)
+		mem->prg_generation ++;
 }
- 
\ No newline at end of file
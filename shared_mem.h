@@ -4,19 +4,105 @@
 - Also interfacing for triggering cpu interrupts
 - Communication via buses
 
+The CPU address space is split into 256 byte pages. A page either points
+straight at host memory (internal RAM, PRG-RAM, PRG-ROM banks) or is
+handed to the I/O handler registered for it (PPU, APU, controllers).
+
+PRG-RAM is only allocated at the first write to it, until then it reads
+as zeros from a block every instance shares.
+
 */
 #ifndef SHARED_MEM_H
 #define SHARED_MEM_H
 
 #include "rom.h"
+#include <stddef.h>
 #include <stdint.h>
 
+#define CPU_PAGE_SIZE  0x100
+#define CPU_PAGE_COUNT 0x100
+
+#define INTERNAL_RAM_SIZE 0x0800 // Mirrored up to $1FFF
+#define PRG_RAM_SIZE      0x2000 // $6000-$7FFF
+#define MAX_IO_HANDLERS   8
+
+typedef struct io_handler {
+	uint8_t (*read)(void *context, uint16_t addr);
+	void (*write)(void *context, uint16_t addr, uint8_t byte);
+	// Optional: the CPU time up to which reads of addr keep returning the
+	// same value, with no side effects past the first. Lets the CPU skip
+	// loops polling it (see skip_idle_loop() in cpu.c). 0 if it can't tell
+	uint64_t (*idle_until)(void *context, uint16_t addr);
+	void *context;
+} IoHandler;
+
 typedef struct {
-	uint8_t cpu_memory[0xFFFF];
+	uint8_t *read_pages[CPU_PAGE_COUNT];  // NULL when reads go to the I/O handler
+	uint8_t *write_pages[CPU_PAGE_COUNT]; // NULL when writes go to the I/O handler
+	uint8_t io_pages[CPU_PAGE_COUNT];     // Index into io_handlers, 0 for open bus
+	IoHandler *io_handlers[MAX_IO_HANDLERS]; // [0] is always NULL
+	int io_handler_count;
+	IoHandler prg_ram_handler; // Allocates PRG-RAM at the first write
+
+	uint32_t prg_generation; // Bumped whenever $8000-$FFFF changes
+	uint8_t dirty_pages[CPU_PAGE_COUNT / 8]; // Bit per page written through write_pages
+
+	uint8_t ram[INTERNAL_RAM_SIZE];
+	uint8_t *prg_ram; // PRG_RAM_SIZE bytes, NULL until written
 } SharedMemory;
 
-uint8_t read_cpu_memory(SharedMemory* mem, uint16_t addr);
-void write_cpu_memory(SharedMemory* mem, uint16_t addr, uint8_t byte);
-void load_pgr_banks(SharedMemory* mem, Rom *rom);
+uint8_t read_io_memory(SharedMemory* mem, uint16_t addr);
+void write_io_memory(SharedMemory* mem, uint16_t addr, uint8_t byte);
+
+static inline uint8_t read_cpu_memory(SharedMemory* mem, uint16_t addr)
+{
+	uint8_t *page = mem->read_pages[addr >> 8];
+	if (page != NULL)
+		return page[addr & 0xFF];
+	return read_io_memory(mem, addr);
+}
+
+static inline void write_cpu_memory(SharedMemory* mem, uint16_t addr, uint8_t byte)
+{
+	uint8_t *page = mem->write_pages[addr >> 8];
+	if (page == NULL)
+	{
+		write_io_memory(mem, addr, byte);
+		return;
+	}
+
+	page[addr & 0xFF] = byte;
+	mem->dirty_pages[addr >> 11] |= 1 << ((addr >> 8) & 7);
+
+	// Code in PRG changed under any instruction decoded from it
+	if (addr >= 0x8000)
+		mem->prg_generation ++;
+}
+
+/* Read without triggering I/O side effects, for decoders and debuggers.
+   I/O pages read as open bus, the high byte of the address */
+static inline uint8_t peek_cpu_memory(SharedMemory* mem, uint16_t addr)
+{
+	uint8_t *page = mem->read_pages[addr >> 8];
+	if (page != NULL)
+		return page[addr & 0xFF];
+	return addr >> 8;
+}
+
+// Must not move after this, PRG-RAM's handler points back at it
+void init_shared_memory(SharedMemory* mem);
+void cleanup_shared_memory(SharedMemory* mem);
+
+// Allocate PRG-RAM now if it's still waiting for its first write. Carts
+// with $6000-$7FFF mapped to anything else are left alone
+bool back_prg_ram(SharedMemory* mem);
+
+// PRG-RAM, or the zeros it reads as while it doesn't exist
+const uint8_t *prg_ram_contents(SharedMemory* mem);
+
+/* Point start-end at host memory, repeating every size bytes. Writes to
+   read only pages still reach any I/O handler mapped there before. */
+void map_memory(SharedMemory* mem, uint16_t start, uint16_t end, uint8_t *host, size_t size, bool writable);
+void map_io(SharedMemory* mem, uint16_t start, uint16_t end, IoHandler *handler);
 
 #endif
@@ -0,0 +1,159 @@
+#include "trace.h"
+#include <string.h>
+#include <time.h>
+
+static void *trace_writer(void *arg)
+{
+	Tracer *tracer = arg;
+	struct timespec idle = {0, 100000};
+
+	for (;;)
+	{
+		uint64_t tail = tracer->tail;
+		uint64_t head = __atomic_load_n(&tracer->head, __ATOMIC_ACQUIRE);
+
+		if (head == tail)
+		{
+			if (!__atomic_load_n(&tracer->running, __ATOMIC_ACQUIRE))
+				break;
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		// Write up to the end of the ring in one go
+		uint64_t start = tail & (TRACE_RING_SIZE - 1);
+		uint64_t count = head - tail;
+		if (count > TRACE_RING_SIZE - start) count = TRACE_RING_SIZE - start;
+		if (count > TRACE_WRITE_CHUNK) count = TRACE_WRITE_CHUNK;
+
+		fwrite(&tracer->ring[start], sizeof(TraceRecord), count, tracer->file);
+		__atomic_store_n(&tracer->tail, tail + count, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+bool start_trace(Tracer *tracer, char *filename)
+{
+	memset(tracer, 0, sizeof(Tracer));
+	tracer->file = fopen(filename, "wb");
+	if (tracer->file == NULL)
+	{
+		printf("Couldn't create trace file %s\n", filename);
+		return false;
+	}
+
+	TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRecord), 0 };
+	fwrite(&header, sizeof(header), 1, tracer->file);
+
+	tracer->ring = malloc(TRACE_RING_SIZE * sizeof(TraceRecord));
+	tracer->running = true;
+	if (tracer->ring == NULL || pthread_create(&tracer->writer, NULL, &trace_writer, tracer) != 0)
+	{
+		printf("Couldn't start the trace writer\n");
+		free(tracer->ring);
+		fclose(tracer->file);
+		return false;
+	}
+
+	return true;
+}
+
+void stop_trace(Tracer *tracer)
+{
+	__atomic_store_n(&tracer->running, false, __ATOMIC_RELEASE);
+	pthread_join(tracer->writer, NULL);
+
+	fclose(tracer->file);
+	free(tracer->ring);
+	tracer->ring = NULL;
+	tracer->file = NULL;
+}
+
+/* Disassemble in nestest.log syntax, without the memory annotations */
+static void disassemble(TraceRecord *record, char *buffer, size_t size)
+{
+	const char *name = opcode_names[record->opcode];
+	uint8_t low = record->operand[0];
+	uint16_t word = record->operand[0] | (record->operand[1] << 8);
+
+	switch (addressing_modes[record->opcode])
+	{
+		case implied:     snprintf(buffer, size, "%s", name); break;
+		case accumulator: snprintf(buffer, size, "%s A", name); break;
+		case immediate:   snprintf(buffer, size, "%s #$%02X", name, low); break;
+		case zero_page:   snprintf(buffer, size, "%s $%02X", name, low); break;
+		case zero_page_x: snprintf(buffer, size, "%s $%02X,X", name, low); break;
+		case zero_page_y: snprintf(buffer, size, "%s $%02X,Y", name, low); break;
+		case relative:
+			snprintf(buffer, size, "%s $%04X", name, (uint16_t)(record->PC + 2 + (int8_t)low));
+			break;
+		case absolute:    snprintf(buffer, size, "%s $%04X", name, word); break;
+		case absolute_x:  snprintf(buffer, size, "%s $%04X,X", name, word); break;
+		case absolute_y:  snprintf(buffer, size, "%s $%04X,Y", name, word); break;
+		case indirect:    snprintf(buffer, size, "%s ($%04X)", name, word); break;
+		case indirect_x:  snprintf(buffer, size, "%s ($%02X,X)", name, low); break;
+		case indirect_y:  snprintf(buffer, size, "%s ($%02X),Y", name, low); break;
+	}
+}
+
+void format_trace_record(TraceRecord *record, char *buffer, size_t size)
+{
+	int length = instruction_length(addressing_modes[record->opcode]);
+	char bytes[10];
+	char text[32];
+
+	if (length == 1)
+		snprintf(bytes, sizeof(bytes), "%02X", record->opcode);
+	else if (length == 2)
+		snprintf(bytes, sizeof(bytes), "%02X %02X", record->opcode, record->operand[0]);
+	else
+		snprintf(bytes, sizeof(bytes), "%02X %02X %02X", record->opcode, record->operand[0], record->operand[1]);
+	disassemble(record, text, sizeof(text));
+
+	// The PPU runs 3 dots per CPU cycle, 341 dots per scanline
+	uint64_t dots = record->cycle * 3;
+	bool unofficial = opcode_names[record->opcode][0] == 'N' && record->opcode != 0xEA;
+
+	snprintf(buffer, size, "%04X  %-9s%c%-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3d,%3d CYC:%llu",
+		record->PC, bytes, unofficial ? '*' : ' ', text,
+		record->A, record->X, record->Y, record->P, record->SP,
+		(int)((dots / 341) % 262), (int)(dots % 341), (unsigned long long) record->cycle);
+}
+
+bool render_trace(char *trace_file, FILE *out)
+{
+	FILE *fp = fopen(trace_file, "rb");
+	if (fp == NULL)
+	{
+		printf("Couldn't open %s\n", trace_file);
+		return false;
+	}
+
+	TraceHeader header;
+	if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != TRACE_MAGIC ||
+	    header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord))
+	{
+		printf("%s is not a trace file\n", trace_file);
+		fclose(fp);
+		return false;
+	}
+
+	TraceRecord *records = malloc(TRACE_WRITE_CHUNK * sizeof(TraceRecord));
+	char line[128];
+	size_t count;
+
+	while ((count = fread(records, sizeof(TraceRecord), TRACE_WRITE_CHUNK, fp)) > 0)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			format_trace_record(&records[i], line, sizeof(line));
+			fputs(line, out);
+			fputc('\n', out);
+		}
+	}
+
+	free(records);
+	fclose(fp);
+	return true;
+}
@@ -0,0 +1,92 @@
+/*
+
+Binary CPU trace
+
+- One fixed size record per instruction, taken before it executes
+- Records go into a single producer ring buffer, a background thread
+  drains it to disk so the CPU never waits on formatted I/O
+- render_trace() turns a trace file into nestest.log style text offline
+
+*/
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "cpu.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC       0x43525454 // "TTRC"
+#define TRACE_VERSION     2
+#define TRACE_RING_SIZE   (1 << 16)  // Records, must be a power of 2
+#define TRACE_WRITE_CHUNK 4096       // Records per fwrite
+
+typedef struct trace_record {
+	uint64_t cycle;
+	uint16_t PC;
+	uint8_t opcode;
+	uint8_t operand[2]; // The bytes after the opcode, whether used or not
+	uint8_t A;
+	uint8_t X;
+	uint8_t Y;
+	uint8_t P;
+	uint8_t SP;
+	uint8_t padding[6];
+} TraceRecord;
+
+typedef struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t reserved;
+} TraceHeader;
+
+typedef struct tracer {
+	TraceRecord *ring;
+	uint64_t head; // Written by the CPU thread only
+	uint64_t tail; // Written by the writer thread only
+	bool running;
+
+	FILE *file;
+	pthread_t writer;
+	uint64_t stalls; // Times the CPU found the ring full
+} Tracer;
+
+bool start_trace(Tracer *tracer, char *filename);
+void stop_trace(Tracer *tracer); // Drains the ring and closes the file
+
+// Render a trace file as nestest.log lines
+bool render_trace(char *trace_file, FILE *out);
+void format_trace_record(TraceRecord *record, char *buffer, size_t size);
+
+// Snapshot the state before the instruction at PC runs
+static inline void capture_trace_record(Cpu *cpu, TraceRecord *record)
+{
+	record->cycle = cpu->frame_count * CPU_CYCLES_PER_FRAME + cpu->cycle_count;
+	record->PC = cpu->PC;
+	record->opcode = peek_cpu_memory(cpu->memspace, cpu->PC);
+	record->operand[0] = peek_cpu_memory(cpu->memspace, cpu->PC + 1);
+	record->operand[1] = peek_cpu_memory(cpu->memspace, cpu->PC + 2);
+	record->A = cpu->A;
+	record->X = cpu->X;
+	record->Y = cpu->Y;
+	record->P = get_status_flags(cpu) | FLAG_U;
+	record->SP = cpu->SP;
+}
+
+static inline void trace_instruction(Tracer *tracer, Cpu *cpu)
+{
+	uint64_t head = tracer->head;
+	while (head - __atomic_load_n(&tracer->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE)
+	{
+		tracer->stalls ++;
+		sched_yield();
+	}
+
+	capture_trace_record(cpu, &tracer->ring[head & (TRACE_RING_SIZE - 1)]);
+	__atomic_store_n(&tracer->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,294 @@
+#include "video.h"
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VIDEO_X86
+#include <immintrin.h>
+#endif
+
+// 2C02 colors, as most emulators ship them
+const uint8_t nes_palette[64][3] = {
+	{0x66,0x66,0x66}, {0x00,0x2A,0x88}, {0x14,0x12,0xA7}, {0x3B,0x00,0xA4},
+	{0x5C,0x00,0x7E}, {0x6E,0x00,0x40}, {0x6C,0x06,0x00}, {0x56,0x1D,0x00},
+	{0x33,0x35,0x00}, {0x0B,0x48,0x00}, {0x00,0x52,0x00}, {0x00,0x4F,0x08},
+	{0x00,0x40,0x4D}, {0x00,0x00,0x00}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+	{0xAD,0xAD,0xAD}, {0x15,0x5F,0xD9}, {0x42,0x40,0xFF}, {0x75,0x27,0xFE},
+	{0xA0,0x1A,0xCC}, {0xB7,0x1E,0x7B}, {0xB5,0x31,0x20}, {0x99,0x4E,0x00},
+	{0x6B,0x6D,0x00}, {0x38,0x87,0x00}, {0x0C,0x93,0x00}, {0x00,0x8F,0x32},
+	{0x00,0x7C,0x8D}, {0x00,0x00,0x00}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+	{0xFF,0xFE,0xFF}, {0x64,0xB0,0xFF}, {0x92,0x90,0xFF}, {0xC6,0x76,0xFF},
+	{0xF3,0x6A,0xFF}, {0xFE,0x6E,0xCC}, {0xFE,0x81,0x70}, {0xEA,0x9E,0x22},
+	{0xBC,0xBE,0x00}, {0x88,0xD8,0x00}, {0x5C,0xE4,0x30}, {0x45,0xE0,0x82},
+	{0x48,0xCD,0xDE}, {0x4F,0x4F,0x4F}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+	{0xFF,0xFE,0xFF}, {0xC0,0xDF,0xFF}, {0xD3,0xD2,0xFF}, {0xE8,0xC8,0xFF},
+	{0xFB,0xC2,0xFF}, {0xFE,0xC4,0xEA}, {0xFE,0xCC,0xC5}, {0xF7,0xD8,0xA5},
+	{0xE4,0xE5,0x94}, {0xCF,0xEF,0x96}, {0xBD,0xF4,0xAB}, {0xB3,0xF3,0xCC},
+	{0xB5,0xEB,0xF2}, {0xB8,0xB8,0xB8}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+};
+
+/* Scalar */
+
+static void decode_tiles_scalar(const uint8_t *chr, uint8_t *pixels, size_t tile_count)
+{
+	for (size_t tile = 0; tile < tile_count; tile++)
+	{
+		for (int row = 0; row < 8; row++)
+		{
+			uint8_t low = chr[row];
+			uint8_t high = chr[row + 8];
+			for (int pixel = 0; pixel < 8; pixel++)
+				*pixels++ = ((low >> (7 - pixel)) & 1) | (((high >> (7 - pixel)) & 1) << 1);
+		}
+		chr += TILE_BYTES;
+	}
+}
+
+static void indexed_to_rgba_scalar(const uint8_t *indexed, uint8_t *rgba, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		const uint8_t *color = nes_palette[indexed[i] & 0x3F];
+		rgba[0] = color[0];
+		rgba[1] = color[1];
+		rgba[2] = color[2];
+		rgba[3] = 0xFF;
+		rgba += 4;
+	}
+}
+
+static const PixelKernels scalar_kernels = {
+	"scalar", &decode_tiles_scalar, &indexed_to_rgba_scalar
+};
+
+#ifdef VIDEO_X86
+
+/* The 64 entry palette as four 16 byte pshufb tables per channel */
+static void palette_tables(uint8_t tables[3][4][16])
+{
+	for (int i = 0; i < 64; i++)
+		for (int channel = 0; channel < 3; channel++)
+			tables[channel][i >> 4][i & 0x0F] = nes_palette[i][channel];
+}
+
+/* SSSE3: two rows per register, each plane byte spread over 8 lanes and
+   tested against one bit per lane */
+
+__attribute__((target("ssse3")))
+static inline __m128i plane_bits_ssse3(__m128i spread, __m128i bits, __m128i value)
+{
+	return _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(spread, bits), bits), value);
+}
+
+__attribute__((target("ssse3")))
+static void decode_tiles_ssse3(const uint8_t *chr, uint8_t *pixels, size_t tile_count)
+{
+	const __m128i bits = _mm_setr_epi8(
+		0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+		0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	const __m128i one = _mm_set1_epi8(1);
+	const __m128i two = _mm_set1_epi8(2);
+
+	// Row n in lanes 0-7 and row n + 1 in 8-15, for each pair of rows
+	const __m128i spread[4] = {
+		_mm_set_epi64x(0x0101010101010101, 0x0000000000000000),
+		_mm_set_epi64x(0x0303030303030303, 0x0202020202020202),
+		_mm_set_epi64x(0x0505050505050505, 0x0404040404040404),
+		_mm_set_epi64x(0x0707070707070707, 0x0606060606060606),
+	};
+	const __m128i high_plane = _mm_set1_epi8(8);
+
+	for (size_t tile = 0; tile < tile_count; tile++)
+	{
+		__m128i planes = _mm_loadu_si128((const __m128i *) (chr + tile * TILE_BYTES));
+		uint8_t *out = pixels + tile * TILE_PIXELS;
+
+		for (int pair = 0; pair < 4; pair++)
+		{
+			__m128i low = _mm_shuffle_epi8(planes, spread[pair]);
+			__m128i high = _mm_shuffle_epi8(planes, _mm_add_epi8(spread[pair], high_plane));
+			_mm_storeu_si128((__m128i *) (out + pair * 16), _mm_or_si128(
+				plane_bits_ssse3(low, bits, one), plane_bits_ssse3(high, bits, two)));
+		}
+	}
+}
+
+/* Index i picks byte i & 15 from table i >> 4: every table gets the
+   index with its own number xored out of the top bits, and indices that
+   don't belong to it saturate past 0x80 so pshufb zeroes them */
+__attribute__((target("ssse3")))
+static void indexed_to_rgba_ssse3(const uint8_t *indexed, uint8_t *rgba, size_t count)
+{
+	uint8_t tables[3][4][16];
+	palette_tables(tables);
+
+	__m128i lookup[3][4];
+	for (int channel = 0; channel < 3; channel++)
+		for (int table = 0; table < 4; table++)
+			lookup[channel][table] = _mm_loadu_si128((const __m128i *) tables[channel][table]);
+
+	const __m128i saturate = _mm_set1_epi8(0x70);
+	const __m128i alpha = _mm_set1_epi8((char) 0xFF);
+	size_t i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i index = _mm_and_si128(_mm_loadu_si128((const __m128i *) (indexed + i)), _mm_set1_epi8(0x3F));
+		__m128i select[4];
+		for (int table = 0; table < 4; table++)
+			select[table] = _mm_adds_epu8(_mm_xor_si128(index, _mm_set1_epi8(table << 4)), saturate);
+
+		__m128i color[3];
+		for (int channel = 0; channel < 3; channel++)
+		{
+			color[channel] = _mm_shuffle_epi8(lookup[channel][0], select[0]);
+			for (int table = 1; table < 4; table++)
+				color[channel] = _mm_or_si128(color[channel], _mm_shuffle_epi8(lookup[channel][table], select[table]));
+		}
+
+		__m128i red_green_low = _mm_unpacklo_epi8(color[0], color[1]);
+		__m128i red_green_high = _mm_unpackhi_epi8(color[0], color[1]);
+		__m128i blue_alpha_low = _mm_unpacklo_epi8(color[2], alpha);
+		__m128i blue_alpha_high = _mm_unpackhi_epi8(color[2], alpha);
+
+		__m128i *out = (__m128i *) (rgba + i * 4);
+		_mm_storeu_si128(out + 0, _mm_unpacklo_epi16(red_green_low, blue_alpha_low));
+		_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(red_green_low, blue_alpha_low));
+		_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(red_green_high, blue_alpha_high));
+		_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(red_green_high, blue_alpha_high));
+	}
+
+	indexed_to_rgba_scalar(indexed + i, rgba + i * 4, count - i);
+}
+
+static const PixelKernels ssse3_kernels = {
+	"ssse3", &decode_tiles_ssse3, &indexed_to_rgba_ssse3
+};
+
+/* AVX2: the same, 32 lanes at a time. Shuffles stay inside 128 bit
+   lanes, so the tables are repeated in both halves */
+
+__attribute__((target("avx2")))
+static inline __m256i plane_bits_avx2(__m256i spread, __m256i bits, __m256i value)
+{
+	return _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(spread, bits), bits), value);
+}
+
+__attribute__((target("avx2")))
+static void decode_tiles_avx2(const uint8_t *chr, uint8_t *pixels, size_t tile_count)
+{
+	const __m256i bits = _mm256_set1_epi64x(0x0102040810204080);
+	const __m256i one = _mm256_set1_epi8(1);
+	const __m256i two = _mm256_set1_epi8(2);
+
+	// Rows 0-3 spread over the register, then rows 4-7
+	const __m256i spread_top = _mm256_setr_epi64x(
+		0x0000000000000000, 0x0101010101010101, 0x0202020202020202, 0x0303030303030303);
+	const __m256i spread_bottom = _mm256_add_epi8(spread_top, _mm256_set1_epi8(4));
+	const __m256i high_plane = _mm256_set1_epi8(8);
+
+	for (size_t tile = 0; tile < tile_count; tile++)
+	{
+		__m256i planes = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (chr + tile * TILE_BYTES)));
+		uint8_t *out = pixels + tile * TILE_PIXELS;
+
+		// Lane two of spread_top reads rows 2 and 3, but shuffles only see
+		// their own lane, which holds the same tile
+		__m256i top_low = _mm256_shuffle_epi8(planes, spread_top);
+		__m256i top_high = _mm256_shuffle_epi8(planes, _mm256_add_epi8(spread_top, high_plane));
+		__m256i bottom_low = _mm256_shuffle_epi8(planes, spread_bottom);
+		__m256i bottom_high = _mm256_shuffle_epi8(planes, _mm256_add_epi8(spread_bottom, high_plane));
+
+		_mm256_storeu_si256((__m256i *) out, _mm256_or_si256(
+			plane_bits_avx2(top_low, bits, one), plane_bits_avx2(top_high, bits, two)));
+		_mm256_storeu_si256((__m256i *) (out + 32), _mm256_or_si256(
+			plane_bits_avx2(bottom_low, bits, one), plane_bits_avx2(bottom_high, bits, two)));
+	}
+}
+
+__attribute__((target("avx2")))
+static void indexed_to_rgba_avx2(const uint8_t *indexed, uint8_t *rgba, size_t count)
+{
+	uint8_t tables[3][4][16];
+	palette_tables(tables);
+
+	__m256i lookup[3][4];
+	for (int channel = 0; channel < 3; channel++)
+		for (int table = 0; table < 4; table++)
+			lookup[channel][table] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) tables[channel][table]));
+
+	const __m256i saturate = _mm256_set1_epi8(0x70);
+	const __m256i alpha = _mm256_set1_epi8((char) 0xFF);
+	size_t i = 0;
+
+	for (; i + 32 <= count; i += 32)
+	{
+		__m256i index = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (indexed + i)), _mm256_set1_epi8(0x3F));
+		__m256i select[4];
+		for (int table = 0; table < 4; table++)
+			select[table] = _mm256_adds_epu8(_mm256_xor_si256(index, _mm256_set1_epi8(table << 4)), saturate);
+
+		__m256i color[3];
+		for (int channel = 0; channel < 3; channel++)
+		{
+			color[channel] = _mm256_shuffle_epi8(lookup[channel][0], select[0]);
+			for (int table = 1; table < 4; table++)
+				color[channel] = _mm256_or_si256(color[channel], _mm256_shuffle_epi8(lookup[channel][table], select[table]));
+		}
+
+		__m256i red_green_low = _mm256_unpacklo_epi8(color[0], color[1]);
+		__m256i red_green_high = _mm256_unpackhi_epi8(color[0], color[1]);
+		__m256i blue_alpha_low = _mm256_unpacklo_epi8(color[2], alpha);
+		__m256i blue_alpha_high = _mm256_unpackhi_epi8(color[2], alpha);
+
+		// Each holds 4 pixels from the first 16 and the matching 4 from the second
+		__m256i pixels_0 = _mm256_unpacklo_epi16(red_green_low, blue_alpha_low);
+		__m256i pixels_4 = _mm256_unpackhi_epi16(red_green_low, blue_alpha_low);
+		__m256i pixels_8 = _mm256_unpacklo_epi16(red_green_high, blue_alpha_high);
+		__m256i pixels_12 = _mm256_unpackhi_epi16(red_green_high, blue_alpha_high);
+
+		__m256i *out = (__m256i *) (rgba + i * 4);
+		_mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(pixels_0, pixels_4, 0x20));
+		_mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(pixels_8, pixels_12, 0x20));
+		_mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(pixels_0, pixels_4, 0x31));
+		_mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(pixels_8, pixels_12, 0x31));
+	}
+
+	indexed_to_rgba_scalar(indexed + i, rgba + i * 4, count - i);
+}
+
+static const PixelKernels avx2_kernels = {
+	"avx2", &decode_tiles_avx2, &indexed_to_rgba_avx2
+};
+
+#endif
+
+const PixelKernels *get_pixel_kernels(int isa)
+{
+	switch (isa)
+	{
+		case isa_scalar:
+			return &scalar_kernels;
+#ifdef VIDEO_X86
+		case isa_ssse3:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("ssse3") ? &ssse3_kernels : NULL;
+		case isa_avx2:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2") ? &avx2_kernels : NULL;
+#endif
+		default:
+			return NULL;
+	}
+}
+
+const PixelKernels *best_pixel_kernels()
+{
+	for (int isa = PIXEL_ISA_COUNT - 1; isa > isa_scalar; isa--)
+	{
+		const PixelKernels *kernels = get_pixel_kernels(isa);
+		if (kernels != NULL)
+			return kernels;
+	}
+	return &scalar_kernels;
+}
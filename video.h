@@ -0,0 +1,44 @@
+/*
+
+Pixel kernels
+
+- CHR tiles from two bitplanes to one palette index (0-3) per pixel,
+  64 bytes out for every 16 byte tile
+- Indexed frames (NES palette entries) to RGBA32 through nes_palette
+- SSSE3 and AVX2 versions are picked at runtime from what the CPU
+  supports, the scalar ones are the reference and the fallback
+
+*/
+#ifndef VIDEO_H_
+#define VIDEO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TILE_BYTES   16 // 8x8 pixels, two bitplanes
+#define TILE_PIXELS  64
+#define PIXEL_FRAME_SIZE (256 * 240)
+
+enum pixel_isa {
+	isa_scalar = 0,
+	isa_ssse3  = 1,
+	isa_avx2   = 2,
+};
+#define PIXEL_ISA_COUNT 3
+
+// R, G, B of each of the 64 palette entries
+extern const uint8_t nes_palette[64][3];
+
+typedef struct pixel_kernels {
+	const char *name;
+	void (*decode_tiles)(const uint8_t *chr, uint8_t *pixels, size_t tile_count);
+	void (*indexed_to_rgba)(const uint8_t *indexed, uint8_t *rgba, size_t count); // R, G, B, 255 per pixel
+} PixelKernels;
+
+// NULL when this build or this CPU can't run that instruction set
+const PixelKernels *get_pixel_kernels(int isa);
+
+// The fastest set the CPU supports
+const PixelKernels *best_pixel_kernels();
+
+#endif